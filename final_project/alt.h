@@ -0,0 +1,357 @@
+#pragma once
+
+#include "flat_array.h"
+#include "graph.h"
+#include "parallel.h"
+#include "router_base.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace Graph {
+
+    // A* search guided by landmarks (ALT). Distances from every landmark to
+    // every vertex and back are precomputed, and by the triangle inequality
+    // they bound the distance left to the target from below. Landmarks are
+    // picked one by one, each as far as possible from the ones before. The
+    // precomputed data takes 2 * landmark_count weights per vertex. Search
+    // states are pooled and marked with the query version, as in
+    // BidirectionalDijkstraRouter.
+    template <typename Weight>
+        class AltRouter : public RouterBase<Weight> {
+            private:
+                using Graph = DirectedWeightedGraph<Weight>;
+
+                static constexpr Weight UNREACHABLE = std::numeric_limits<Weight>::max();
+                static constexpr EdgeId NO_EDGE = std::numeric_limits<EdgeId>::max();
+
+                // Weights and edges are valid only where versions equal the
+                // version of the current query.
+                struct SearchState {
+                    uint32_t version = 0;
+                    std::vector<uint32_t> versions;
+                    std::vector<Weight> weights;
+                    std::vector<EdgeId> prev_edges;
+
+                    explicit SearchState(size_t vertex_count);
+                    // Invalidates the results of the previous query.
+                    void NextVersion();
+                };
+
+            public:
+                static const size_t DEFAULT_LANDMARK_COUNT = 16;
+
+                // Vertex-major: the distances of vertex v are at
+                // [v * landmark_count, (v + 1) * landmark_count).
+                struct Landmarks {
+                    FlatArray<VertexId> vertices;
+                    FlatArray<Weight> from_landmark;
+                    FlatArray<Weight> to_landmark;
+                };
+
+                explicit AltRouter(const Graph& graph, size_t landmark_count = DEFAULT_LANDMARK_COUNT,
+                                   size_t thread_count = DefaultThreadCount());
+                // Shares the landmarks of another router over the same graph.
+                AltRouter(const Graph& graph, std::shared_ptr<const Landmarks> landmarks)
+                    : graph_(graph), landmarks_(std::move(landmarks)) {}
+
+                using typename RouterBase<Weight>::RouteInfo;
+
+                std::optional<RouteInfo> BuildRoute(VertexId from, VertexId to) const override;
+                // Landmark distances are not updated, a changed graph gets
+                // new landmarks.
+                std::unique_ptr<RouterBase<Weight>> Clone(const Graph& graph) const override {
+                    return std::make_unique<AltRouter>(graph, landmarks_);
+                }
+
+                const FlatArray<VertexId>& GetLandmarks() const {
+                    return landmarks_->vertices;
+                }
+                const Landmarks& GetLandmarkDistances() const {
+                    return *landmarks_;
+                }
+
+            private:
+                // Plain Dijkstra over outgoing or incoming edges.
+                static std::vector<Weight> ComputeDistances(const Graph& graph, const ReverseIncidence<Weight>* reverse_incidence,
+                                                            VertexId source);
+                static std::shared_ptr<const Landmarks> BuildLandmarks(const Graph& graph, size_t landmark_count,
+                                                                       size_t thread_count);
+
+                // Lower bound of the distance from vertex to target, nullopt
+                // if the landmarks show that there is no route.
+                std::optional<Weight> GetLowerBound(VertexId vertex, VertexId target) const;
+
+                // Takes a free state from the pool, there are never more of
+                // them than concurrent queries.
+                std::unique_ptr<SearchState> AcquireState() const;
+                void ReleaseState(std::unique_ptr<SearchState> state) const;
+
+                const Graph& graph_;
+                std::shared_ptr<const Landmarks> landmarks_;
+
+                mutable std::mutex states_mutex_;
+                mutable std::vector<std::unique_ptr<SearchState>> free_states_;
+        };
+
+
+    template <typename Weight>
+        AltRouter<Weight>::AltRouter(const Graph& graph, size_t landmark_count, size_t thread_count)
+        : graph_(graph),
+        landmarks_(BuildLandmarks(graph, landmark_count, thread_count))
+    {
+    }
+
+    template <typename Weight>
+        AltRouter<Weight>::SearchState::SearchState(size_t vertex_count)
+        : versions(vertex_count),
+        weights(vertex_count),
+        prev_edges(vertex_count)
+    {
+    }
+
+    template <typename Weight>
+        void AltRouter<Weight>::SearchState::NextVersion() {
+            if (++version == 0) {
+                // Wrapped around, old marks could pass for new ones.
+                std::fill(versions.begin(), versions.end(), 0);
+                version = 1;
+            }
+        }
+
+    template <typename Weight>
+        std::vector<Weight> AltRouter<Weight>::ComputeDistances(const Graph& graph, const ReverseIncidence<Weight>* reverse_incidence,
+                                                                VertexId source) {
+            std::vector<Weight> distances(graph.GetVertexCount(), UNREACHABLE);
+            using QueueItem = std::pair<Weight, VertexId>;
+            std::priority_queue<QueueItem, std::vector<QueueItem>, std::greater<QueueItem>> queue;
+            distances[source] = 0;
+            queue.push({0, source});
+            while (!queue.empty()) {
+                const auto [distance, vertex] = queue.top();
+                queue.pop();
+                if (distance > distances[vertex]) {
+                    continue;
+                }
+                const auto relax = [&distances, &queue, distance = distance](Weight edge_weight, VertexId next) {
+                    if (distance + edge_weight < distances[next]) {
+                        distances[next] = distance + edge_weight;
+                        queue.push({distances[next], next});
+                    }
+                };
+                if (reverse_incidence) {
+                    for (const EdgeId edge_id : reverse_incidence->GetIncomingEdges(vertex)) {
+                        const auto& edge = graph.GetEdge(edge_id);
+                        relax(edge.weight, edge.from);
+                    }
+                } else {
+                    for (const EdgeId edge_id : graph.GetIncidentEdges(vertex)) {
+                        const auto& edge = graph.GetEdge(edge_id);
+                        relax(edge.weight, edge.to);
+                    }
+                }
+            }
+            return distances;
+        }
+
+    template <typename Weight>
+        std::shared_ptr<const typename AltRouter<Weight>::Landmarks> AltRouter<Weight>::BuildLandmarks(
+                const Graph& graph, size_t landmark_count, size_t thread_count) {
+            const size_t vertex_count = graph.GetVertexCount();
+            landmark_count = std::min(landmark_count, vertex_count);
+            auto landmarks = std::make_shared<Landmarks>();
+            if (landmark_count == 0) {
+                return landmarks;
+            }
+
+            // Farthest point selection: every next landmark is the vertex
+            // farthest from its closest landmark. Vertices no landmark
+            // reaches come first, as infinitely far: the search restarts
+            // from the first of them, the seed, and takes the uncovered
+            // vertex farthest from it. So landmarks spread over the whole
+            // graph even where vertex 0 reaches little. A seed that reaches
+            // no other vertex is passed over, it would make a useless
+            // landmark.
+            std::vector<VertexId> vertices;
+            std::vector<std::vector<Weight>> from_landmark;
+            std::vector<Weight> closest(vertex_count, UNREACHABLE);
+            VertexId seed = 0;
+            while (vertices.size() < landmark_count) {
+                while (seed < vertex_count && closest[seed] != UNREACHABLE) {
+                    ++seed;
+                }
+                VertexId farthest = 0;
+                if (seed < vertex_count) {
+                    const std::vector<Weight> from_seed = ComputeDistances(graph, nullptr, seed);
+                    farthest = seed;
+                    bool reaches_other = false;
+                    for (VertexId vertex = 0; vertex < vertex_count; ++vertex) {
+                        if (vertex == seed || from_seed[vertex] == UNREACHABLE) {
+                            continue;
+                        }
+                        reaches_other = true;
+                        if (closest[vertex] == UNREACHABLE && from_seed[vertex] > from_seed[farthest]) {
+                            farthest = vertex;
+                        }
+                    }
+                    ++seed;
+                    if (!reaches_other) {
+                        continue;
+                    }
+                } else {
+                    for (VertexId vertex = 1; vertex < vertex_count; ++vertex) {
+                        const bool is_farther = closest[vertex] != UNREACHABLE
+                                && (closest[farthest] == UNREACHABLE || closest[vertex] > closest[farthest]);
+                        if (is_farther) {
+                            farthest = vertex;
+                        }
+                    }
+                    if (closest[farthest] == 0 || closest[farthest] == UNREACHABLE) {
+                        break;
+                    }
+                }
+                vertices.push_back(farthest);
+                from_landmark.push_back(ComputeDistances(graph, nullptr, farthest));
+                for (VertexId vertex = 0; vertex < vertex_count; ++vertex) {
+                    closest[vertex] = std::min(closest[vertex], from_landmark.back()[vertex]);
+                }
+            }
+            landmark_count = vertices.size();
+
+            const ReverseIncidence<Weight> reverse_incidence(graph);
+            std::vector<std::vector<Weight>> to_landmark(landmark_count);
+            ParallelFor(landmark_count, thread_count, [&](size_t landmark_idx) {
+                to_landmark[landmark_idx] = ComputeDistances(graph, &reverse_incidence, vertices[landmark_idx]);
+            });
+
+            std::vector<Weight> from_distances(vertex_count * landmark_count);
+            std::vector<Weight> to_distances(vertex_count * landmark_count);
+            for (VertexId vertex = 0; vertex < vertex_count; ++vertex) {
+                for (size_t landmark_idx = 0; landmark_idx < landmark_count; ++landmark_idx) {
+                    from_distances[vertex * landmark_count + landmark_idx] = from_landmark[landmark_idx][vertex];
+                    to_distances[vertex * landmark_count + landmark_idx] = to_landmark[landmark_idx][vertex];
+                }
+            }
+            landmarks->vertices = std::move(vertices);
+            landmarks->from_landmark = std::move(from_distances);
+            landmarks->to_landmark = std::move(to_distances);
+            return landmarks;
+        }
+
+    template <typename Weight>
+        std::optional<Weight> AltRouter<Weight>::GetLowerBound(VertexId vertex, VertexId target) const {
+            const size_t landmark_count = landmarks_->vertices.size();
+            const Weight* from_vertex = landmarks_->from_landmark.data() + vertex * landmark_count;
+            const Weight* from_target = landmarks_->from_landmark.data() + target * landmark_count;
+            const Weight* to_vertex = landmarks_->to_landmark.data() + vertex * landmark_count;
+            const Weight* to_target = landmarks_->to_landmark.data() + target * landmark_count;
+
+            Weight bound = 0;
+            for (size_t landmark_idx = 0; landmark_idx < landmark_count; ++landmark_idx) {
+                // d(vertex, target) >= d(vertex, L) - d(target, L); a vertex
+                // that cannot reach L cannot reach a target that can.
+                if (to_target[landmark_idx] != UNREACHABLE) {
+                    if (to_vertex[landmark_idx] == UNREACHABLE) {
+                        return std::nullopt;
+                    }
+                    bound = std::max(bound, to_vertex[landmark_idx] - to_target[landmark_idx]);
+                }
+                // d(vertex, target) >= d(L, target) - d(L, vertex).
+                if (from_target[landmark_idx] != UNREACHABLE && from_vertex[landmark_idx] != UNREACHABLE) {
+                    bound = std::max(bound, from_target[landmark_idx] - from_vertex[landmark_idx]);
+                }
+            }
+            return bound;
+        }
+
+    template <typename Weight>
+        std::unique_ptr<typename AltRouter<Weight>::SearchState> AltRouter<Weight>::AcquireState() const {
+            {
+                std::lock_guard<std::mutex> guard(states_mutex_);
+                if (!free_states_.empty()) {
+                    auto state = std::move(free_states_.back());
+                    free_states_.pop_back();
+                    return state;
+                }
+            }
+            return std::make_unique<SearchState>(graph_.GetVertexCount());
+        }
+
+    template <typename Weight>
+        void AltRouter<Weight>::ReleaseState(std::unique_ptr<SearchState> state) const {
+            std::lock_guard<std::mutex> guard(states_mutex_);
+            free_states_.push_back(std::move(state));
+        }
+
+    template <typename Weight>
+        std::optional<typename AltRouter<Weight>::RouteInfo> AltRouter<Weight>::BuildRoute(VertexId from, VertexId to) const {
+            // Items are ordered by weight plus the lower bound of the rest,
+            // and keep the weight to skip items that were improved upon.
+            using QueueItem = std::tuple<Weight, Weight, VertexId>;
+            std::priority_queue<QueueItem, std::vector<QueueItem>, std::greater<QueueItem>> queue;
+            const auto start_bound = GetLowerBound(from, to);
+            if (!start_bound) {
+                return std::nullopt;
+            }
+            auto state = AcquireState();
+            state->NextVersion();
+            const uint32_t version = state->version;
+            auto& versions = state->versions;
+            auto& weights = state->weights;
+            auto& prev_edges = state->prev_edges;
+
+            versions[from] = version;
+            weights[from] = 0;
+            prev_edges[from] = NO_EDGE;
+            queue.push({*start_bound, 0, from});
+            bool is_found = false;
+            while (!queue.empty()) {
+                const auto [key, weight, vertex] = queue.top();
+                queue.pop();
+                if (weight > weights[vertex]) {
+                    continue;
+                }
+                if (vertex == to) {
+                    is_found = true;
+                    break;
+                }
+                for (const EdgeId edge_id : graph_.GetIncidentEdges(vertex)) {
+                    const auto& edge = graph_.GetEdge(edge_id);
+                    const Weight candidate_weight = weight + edge.weight;
+                    if (versions[edge.to] == version && candidate_weight >= weights[edge.to]) {
+                        continue;
+                    }
+                    const auto bound = GetLowerBound(edge.to, to);
+                    if (!bound) {
+                        continue;
+                    }
+                    versions[edge.to] = version;
+                    weights[edge.to] = candidate_weight;
+                    prev_edges[edge.to] = edge_id;
+                    queue.push({candidate_weight + *bound, candidate_weight, edge.to});
+                }
+            }
+
+            std::optional<RouteInfo> route;
+            if (is_found) {
+                std::vector<EdgeId> edges;
+                for (EdgeId edge_id = prev_edges[to]; edge_id != NO_EDGE; edge_id = prev_edges[graph_.GetEdge(edge_id).from]) {
+                    edges.push_back(edge_id);
+                }
+                std::reverse(edges.begin(), edges.end());
+                route = this->SaveRoute(weights[to], std::move(edges));
+            }
+            ReleaseState(std::move(state));
+            return route;
+        }
+
+}
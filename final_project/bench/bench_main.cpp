@@ -0,0 +1,187 @@
+// Times every stage of processing a synthetic city and prints the results
+// as JSON. Built from the project directory together with every project
+// source except main.cpp:
+//
+//     g++ -std=c++17 -O2 -I. bench/*.cpp $(ls *.cpp | grep -v main.cpp) -o bench -lpthread
+//
+// Usage: bench run [PARAMS_FILE] [REPETITIONS]
+//        bench generate [PARAMS_FILE]
+// PARAMS_FILE holds a JSON object with CityParams fields. "generate" prints
+// the input document itself, so the main binary can be run on it.
+#include "city_generator.h"
+#include "json.h"
+#include "request.h"
+#include "transport_system.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+    class StageTimes {
+    public:
+        template <typename Func>
+        auto Measure(const string& stage, Func func) {
+            const auto start = chrono::steady_clock::now();
+            const auto finish = [&] {
+                Add(stage, chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+            };
+            if constexpr (is_void_v<decltype(func())>) {
+                func();
+                finish();
+            } else {
+                auto result = func();
+                finish();
+                return result;
+            }
+        }
+
+        // Stages in the order they first ran, with min, median and max of
+        // their durations in milliseconds.
+        Json::Node ToJson() const {
+            vector<Json::Node> result;
+            for (const string& stage : order_) {
+                vector<double> durations = durations_.at(stage);
+                sort(durations.begin(), durations.end());
+                result.push_back(Json::Node(map<string, Json::Node>{
+                    {"stage", Json::Node(stage)},
+                    {"min_ms", Json::Node(durations.front())},
+                    {"median_ms", Json::Node(durations[durations.size() / 2])},
+                    {"max_ms", Json::Node(durations.back())}
+                }));
+            }
+            return Json::Node(move(result));
+        }
+
+    private:
+        void Add(const string& stage, double duration_ms) {
+            auto& durations = durations_[stage];
+            if (durations.empty()) {
+                order_.push_back(stage);
+            }
+            durations.push_back(duration_ms);
+        }
+
+        vector<string> order_;
+        map<string, vector<double>> durations_;
+    };
+
+    // One pass over the whole input. Graph and router are timed apart: the
+    // graph is built with the search router, which costs nothing to make,
+    // and then the configured router is made over it.
+    void RunOnce(const string& input, StageTimes& times, map<string, size_t>& counts) {
+        const Json::Document document = times.Measure("json_load", [&input] {
+            istringstream stream(input);
+            return Json::Load(stream);
+        });
+
+        const auto requests = times.Measure("parse_requests", [&document] {
+            vector<RequestHolder> stat_requests;
+            for (const auto& request_json : ReadStatRequestsJson(document)) {
+                stat_requests.push_back(ParseReadRequest(request_json));
+            }
+            return make_pair(ReadWriteRequests(document), move(stat_requests));
+        });
+        const auto& stat_requests_json = ReadStatRequestsJson(document);
+
+        TransportSystem ts;
+        times.Measure("process_write_requests", [&] {
+            ProcessWriteRequests(requests.first, ts);
+        });
+        const auto router_type = ts.GetRouterType();
+        ts.SetRouterType(TransportSystem::RouterType::DIJKSTRA);
+        times.Measure("build_graph", [&ts] {
+            ts.BuildGraph();
+        });
+        ts.SetRouterType(router_type);
+        times.Measure("build_router", [&ts] {
+            ts.MakeRouter();
+        });
+
+        map<string, vector<RequestHolder>> requests_by_type;
+        for (size_t request_idx = 0; request_idx < requests.second.size(); ++request_idx) {
+            const string& type = stat_requests_json[request_idx].AsMap().at("type").AsString();
+            requests_by_type[type].push_back(requests.second[request_idx]);
+        }
+        vector<Json::Node> responses;
+        for (const auto& [type, type_requests] : requests_by_type) {
+            counts[type] = type_requests.size();
+            const Json::Node type_responses = times.Measure("stat_" + type, [&ts, &type_requests = type_requests] {
+                return ProcessReadRequests(type_requests, ts);
+            });
+            for (const auto& response : type_responses.AsVector()) {
+                responses.push_back(response);
+            }
+        }
+
+        times.Measure("print_responses", [&responses] {
+            ostringstream output;
+            output.precision(6);
+            PrintResponses(Json::Node(move(responses)), output);
+            return output.str().size();
+        });
+    }
+
+    CityParams ReadParamsFile(const char* path) {
+        ifstream input(path);
+        if (!input) {
+            throw runtime_error(string("cannot open ") + path);
+        }
+        return ReadCityParams(Json::Load(input).GetRoot());
+    }
+
+}
+
+int main(int argc, const char* argv[]) {
+    const string mode = argc > 1 ? argv[1] : "";
+    if (mode != "run" && mode != "generate") {
+        cerr << "Usage: " << argv[0] << " run [PARAMS_FILE] [REPETITIONS]" << endl;
+        cerr << "       " << argv[0] << " generate [PARAMS_FILE]" << endl;
+        return 1;
+    }
+    const CityParams params = argc > 2 ? ReadParamsFile(argv[2]) : CityParams{};
+
+    StageTimes times;
+    const Json::Node city = times.Measure("generate", [&params] {
+        return GenerateCity(params);
+    });
+    // Coordinates need more digits than the six of the answers.
+    ostringstream city_text;
+    city_text.precision(10);
+    city_text << city;
+    if (mode == "generate") {
+        cout << city_text.str();
+        return 0;
+    }
+
+    const int repetitions = argc > 3 ? max(1, atoi(argv[3])) : 3;
+    map<string, size_t> counts;
+    for (int i = 0; i < repetitions; ++i) {
+        RunOnce(city_text.str(), times, counts);
+    }
+
+    map<string, Json::Node> request_counts;
+    for (const auto& [type, count] : counts) {
+        request_counts[type] = Json::Node(double(count));
+    }
+    cout.precision(6);
+    cout << Json::Node(map<string, Json::Node>{
+        {"params", CityParamsToJson(params)},
+        {"input_bytes", Json::Node(double(city_text.str().size()))},
+        {"repetitions", Json::Node(double(repetitions))},
+        {"thread_count", Json::Node(double(DefaultThreadCount()))},
+        {"stat_request_counts", Json::Node(move(request_counts))},
+        {"stages", times.ToJson()}
+    }) << endl;
+
+    return 0;
+}
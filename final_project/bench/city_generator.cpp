@@ -0,0 +1,338 @@
+#include "city_generator.h"
+#include "geo.h"
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <random>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+    class Random {
+    public:
+        explicit Random(uint64_t seed) : engine_(seed) {}
+
+        // In [0, 1).
+        double Uniform() {
+            return (engine_() >> 11) * (1.0 / (uint64_t(1) << 53));
+        }
+        double Uniform(double from, double to) {
+            return from + (to - from) * Uniform();
+        }
+        // In [0, bound).
+        size_t Index(size_t bound) {
+            return min<size_t>(bound - 1, Uniform() * bound);
+        }
+        // In [from, to].
+        size_t Range(size_t from, size_t to) {
+            return from + Index(to - from + 1);
+        }
+        // Rounds randomly so that the average is value.
+        size_t Round(double value) {
+            const double whole = floor(value);
+            return size_t(whole) + (Uniform() < value - whole ? 1 : 0);
+        }
+
+    private:
+        mt19937_64 engine_;
+    };
+
+    struct Point {
+        double lat, lon;
+    };
+
+    const double CENTER_LAT = 55.75;
+    const double CENTER_LON = 37.62;
+    const double CITY_RADIUS = 0.15;  // degrees
+
+    // Stops gather around district centres, denser towards the middle of
+    // the city.
+    vector<Point> PlaceStops(const CityParams& params, Random& random) {
+        const size_t district_count = max<size_t>(1, sqrt(double(params.stop_count)) / 4);
+        vector<Point> districts;
+        for (size_t i = 0; i < district_count; ++i) {
+            const double radius = CITY_RADIUS * sqrt(random.Uniform());
+            const double angle = random.Uniform(0, 2 * M_PI);
+            districts.push_back({CENTER_LAT + radius * sin(angle), CENTER_LON + 2 * radius * cos(angle)});
+        }
+
+        vector<Point> stops;
+        stops.reserve(params.stop_count);
+        for (size_t i = 0; i < params.stop_count; ++i) {
+            const Point& district = districts[random.Index(district_count)];
+            // A sum of uniforms is close enough to a normal spread.
+            const double dlat = (random.Uniform() + random.Uniform() + random.Uniform() - 1.5) * CITY_RADIUS / 4;
+            const double dlon = (random.Uniform() + random.Uniform() + random.Uniform() - 1.5) * CITY_RADIUS / 2;
+            stops.push_back({district.lat + dlat, district.lon + dlon});
+        }
+        return stops;
+    }
+
+    // Uniform grid over the stops for finding the ones nearby.
+    class StopGrid {
+    public:
+        explicit StopGrid(const vector<Point>& stops) : stops_(stops) {
+            // About four stops per cell.
+            const size_t side = max<size_t>(1, sqrt(stops.size() / 4.0));
+            min_lat_ = max_lat_ = stops.empty() ? 0 : stops[0].lat;
+            min_lon_ = max_lon_ = stops.empty() ? 0 : stops[0].lon;
+            for (const Point& stop : stops) {
+                min_lat_ = min(min_lat_, stop.lat);
+                max_lat_ = max(max_lat_, stop.lat);
+                min_lon_ = min(min_lon_, stop.lon);
+                max_lon_ = max(max_lon_, stop.lon);
+            }
+            side_ = side;
+            cells_.resize(side * side);
+            for (size_t stop_idx = 0; stop_idx < stops.size(); ++stop_idx) {
+                const auto [row, col] = GetCell(stops[stop_idx]);
+                cells_[row * side_ + col].push_back(stop_idx);
+            }
+        }
+
+        // Stops in the cell of the given one and the cells around it.
+        vector<size_t> GetNeighbours(size_t stop_idx) const {
+            const auto [row, col] = GetCell(stops_[stop_idx]);
+            vector<size_t> result;
+            for (size_t r = row > 0 ? row - 1 : 0; r <= min(row + 1, side_ - 1); ++r) {
+                for (size_t c = col > 0 ? col - 1 : 0; c <= min(col + 1, side_ - 1); ++c) {
+                    for (size_t other_idx : cells_[r * side_ + c]) {
+                        if (other_idx != stop_idx) {
+                            result.push_back(other_idx);
+                        }
+                    }
+                }
+            }
+            return result;
+        }
+
+    private:
+        pair<size_t, size_t> GetCell(const Point& stop) const {
+            const auto cell = [this](double value, double from, double to) {
+                return to > from ? min<size_t>(side_ - 1, (value - from) / (to - from) * side_) : 0;
+            };
+            return {cell(stop.lat, min_lat_, max_lat_), cell(stop.lon, min_lon_, max_lon_)};
+        }
+
+        const vector<Point>& stops_;
+        size_t side_;
+        double min_lat_, max_lat_, min_lon_, max_lon_;
+        vector<vector<size_t>> cells_;
+    };
+
+    // A walk through nearby stops, jumping anywhere when it is stuck.
+    vector<size_t> MakeRoute(const CityParams& params, const StopGrid& grid, size_t stop_count, Random& random) {
+        const size_t length = random.Range(
+                max<size_t>(2, params.min_stops_per_bus), max(params.min_stops_per_bus, params.max_stops_per_bus));
+        vector<size_t> route = {random.Index(stop_count)};
+        set<size_t> visited = {route[0]};
+        while (route.size() < length && visited.size() < stop_count) {
+            vector<size_t> candidates;
+            for (size_t other_idx : grid.GetNeighbours(route.back())) {
+                if (!visited.count(other_idx)) {
+                    candidates.push_back(other_idx);
+                }
+            }
+            size_t next = candidates.empty() ? random.Index(stop_count) : candidates[random.Index(candidates.size())];
+            while (visited.count(next)) {
+                next = random.Index(stop_count);
+            }
+            route.push_back(next);
+            visited.insert(next);
+        }
+        return route;
+    }
+
+    string StopName(size_t stop_idx) {
+        return "Stop " + to_string(stop_idx);
+    }
+    string BusName(size_t bus_idx) {
+        return "Bus " + to_string(bus_idx);
+    }
+
+    Json::Node MakeStatRequest(const CityParams& params, size_t request_id, Random& random) {
+        const double total = params.bus_request_share + params.stop_request_share
+                + params.route_request_share + params.time_matrix_request_share + params.isochrone_request_share;
+        double choice = random.Uniform() * total;
+        map<string, Json::Node> request = {{"id", Json::Node(double(request_id))}};
+        // A few names miss, as in production traffic.
+        const auto stop_name = [&] {
+            return random.Uniform() < 0.01 ? string("Unknown stop") : StopName(random.Index(params.stop_count));
+        };
+
+        if ((choice -= params.bus_request_share) < 0 || params.stop_count == 0) {
+            request["type"] = Json::Node(string("Bus"));
+            request["name"] = Json::Node(random.Uniform() < 0.01
+                                         ? string("Unknown bus") : BusName(random.Index(max<size_t>(1, params.bus_count))));
+        } else if ((choice -= params.stop_request_share) < 0) {
+            request["type"] = Json::Node(string("Stop"));
+            request["name"] = Json::Node(stop_name());
+        } else if ((choice -= params.route_request_share) < 0) {
+            request["type"] = Json::Node(string("Route"));
+            request["from"] = Json::Node(stop_name());
+            request["to"] = Json::Node(stop_name());
+        } else if ((choice -= params.isochrone_request_share) < 0) {
+            request["type"] = Json::Node(string("Isochrone"));
+            request["from"] = Json::Node(stop_name());
+            request["max_time"] = Json::Node(params.isochrone_max_time);
+        } else {
+            request["type"] = Json::Node(string("TimeMatrix"));
+            vector<Json::Node> from, to;
+            for (size_t i = 0; i < params.time_matrix_size; ++i) {
+                from.push_back(Json::Node(StopName(random.Index(params.stop_count))));
+                to.push_back(Json::Node(StopName(random.Index(params.stop_count))));
+            }
+            request["from"] = Json::Node(move(from));
+            request["to"] = Json::Node(move(to));
+        }
+        return Json::Node(move(request));
+    }
+
+}
+
+Json::Node GenerateCity(const CityParams& params) {
+    Random random(params.seed);
+    const vector<Point> stops = PlaceStops(params, random);
+    const StopGrid grid(stops);
+
+    vector<Json::Node> base_requests;
+    // Road distances are mostly known between consecutive stops of a route.
+    vector<set<size_t>> route_neighbours(stops.size());
+    for (size_t bus_idx = 0; stops.size() > 0 && bus_idx < params.bus_count; ++bus_idx) {
+        const auto route = MakeRoute(params, grid, stops.size(), random);
+        for (size_t i = 1; i < route.size(); ++i) {
+            route_neighbours[route[i - 1]].insert(route[i]);
+        }
+
+        const bool is_roundtrip = random.Uniform() < params.round_bus_ratio;
+        vector<Json::Node> stop_names;
+        for (size_t stop_idx : route) {
+            stop_names.push_back(Json::Node(StopName(stop_idx)));
+        }
+        if (is_roundtrip) {
+            stop_names.push_back(stop_names.front());
+            route_neighbours[route.back()].insert(route.front());
+        }
+        base_requests.push_back(Json::Node(map<string, Json::Node>{
+            {"type", Json::Node(string("Bus"))},
+            {"name", Json::Node(BusName(bus_idx))},
+            {"stops", Json::Node(move(stop_names))},
+            {"is_roundtrip", Json::Node(is_roundtrip)}
+        }));
+    }
+
+    for (size_t stop_idx = 0; stop_idx < stops.size(); ++stop_idx) {
+        vector<size_t> candidates(route_neighbours[stop_idx].begin(), route_neighbours[stop_idx].end());
+        const size_t distance_count = random.Round(params.road_distance_density);
+        if (candidates.size() < distance_count) {
+            for (size_t other_idx : grid.GetNeighbours(stop_idx)) {
+                if (!route_neighbours[stop_idx].count(other_idx)) {
+                    candidates.push_back(other_idx);
+                }
+            }
+        }
+        map<string, Json::Node> road_distances;
+        for (size_t i = 0; i < min(distance_count, candidates.size()); ++i) {
+            const Point& from = stops[stop_idx];
+            const Point& to = stops[candidates[i]];
+            // Roads wind, so they are a bit longer than the straight line.
+            const double distance = CalculateGeoDistance(from.lat, from.lon, to.lat, to.lon) * random.Uniform(1.05, 1.6);
+            road_distances[StopName(candidates[i])] = Json::Node(round(max(1.0, distance)));
+        }
+        base_requests.push_back(Json::Node(map<string, Json::Node>{
+            {"type", Json::Node(string("Stop"))},
+            {"name", Json::Node(StopName(stop_idx))},
+            {"latitude", Json::Node(stops[stop_idx].lat)},
+            {"longitude", Json::Node(stops[stop_idx].lon)},
+            {"road_distances", Json::Node(move(road_distances))}
+        }));
+    }
+    // Real inputs interleave stops and buses.
+    for (size_t i = base_requests.size(); i > 1; --i) {
+        swap(base_requests[i - 1], base_requests[random.Index(i)]);
+    }
+
+    vector<Json::Node> stat_requests;
+    for (size_t request_id = 0; request_id < params.stat_request_count; ++request_id) {
+        stat_requests.push_back(MakeStatRequest(params, request_id, random));
+    }
+
+    return Json::Node(map<string, Json::Node>{
+        {"routing_settings", Json::Node(map<string, Json::Node>{
+            {"bus_wait_time", Json::Node(params.bus_wait_time)},
+            {"bus_velocity", Json::Node(params.bus_velocity)},
+            {"router", Json::Node(params.router)},
+            {"vertex_order", Json::Node(params.vertex_order)}
+        })},
+        {"base_requests", Json::Node(move(base_requests))},
+        {"stat_requests", Json::Node(move(stat_requests))}
+    });
+}
+
+CityParams ReadCityParams(const Json::Node& node) {
+    CityParams params;
+    const auto& settings = node.AsMap();
+    const auto read_double = [&settings](const string& key, double& value) {
+        if (auto it = settings.find(key); it != settings.end()) {
+            value = it->second.AsDouble();
+        }
+    };
+    const auto read_size = [&settings](const string& key, auto& value) {
+        if (auto it = settings.find(key); it != settings.end()) {
+            value = it->second.AsInt();
+        }
+    };
+    read_size("seed", params.seed);
+    read_size("stop_count", params.stop_count);
+    read_size("bus_count", params.bus_count);
+    read_size("min_stops_per_bus", params.min_stops_per_bus);
+    read_size("max_stops_per_bus", params.max_stops_per_bus);
+    read_double("round_bus_ratio", params.round_bus_ratio);
+    read_double("road_distance_density", params.road_distance_density);
+    read_double("bus_wait_time", params.bus_wait_time);
+    read_double("bus_velocity", params.bus_velocity);
+    if (auto it = settings.find("router"); it != settings.end()) {
+        params.router = it->second.AsString();
+    }
+    if (auto it = settings.find("vertex_order"); it != settings.end()) {
+        params.vertex_order = it->second.AsString();
+    }
+    read_size("stat_request_count", params.stat_request_count);
+    read_double("bus_request_share", params.bus_request_share);
+    read_double("stop_request_share", params.stop_request_share);
+    read_double("route_request_share", params.route_request_share);
+    read_double("time_matrix_request_share", params.time_matrix_request_share);
+    read_size("time_matrix_size", params.time_matrix_size);
+    read_double("isochrone_request_share", params.isochrone_request_share);
+    read_double("isochrone_max_time", params.isochrone_max_time);
+    return params;
+}
+
+Json::Node CityParamsToJson(const CityParams& params) {
+    return Json::Node(map<string, Json::Node>{
+        {"seed", Json::Node(double(params.seed))},
+        {"stop_count", Json::Node(double(params.stop_count))},
+        {"bus_count", Json::Node(double(params.bus_count))},
+        {"min_stops_per_bus", Json::Node(double(params.min_stops_per_bus))},
+        {"max_stops_per_bus", Json::Node(double(params.max_stops_per_bus))},
+        {"round_bus_ratio", Json::Node(params.round_bus_ratio)},
+        {"road_distance_density", Json::Node(params.road_distance_density)},
+        {"bus_wait_time", Json::Node(params.bus_wait_time)},
+        {"bus_velocity", Json::Node(params.bus_velocity)},
+        {"router", Json::Node(params.router)},
+        {"vertex_order", Json::Node(params.vertex_order)},
+        {"stat_request_count", Json::Node(double(params.stat_request_count))},
+        {"bus_request_share", Json::Node(params.bus_request_share)},
+        {"stop_request_share", Json::Node(params.stop_request_share)},
+        {"route_request_share", Json::Node(params.route_request_share)},
+        {"time_matrix_request_share", Json::Node(params.time_matrix_request_share)},
+        {"time_matrix_size", Json::Node(double(params.time_matrix_size))},
+        {"isochrone_request_share", Json::Node(params.isochrone_request_share)},
+        {"isochrone_max_time", Json::Node(params.isochrone_max_time)}
+    });
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include "json.h"
+
+#include <cstdint>
+#include <string>
+
+// Synthetic city of the shape of production inputs. The same parameters
+// always give the same document: every random value comes from a seeded
+// std::mt19937_64, whose output is fixed by the standard, and never from
+// the implementation-defined std distributions.
+struct CityParams {
+    uint64_t seed = 1;
+
+    size_t stop_count = 1000;
+    size_t bus_count = 100;
+    // Stops on one bus route before a straight route is mirrored or a round
+    // route is closed.
+    size_t min_stops_per_bus = 5;
+    size_t max_stops_per_bus = 30;
+    double round_bus_ratio = 0.5;
+    // Average number of explicit road distances per stop, the rest of the
+    // stop pairs fall back to the geographic distance.
+    double road_distance_density = 2.0;
+
+    double bus_wait_time = 6;
+    double bus_velocity = 40;
+    std::string router = "all_pairs";
+    std::string vertex_order = "input";
+
+    // Stat requests and the shares of their types, the shares need not sum
+    // to one. Time matrices are time_matrix_size stops square.
+    size_t stat_request_count = 2000;
+    double bus_request_share = 0.2;
+    double stop_request_share = 0.2;
+    double route_request_share = 0.6;
+    double time_matrix_request_share = 0.0;
+    size_t time_matrix_size = 10;
+    // Isochrones reach isochrone_max_time minutes from a random stop.
+    double isochrone_request_share = 0.0;
+    double isochrone_max_time = 30;
+};
+
+// Document in the input format: routing_settings, base_requests and
+// stat_requests.
+Json::Node GenerateCity(const CityParams& params);
+
+// Reads the parameters from a JSON object, missing keys keep the defaults.
+CityParams ReadCityParams(const Json::Node& node);
+Json::Node CityParamsToJson(const CityParams& params);
@@ -0,0 +1,223 @@
+#pragma once
+
+#include "graph.h"
+#include "router_base.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <utility>
+#include <vector>
+
+namespace Graph {
+
+    // Two Dijkstra searches per query, forward from the source over outgoing
+    // edges and backward from the target over incoming ones. Every edge that
+    // joins the two searches gives a candidate route; the best one is final
+    // once the two queue tops together weigh no less than it. Search states
+    // are pooled and marked with the query version, so a query touches only
+    // the vertices it reaches.
+    template <typename Weight>
+        class BidirectionalDijkstraRouter : public RouterBase<Weight> {
+            private:
+                using Graph = DirectedWeightedGraph<Weight>;
+
+                static constexpr EdgeId NO_EDGE = std::numeric_limits<EdgeId>::max();
+
+                // Weights and edges of one direction are valid only where
+                // versions equal the version of the current query.
+                struct SearchState {
+                    uint32_t version = 0;
+                    std::vector<uint32_t> forward_versions;
+                    std::vector<Weight> forward_weights;
+                    std::vector<EdgeId> forward_edges;    // last one from the source
+                    std::vector<uint32_t> backward_versions;
+                    std::vector<Weight> backward_weights;
+                    std::vector<EdgeId> backward_edges;   // first one to the target
+
+                    explicit SearchState(size_t vertex_count);
+                    // Invalidates the results of the previous query.
+                    void NextVersion();
+                };
+
+            public:
+                explicit BidirectionalDijkstraRouter(const Graph& graph)
+                    : graph_(graph), reverse_incidence_(graph) {}
+
+                // Weights are read at query time, only new vertices and edges
+                // call for new incoming lists.
+                bool Update(const GraphChanges<Weight>& changes) override;
+                std::unique_ptr<RouterBase<Weight>> Clone(const Graph& graph) const override {
+                    return std::make_unique<BidirectionalDijkstraRouter>(graph);
+                }
+
+                using typename RouterBase<Weight>::RouteInfo;
+
+                std::optional<RouteInfo> BuildRoute(VertexId from, VertexId to) const override;
+
+            private:
+                // Takes a free state from the pool, there are never more of
+                // them than concurrent queries.
+                std::unique_ptr<SearchState> AcquireState() const;
+                void ReleaseState(std::unique_ptr<SearchState> state) const;
+
+                const Graph& graph_;
+                ReverseIncidence<Weight> reverse_incidence_;
+
+                mutable std::mutex states_mutex_;
+                mutable std::vector<std::unique_ptr<SearchState>> free_states_;
+        };
+
+
+    template <typename Weight>
+        BidirectionalDijkstraRouter<Weight>::SearchState::SearchState(size_t vertex_count)
+        : forward_versions(vertex_count),
+        forward_weights(vertex_count),
+        forward_edges(vertex_count),
+        backward_versions(vertex_count),
+        backward_weights(vertex_count),
+        backward_edges(vertex_count)
+    {
+    }
+
+    template <typename Weight>
+        void BidirectionalDijkstraRouter<Weight>::SearchState::NextVersion() {
+            if (++version == 0) {
+                // Wrapped around, old marks could pass for new ones.
+                std::fill(forward_versions.begin(), forward_versions.end(), 0);
+                std::fill(backward_versions.begin(), backward_versions.end(), 0);
+                version = 1;
+            }
+        }
+
+    template <typename Weight>
+        bool BidirectionalDijkstraRouter<Weight>::Update(const GraphChanges<Weight>& changes) {
+            if (changes.old_vertex_count != graph_.GetVertexCount() || !changes.added_edges.empty()) {
+                reverse_incidence_ = ReverseIncidence<Weight>(graph_);
+                std::lock_guard<std::mutex> guard(states_mutex_);
+                free_states_.clear();
+            }
+            return true;
+        }
+
+    template <typename Weight>
+        std::unique_ptr<typename BidirectionalDijkstraRouter<Weight>::SearchState>
+        BidirectionalDijkstraRouter<Weight>::AcquireState() const {
+            {
+                std::lock_guard<std::mutex> guard(states_mutex_);
+                if (!free_states_.empty()) {
+                    auto state = std::move(free_states_.back());
+                    free_states_.pop_back();
+                    return state;
+                }
+            }
+            return std::make_unique<SearchState>(graph_.GetVertexCount());
+        }
+
+    template <typename Weight>
+        void BidirectionalDijkstraRouter<Weight>::ReleaseState(std::unique_ptr<SearchState> state) const {
+            std::lock_guard<std::mutex> guard(states_mutex_);
+            free_states_.push_back(std::move(state));
+        }
+
+    template <typename Weight>
+        std::optional<typename BidirectionalDijkstraRouter<Weight>::RouteInfo>
+        BidirectionalDijkstraRouter<Weight>::BuildRoute(VertexId from, VertexId to) const {
+            auto state = AcquireState();
+            state->NextVersion();
+            const uint32_t version = state->version;
+
+            using QueueItem = std::pair<Weight, VertexId>;
+            using Queue = std::priority_queue<QueueItem, std::vector<QueueItem>, std::greater<QueueItem>>;
+            Queue forward_queue, backward_queue;
+            state->forward_versions[from] = version;
+            state->forward_weights[from] = 0;
+            state->forward_edges[from] = NO_EDGE;
+            forward_queue.push({0, from});
+            state->backward_versions[to] = version;
+            state->backward_weights[to] = 0;
+            state->backward_edges[to] = NO_EDGE;
+            backward_queue.push({0, to});
+
+            std::optional<Weight> best_weight;
+            VertexId meeting_vertex = from;
+            if (from == to) {
+                best_weight = 0;
+            }
+
+            // One step of a search: settles its queue top and relaxes its
+            // edges, checking every reached vertex against the other search.
+            const auto step = [&](bool is_forward) {
+                Queue& queue = is_forward ? forward_queue : backward_queue;
+                auto& versions = is_forward ? state->forward_versions : state->backward_versions;
+                auto& weights = is_forward ? state->forward_weights : state->backward_weights;
+                auto& edges = is_forward ? state->forward_edges : state->backward_edges;
+                const auto& other_versions = is_forward ? state->backward_versions : state->forward_versions;
+                const auto& other_weights = is_forward ? state->backward_weights : state->forward_weights;
+
+                const auto [weight, vertex] = queue.top();
+                queue.pop();
+                if (weight > weights[vertex]) {
+                    return;
+                }
+                const auto relax = [&, weight = weight](EdgeId edge_id, VertexId next) {
+                    const Weight candidate_weight = weight + graph_.GetEdge(edge_id).weight;
+                    if (versions[next] == version && candidate_weight >= weights[next]) {
+                        return;
+                    }
+                    versions[next] = version;
+                    weights[next] = candidate_weight;
+                    edges[next] = edge_id;
+                    queue.push({candidate_weight, next});
+                    if (other_versions[next] == version) {
+                        const Weight route_weight = candidate_weight + other_weights[next];
+                        if (!best_weight || route_weight < *best_weight) {
+                            best_weight = route_weight;
+                            meeting_vertex = next;
+                        }
+                    }
+                };
+                if (is_forward) {
+                    for (const EdgeId edge_id : graph_.GetIncidentEdges(vertex)) {
+                        relax(edge_id, graph_.GetEdge(edge_id).to);
+                    }
+                } else {
+                    for (const EdgeId edge_id : reverse_incidence_.GetIncomingEdges(vertex)) {
+                        relax(edge_id, graph_.GetEdge(edge_id).from);
+                    }
+                }
+            };
+
+            while (!forward_queue.empty() && !backward_queue.empty()) {
+                const Weight forward_top = forward_queue.top().first;
+                const Weight backward_top = backward_queue.top().first;
+                if (best_weight && forward_top + backward_top >= *best_weight) {
+                    break;
+                }
+                step(forward_top <= backward_top);
+            }
+
+            std::optional<RouteInfo> route;
+            if (best_weight) {
+                std::vector<EdgeId> edges;
+                for (EdgeId edge_id = state->forward_edges[meeting_vertex]; edge_id != NO_EDGE;
+                        edge_id = state->forward_edges[graph_.GetEdge(edge_id).from]) {
+                    edges.push_back(edge_id);
+                }
+                std::reverse(edges.begin(), edges.end());
+                for (EdgeId edge_id = state->backward_edges[meeting_vertex]; edge_id != NO_EDGE;
+                        edge_id = state->backward_edges[graph_.GetEdge(edge_id).to]) {
+                    edges.push_back(edge_id);
+                }
+                route = this->SaveRoute(*best_weight, std::move(edges));
+            }
+            ReleaseState(std::move(state));
+            return route;
+        }
+
+}
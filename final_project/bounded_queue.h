@@ -0,0 +1,111 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Bounded multi-producer multi-consumer queue without locks: a ring of cells,
+// each with a sequence number telling whether it is free for the producer of
+// a given position or filled for its consumer (D. Vyukov's algorithm).
+// Push and Pop yield the thread while the queue is full or empty.
+template <typename T>
+class BoundedQueue {
+public:
+    // The capacity is rounded up to a power of two.
+    explicit BoundedQueue(size_t capacity);
+
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator = (const BoundedQueue&) = delete;
+
+    // Both leave value untouched if the queue is full or empty.
+    bool TryPush(T& value);
+    bool TryPop(T& value);
+
+    void Push(T value) {
+        while (!TryPush(value)) {
+            std::this_thread::yield();
+        }
+    }
+    T Pop() {
+        T value;
+        while (!TryPop(value)) {
+            std::this_thread::yield();
+        }
+        return value;
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    std::vector<Cell> cells_;
+    size_t mask_;
+    // Producers and consumers contend on different cache lines.
+    alignas(64) std::atomic<size_t> push_position_ = 0;
+    alignas(64) std::atomic<size_t> pop_position_ = 0;
+};
+
+
+template <typename T>
+BoundedQueue<T>::BoundedQueue(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) {
+        size *= 2;
+    }
+    cells_ = std::vector<Cell>(size);
+    mask_ = size - 1;
+    for (size_t i = 0; i < size; ++i) {
+        cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+template <typename T>
+bool BoundedQueue<T>::TryPush(T& value) {
+    size_t position = push_position_.load(std::memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+        cell = &cells_[position & mask_];
+        const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+        const intptr_t difference = intptr_t(sequence) - intptr_t(position);
+        if (difference == 0) {
+            if (push_position_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (difference < 0) {
+            return false;
+        } else {
+            position = push_position_.load(std::memory_order_relaxed);
+        }
+    }
+    cell->value = std::move(value);
+    cell->sequence.store(position + 1, std::memory_order_release);
+    return true;
+}
+
+template <typename T>
+bool BoundedQueue<T>::TryPop(T& value) {
+    size_t position = pop_position_.load(std::memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+        cell = &cells_[position & mask_];
+        const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+        const intptr_t difference = intptr_t(sequence) - intptr_t(position + 1);
+        if (difference == 0) {
+            if (pop_position_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (difference < 0) {
+            return false;
+        } else {
+            position = pop_position_.load(std::memory_order_relaxed);
+        }
+    }
+    value = std::move(cell->value);
+    cell->sequence.store(position + mask_ + 1, std::memory_order_release);
+    return true;
+}
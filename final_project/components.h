@@ -0,0 +1,644 @@
+#pragma once
+
+#include "dijkstra.h"
+#include "flat_array.h"
+#include "graph.h"
+#include "parallel.h"
+#include "router_base.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <optional>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace Graph {
+
+    struct Components {
+        // Weak components are numbered in the order of their smallest vertex.
+        std::vector<uint32_t> weak;
+        size_t weak_count = 0;
+        // Strong components are numbered in reverse topological order: a
+        // vertex reaches no vertex of a strong component above its own.
+        std::vector<uint32_t> strong;
+        size_t strong_count = 0;
+    };
+
+    template <typename Weight>
+        Components ComputeComponents(const DirectedWeightedGraph<Weight>& graph);
+
+
+    // A router per weak component, over a copy in rank order that keeps only
+    // the lightest of parallel edges, ties by EdgeOrder and then by id.
+    template <typename Weight>
+        class ComponentRouter : public RouterBase<Weight> {
+            private:
+                using Graph = DirectedWeightedGraph<Weight>;
+
+            public:
+                struct Part {
+                    Graph graph;
+                    FlatArray<VertexId> vertices;  // global id of every local vertex
+                    FlatArray<EdgeId> edges;       // global id of every local edge
+                    std::unique_ptr<RouterBase<Weight>> router;
+                };
+                // All but the component routers, to load a saved router.
+                struct Layout {
+                    Components components;
+                    std::vector<VertexId> local_vertices;
+                    std::vector<EdgeId> local_edges;
+                    size_t pruned_edge_count = 0;
+                    std::vector<std::shared_ptr<Part>> parts;  // without routers
+                };
+
+                using RouterFactory = std::function<std::unique_ptr<RouterBase<Weight>>(const Graph& graph, size_t component)>;
+                // Whether lhs goes before rhs among parallel edges of equal
+                // weight.
+                using EdgeOrder = std::function<bool(EdgeId lhs, EdgeId rhs)>;
+
+                // vertex_ranks is a permutation of the vertices or empty.
+                ComponentRouter(const Graph& graph, RouterFactory factory, std::vector<uint32_t> vertex_ranks = {},
+                                EdgeOrder edge_order = {}, size_t thread_count = DefaultThreadCount());
+                // Routers of the given parts come from load, later ones from
+                // factory.
+                ComponentRouter(const Graph& graph, RouterFactory factory, const RouterFactory& load, Layout layout,
+                                std::vector<uint32_t> vertex_ranks, EdgeOrder edge_order = {},
+                                size_t thread_count = DefaultThreadCount());
+
+                using typename RouterBase<Weight>::RouteInfo;
+
+                std::optional<RouteInfo> BuildRoute(VertexId from, VertexId to) const override;
+                std::optional<Weight> GetRouteWeight(VertexId from, VertexId to) const override;
+                // A component that kept its vertices updates its router,
+                // any other one gets a new router.
+                bool Update(const GraphChanges<Weight>& changes) override;
+                std::unique_ptr<RouterBase<Weight>> Clone(const Graph& graph) const override;
+
+                // Shortest routes from one source to every vertex, in global
+                // ids. Valid until the next update of the router.
+                class Tree {
+                    public:
+                        std::optional<Weight> GetWeight(VertexId to) const;
+                        std::vector<EdgeId> GetRouteEdges(VertexId to) const;
+
+                    private:
+                        friend class ComponentRouter;
+                        Tree(const ComponentRouter& router, VertexId from);
+
+                        const ComponentRouter& router_;
+                        VertexId from_;
+                        std::shared_ptr<const Part> part_;
+                        std::optional<ShortestPathTree<Weight>> tree_;
+                };
+
+                Tree BuildTree(VertexId from) const {
+                    return Tree(*this, from);
+                }
+                // Same as the free FindVerticesWithin over the whole graph.
+                std::vector<std::pair<VertexId, Weight>> FindVerticesWithin(
+                        VertexId from, Weight max_weight, size_t max_count = std::numeric_limits<size_t>::max()) const;
+
+                size_t GetComponentCount() const {
+                    return parts_.size();
+                }
+                // Router of a weak component, nullptr for a single vertex.
+                const RouterBase<Weight>* GetComponentRouter(size_t component) const {
+                    return parts_[component] ? parts_[component]->router.get() : nullptr;
+                }
+                // Nullptr for a single vertex.
+                const Part* GetPart(size_t component) const {
+                    return parts_[component].get();
+                }
+                const Components& GetComponents() const {
+                    return components_;
+                }
+                // Local ids of the global vertices and edges.
+                const std::vector<VertexId>& GetLocalVertices() const {
+                    return local_vertices_;
+                }
+                const std::vector<EdgeId>& GetLocalEdges() const {
+                    return local_edges_;
+                }
+                // Vertices added after construction rank after all others.
+                const std::vector<uint32_t>& GetVertexRanks() const {
+                    return vertex_ranks_;
+                }
+                // Parallel edges left out of the component copies.
+                size_t GetPrunedEdgeCount() const {
+                    return pruned_edge_count_;
+                }
+                // For clones whose edge order has to read their own data,
+                // takes effect with the next update.
+                void SetEdgeOrder(EdgeOrder edge_order) {
+                    edge_order_ = std::move(edge_order);
+                }
+
+            private:
+                ComponentRouter(const ComponentRouter& other, const Graph& graph);
+
+                static constexpr EdgeId NO_EDGE = std::numeric_limits<EdgeId>::max();
+
+                struct Contents {
+                    std::vector<std::vector<VertexId>> vertices;  // by local id
+                    std::vector<std::vector<EdgeId>> edges;       // kept ones only
+                    std::vector<bool> is_parallel;           // by global edge
+                };
+
+                // Fills in identity ranks if there are none.
+                void CheckVertexRanks();
+                Contents Partition();
+                bool IsPreferred(EdgeId lhs, EdgeId rhs) const;
+                std::shared_ptr<const Part> BuildPart(size_t component, const Contents& contents) const;
+                // Part of a route query, nullptr if the components rule the
+                // route out.
+                const Part* FindPart(VertexId from, VertexId to) const;
+
+                const Graph& graph_;
+                RouterFactory factory_;
+                size_t thread_count_;
+                std::vector<uint32_t> vertex_ranks_;
+                EdgeOrder edge_order_;
+                Components components_;
+                std::vector<VertexId> local_vertices_;
+                std::vector<EdgeId> local_edges_;  // NO_EDGE for pruned edges
+                size_t pruned_edge_count_ = 0;
+                // By weak component, null for a single vertex. Parts are never
+                // changed, so clones share them.
+                std::vector<std::shared_ptr<const Part>> parts_;
+        };
+
+
+    template <typename Weight>
+        Components ComputeComponents(const DirectedWeightedGraph<Weight>& graph) {
+            static constexpr uint32_t NONE = std::numeric_limits<uint32_t>::max();
+            const size_t vertex_count = graph.GetVertexCount();
+            Components components;
+
+            // Weak components by union-find over all edges.
+            std::vector<VertexId> parents(vertex_count);
+            std::iota(parents.begin(), parents.end(), 0);
+            const auto find_root = [&parents](VertexId vertex) {
+                while (parents[vertex] != vertex) {
+                    vertex = parents[vertex] = parents[parents[vertex]];
+                }
+                return vertex;
+            };
+            for (EdgeId edge_id = 0; edge_id < graph.GetEdgeCount(); ++edge_id) {
+                const auto& edge = graph.GetEdge(edge_id);
+                const VertexId from_root = find_root(edge.from);
+                const VertexId to_root = find_root(edge.to);
+                parents[std::max(from_root, to_root)] = std::min(from_root, to_root);
+            }
+            components.weak.resize(vertex_count);
+            for (VertexId vertex = 0; vertex < vertex_count; ++vertex) {
+                // Roots are the smallest vertices, so they come first.
+                const VertexId root = find_root(vertex);
+                components.weak[vertex] = root == vertex ? components.weak_count++ : components.weak[root];
+            }
+
+            // Strong components by Tarjan's algorithm with an explicit stack
+            // of frames, long bus routes would overflow the call stack.
+            struct Frame {
+                VertexId vertex;
+                const EdgeId* next_edge;
+                const EdgeId* end_edge;
+            };
+            std::vector<uint32_t> indices(vertex_count, NONE);
+            std::vector<uint32_t> low_links(vertex_count);
+            std::vector<bool> is_on_stack(vertex_count);
+            std::vector<VertexId> stack;
+            std::vector<Frame> frames;
+            uint32_t next_index = 0;
+            components.strong.resize(vertex_count);
+            const auto visit = [&](VertexId vertex) {
+                indices[vertex] = low_links[vertex] = next_index++;
+                stack.push_back(vertex);
+                is_on_stack[vertex] = true;
+                const auto edges = graph.GetIncidentEdges(vertex);
+                frames.push_back({vertex, edges.begin(), edges.end()});
+            };
+            for (VertexId root = 0; root < vertex_count; ++root) {
+                if (indices[root] != NONE) {
+                    continue;
+                }
+                visit(root);
+                while (!frames.empty()) {
+                    Frame& frame = frames.back();
+                    if (frame.next_edge != frame.end_edge) {
+                        const VertexId vertex = frame.vertex;
+                        const VertexId next = graph.GetEdge(*frame.next_edge++).to;
+                        if (indices[next] == NONE) {
+                            visit(next);
+                        } else if (is_on_stack[next]) {
+                            low_links[vertex] = std::min(low_links[vertex], indices[next]);
+                        }
+                        continue;
+                    }
+                    const VertexId vertex = frame.vertex;
+                    frames.pop_back();
+                    if (!frames.empty()) {
+                        const VertexId parent = frames.back().vertex;
+                        low_links[parent] = std::min(low_links[parent], low_links[vertex]);
+                    }
+                    if (low_links[vertex] == indices[vertex]) {
+                        VertexId member;
+                        do {
+                            member = stack.back();
+                            stack.pop_back();
+                            is_on_stack[member] = false;
+                            components.strong[member] = components.strong_count;
+                        } while (member != vertex);
+                        ++components.strong_count;
+                    }
+                }
+            }
+            return components;
+        }
+
+
+    template <typename Weight>
+        ComponentRouter<Weight>::ComponentRouter(const Graph& graph, RouterFactory factory, std::vector<uint32_t> vertex_ranks,
+                                                 EdgeOrder edge_order, size_t thread_count)
+        : graph_(graph),
+        factory_(std::move(factory)),
+        thread_count_(thread_count),
+        vertex_ranks_(std::move(vertex_ranks)),
+        edge_order_(std::move(edge_order))
+    {
+        CheckVertexRanks();
+
+        const auto contents = Partition();
+        parts_.resize(components_.weak_count);
+        // Largest components first, they take the longest to build.
+        std::vector<size_t> order(components_.weak_count);
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&contents](size_t lhs, size_t rhs) {
+            return contents.vertices[lhs].size() > contents.vertices[rhs].size();
+        });
+        ParallelFor(order.size(), thread_count_, [&](size_t idx) {
+            const size_t component = order[idx];
+            parts_[component] = BuildPart(component, contents);
+        });
+    }
+
+    template <typename Weight>
+        ComponentRouter<Weight>::ComponentRouter(const Graph& graph, RouterFactory factory, const RouterFactory& load,
+                                                 Layout layout, std::vector<uint32_t> vertex_ranks, EdgeOrder edge_order,
+                                                 size_t thread_count)
+        : graph_(graph),
+        factory_(std::move(factory)),
+        thread_count_(thread_count),
+        vertex_ranks_(std::move(vertex_ranks)),
+        edge_order_(std::move(edge_order)),
+        components_(std::move(layout.components)),
+        local_vertices_(std::move(layout.local_vertices)),
+        local_edges_(std::move(layout.local_edges)),
+        pruned_edge_count_(layout.pruned_edge_count)
+    {
+        CheckVertexRanks();
+        const size_t vertex_count = graph_.GetVertexCount();
+        if (components_.weak.size() != vertex_count || components_.strong.size() != vertex_count
+                || local_vertices_.size() != vertex_count || local_edges_.size() != graph_.GetEdgeCount()
+                || layout.parts.size() != components_.weak_count) {
+            throw std::invalid_argument("layout does not match the graph");
+        }
+        parts_.reserve(layout.parts.size());
+        for (size_t component = 0; component < layout.parts.size(); ++component) {
+            auto& part = layout.parts[component];
+            if (part) {
+                part->router = load(part->graph, component);
+            }
+            parts_.push_back(std::move(part));
+        }
+    }
+
+    template <typename Weight>
+        ComponentRouter<Weight>::ComponentRouter(const ComponentRouter& other, const Graph& graph)
+        : graph_(graph),
+        factory_(other.factory_),
+        thread_count_(other.thread_count_),
+        vertex_ranks_(other.vertex_ranks_),
+        edge_order_(other.edge_order_),
+        components_(other.components_),
+        local_vertices_(other.local_vertices_),
+        local_edges_(other.local_edges_),
+        pruned_edge_count_(other.pruned_edge_count_),
+        parts_(other.parts_)
+    {
+    }
+
+    template <typename Weight>
+        std::unique_ptr<RouterBase<Weight>> ComponentRouter<Weight>::Clone(const Graph& graph) const {
+            return std::unique_ptr<RouterBase<Weight>>(new ComponentRouter(*this, graph));
+        }
+
+    template <typename Weight>
+        void ComponentRouter<Weight>::CheckVertexRanks() {
+            const size_t vertex_count = graph_.GetVertexCount();
+            if (vertex_ranks_.empty()) {
+                vertex_ranks_.resize(vertex_count);
+                std::iota(vertex_ranks_.begin(), vertex_ranks_.end(), 0);
+            }
+            std::vector<bool> is_ranked(vertex_count);
+            for (const uint32_t rank : vertex_ranks_) {
+                if (vertex_ranks_.size() != vertex_count || rank >= vertex_count || is_ranked[rank]) {
+                    throw std::invalid_argument("vertex ranks are not a permutation");
+                }
+                is_ranked[rank] = true;
+            }
+        }
+
+    template <typename Weight>
+        typename ComponentRouter<Weight>::Contents ComponentRouter<Weight>::Partition() {
+            components_ = ComputeComponents(graph_);
+            const size_t edge_count = graph_.GetEdgeCount();
+            Contents contents{
+                std::vector<std::vector<VertexId>>(components_.weak_count),
+                std::vector<std::vector<EdgeId>>(components_.weak_count),
+                std::vector<bool>(edge_count, false)
+            };
+            const size_t vertex_count = graph_.GetVertexCount();
+            std::vector<VertexId> order(vertex_count);
+            for (VertexId vertex = 0; vertex < vertex_count; ++vertex) {
+                order[vertex_ranks_[vertex]] = vertex;
+            }
+            local_vertices_.resize(vertex_count);
+            for (const VertexId vertex : order) {
+                auto& vertices = contents.vertices[components_.weak[vertex]];
+                local_vertices_[vertex] = vertices.size();
+                vertices.push_back(vertex);
+            }
+
+            // The preferred edge to every target of a vertex, over its
+            // incidence list.
+            std::vector<bool> is_kept(edge_count);
+            std::vector<EdgeId> kept_edges(vertex_count, NO_EDGE);
+            for (VertexId vertex = 0; vertex < vertex_count; ++vertex) {
+                const auto incident_edges = graph_.GetIncidentEdges(vertex);
+                for (const EdgeId edge_id : incident_edges) {
+                    EdgeId& kept_edge = kept_edges[graph_.GetEdge(edge_id).to];
+                    if (kept_edge == NO_EDGE) {
+                        kept_edge = edge_id;
+                        continue;
+                    }
+                    contents.is_parallel[kept_edge] = contents.is_parallel[edge_id] = true;
+                    if (IsPreferred(edge_id, kept_edge)) {
+                        kept_edge = edge_id;
+                    }
+                }
+                for (const EdgeId edge_id : incident_edges) {
+                    EdgeId& kept_edge = kept_edges[graph_.GetEdge(edge_id).to];
+                    if (kept_edge != NO_EDGE) {
+                        is_kept[kept_edge] = true;
+                        kept_edge = NO_EDGE;
+                    }
+                }
+            }
+
+            local_edges_.assign(edge_count, NO_EDGE);
+            pruned_edge_count_ = 0;
+            for (EdgeId edge_id = 0; edge_id < edge_count; ++edge_id) {
+                if (!is_kept[edge_id]) {
+                    ++pruned_edge_count_;
+                    continue;
+                }
+                auto& edges = contents.edges[components_.weak[graph_.GetEdge(edge_id).from]];
+                local_edges_[edge_id] = edges.size();
+                edges.push_back(edge_id);
+            }
+            return contents;
+        }
+
+    template <typename Weight>
+        bool ComponentRouter<Weight>::IsPreferred(EdgeId lhs, EdgeId rhs) const {
+            const Weight lhs_weight = graph_.GetEdge(lhs).weight;
+            const Weight rhs_weight = graph_.GetEdge(rhs).weight;
+            if (lhs_weight != rhs_weight) {
+                return lhs_weight < rhs_weight;
+            }
+            if (edge_order_) {
+                if (edge_order_(lhs, rhs)) {
+                    return true;
+                }
+                if (edge_order_(rhs, lhs)) {
+                    return false;
+                }
+            }
+            return lhs < rhs;
+        }
+
+    template <typename Weight>
+        std::shared_ptr<const typename ComponentRouter<Weight>::Part> ComponentRouter<Weight>::BuildPart(
+                size_t component, const Contents& contents) const {
+            // A single vertex gets no part, its edges can only be loops.
+            const auto& vertices = contents.vertices[component];
+            if (vertices.size() == 1) {
+                return nullptr;
+            }
+            const auto& edges = contents.edges[component];
+            std::vector<Edge<Weight>> local_edges;
+            local_edges.reserve(edges.size());
+            for (const EdgeId edge_id : edges) {
+                const auto& edge = graph_.GetEdge(edge_id);
+                local_edges.push_back({local_vertices_[edge.from], local_vertices_[edge.to], edge.weight});
+            }
+            auto part = std::make_shared<Part>(Part{Graph(vertices.size(), std::move(local_edges)), vertices, edges, nullptr});
+            part->router = factory_(part->graph, component);
+            return part;
+        }
+
+    template <typename Weight>
+        const typename ComponentRouter<Weight>::Part* ComponentRouter<Weight>::FindPart(VertexId from, VertexId to) const {
+            if (components_.weak[from] != components_.weak[to] || components_.strong[from] < components_.strong[to]) {
+                return nullptr;
+            }
+            return parts_[components_.weak[from]].get();
+        }
+
+    template <typename Weight>
+        std::optional<typename ComponentRouter<Weight>::RouteInfo> ComponentRouter<Weight>::BuildRoute(VertexId from, VertexId to) const {
+            if (from == to) {
+                return this->SaveRoute(0, {});
+            }
+            const Part* part = FindPart(from, to);
+            if (!part) {
+                return std::nullopt;
+            }
+            const auto route = part->router->BuildRoute(local_vertices_[from], local_vertices_[to]);
+            if (!route) {
+                return std::nullopt;
+            }
+            std::vector<EdgeId> edges = part->router->ExtractRoute(route->id);
+            for (EdgeId& edge_id : edges) {
+                edge_id = part->edges[edge_id];
+            }
+            return this->SaveRoute(route->weight, std::move(edges));
+        }
+
+    template <typename Weight>
+        std::optional<Weight> ComponentRouter<Weight>::GetRouteWeight(VertexId from, VertexId to) const {
+            if (from == to) {
+                return 0;
+            }
+            const Part* part = FindPart(from, to);
+            if (!part) {
+                return std::nullopt;
+            }
+            return part->router->GetRouteWeight(local_vertices_[from], local_vertices_[to]);
+        }
+
+    template <typename Weight>
+        ComponentRouter<Weight>::Tree::Tree(const ComponentRouter& router, VertexId from)
+        : router_(router),
+        from_(from),
+        part_(router.parts_[router.components_.weak[from]])
+    {
+        if (part_) {
+            tree_.emplace(part_->graph, router.local_vertices_[from]);
+        }
+    }
+
+    template <typename Weight>
+        std::optional<Weight> ComponentRouter<Weight>::Tree::GetWeight(VertexId to) const {
+            if (to == from_) {
+                return 0;
+            }
+            if (!router_.FindPart(from_, to)) {
+                return std::nullopt;
+            }
+            return tree_->GetWeight(router_.local_vertices_[to]);
+        }
+
+    template <typename Weight>
+        std::vector<EdgeId> ComponentRouter<Weight>::Tree::GetRouteEdges(VertexId to) const {
+            if (to == from_ || !router_.FindPart(from_, to)) {
+                return {};
+            }
+            std::vector<EdgeId> edges = tree_->GetRouteEdges(router_.local_vertices_[to]);
+            for (EdgeId& edge_id : edges) {
+                edge_id = part_->edges[edge_id];
+            }
+            return edges;
+        }
+
+    template <typename Weight>
+        std::vector<std::pair<VertexId, Weight>> ComponentRouter<Weight>::FindVerticesWithin(
+                VertexId from, Weight max_weight, size_t max_count) const {
+            const Part* part = parts_[components_.weak[from]].get();
+            if (!part) {
+                if (max_weight < 0 || max_count == 0) {
+                    return {};
+                }
+                return {{from, 0}};
+            }
+            auto vertices = ::Graph::FindVerticesWithin(part->graph, local_vertices_[from], max_weight, max_count);
+            for (auto& [vertex, weight] : vertices) {
+                vertex = part->vertices[vertex];
+            }
+            return vertices;
+        }
+
+    template <typename Weight>
+        bool ComponentRouter<Weight>::Update(const GraphChanges<Weight>& changes) {
+            const auto old_components = std::move(components_);
+            auto old_parts = std::move(parts_);
+            for (VertexId vertex = vertex_ranks_.size(); vertex < graph_.GetVertexCount(); ++vertex) {
+                vertex_ranks_.push_back(vertex);
+            }
+            const auto contents = Partition();
+            parts_.resize(components_.weak_count);
+
+            // A part is rebuilt unless its vertices made up exactly one old
+            // part and none of its changed edges is parallel to another.
+            std::vector<size_t> old_vertex_counts(old_components.weak_count);
+            for (VertexId vertex = 0; vertex < changes.old_vertex_count; ++vertex) {
+                ++old_vertex_counts[old_components.weak[vertex]];
+            }
+            std::vector<std::optional<size_t>> old_part_ids(components_.weak_count);
+            std::vector<bool> is_kept(components_.weak_count, true);
+            for (VertexId vertex = 0; vertex < graph_.GetVertexCount(); ++vertex) {
+                const size_t component = components_.weak[vertex];
+                if (vertex >= changes.old_vertex_count) {
+                    is_kept[component] = false;
+                    continue;
+                }
+                const size_t old_component = old_components.weak[vertex];
+                if (!old_part_ids[component]) {
+                    old_part_ids[component] = old_component;
+                }
+                if (*old_part_ids[component] != old_component || !old_parts[old_component]) {
+                    is_kept[component] = false;
+                }
+            }
+            for (size_t component = 0; component < components_.weak_count; ++component) {
+                if (is_kept[component] && old_vertex_counts[*old_part_ids[component]] != contents.vertices[component].size()) {
+                    is_kept[component] = false;
+                }
+            }
+
+            std::vector<GraphChanges<Weight>> part_changes(components_.weak_count);
+            for (const EdgeId edge_id : changes.added_edges) {
+                const size_t component = components_.weak[graph_.GetEdge(edge_id).from];
+                if (contents.is_parallel[edge_id]) {
+                    is_kept[component] = false;
+                } else {
+                    part_changes[component].added_edges.push_back(local_edges_[edge_id]);
+                }
+            }
+            for (const auto& [edge_id, old_weight] : changes.reweighted_edges) {
+                const size_t component = components_.weak[graph_.GetEdge(edge_id).from];
+                if (contents.is_parallel[edge_id]) {
+                    is_kept[component] = false;
+                } else {
+                    part_changes[component].reweighted_edges.push_back({local_edges_[edge_id], old_weight});
+                }
+            }
+
+            std::vector<size_t> changed;
+            for (size_t component = 0; component < components_.weak_count; ++component) {
+                if (!is_kept[component]) {
+                    changed.push_back(component);
+                } else if (part_changes[component].added_edges.empty() && part_changes[component].reweighted_edges.empty()) {
+                    parts_[component] = std::move(old_parts[*old_part_ids[component]]);
+                } else {
+                    changed.push_back(component);
+                }
+            }
+            ParallelFor(changed.size(), thread_count_, [&](size_t idx) {
+                const size_t component = changed[idx];
+                if (!is_kept[component]) {
+                    parts_[component] = BuildPart(component, contents);
+                    return;
+                }
+                // Parts are shared with clones, a changed one is a new copy.
+                const Part& old_part = *old_parts[*old_part_ids[component]];
+                auto part = std::make_shared<Part>(Part{old_part.graph, old_part.vertices, old_part.edges, nullptr});
+                part->router = old_part.router->Clone(part->graph);
+                auto& local_changes = part_changes[component];
+                local_changes.old_vertex_count = contents.vertices[component].size();
+                std::sort(local_changes.added_edges.begin(), local_changes.added_edges.end());
+                for (const EdgeId local_edge : local_changes.added_edges) {
+                    const EdgeId edge_id = contents.edges[component][local_edge];
+                    const auto& edge = graph_.GetEdge(edge_id);
+                    part->graph.AddEdge({local_vertices_[edge.from], local_vertices_[edge.to], edge.weight});
+                    part->edges.Modify([edge_id](auto& edges) {
+                        edges.push_back(edge_id);
+                    });
+                }
+                for (const auto& [local_edge, old_weight] : local_changes.reweighted_edges) {
+                    part->graph.SetEdgeWeight(local_edge, graph_.GetEdge(part->edges[local_edge]).weight);
+                }
+                if (!part->router->Update(local_changes)) {
+                    part->router = factory_(part->graph, component);
+                }
+                parts_[component] = std::move(part);
+            });
+            return true;
+        }
+
+}
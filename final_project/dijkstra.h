@@ -0,0 +1,160 @@
+#pragma once
+
+#include "graph.h"
+#include "router_base.h"
+
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <queue>
+#include <utility>
+#include <vector>
+
+namespace Graph {
+
+    // Shortest routes from one source to every reachable vertex.
+    template <typename Weight>
+        class ShortestPathTree {
+            private:
+                using Graph = DirectedWeightedGraph<Weight>;
+
+            public:
+                // With a target the search stops as soon as the target is
+                // settled, and only routes to settled vertices are exact.
+                ShortestPathTree(const Graph& graph, VertexId from, std::optional<VertexId> target = std::nullopt);
+
+                std::optional<Weight> GetWeight(VertexId to) const;
+                std::optional<EdgeId> GetLastEdge(VertexId to) const {
+                    return prev_edges_[to];
+                }
+                std::vector<EdgeId> GetRouteEdges(VertexId to) const;
+
+            private:
+                const Graph& graph_;
+                std::vector<std::optional<Weight>> weights_;
+                std::vector<std::optional<EdgeId>> prev_edges_;
+        };
+
+
+    template <typename Weight>
+        ShortestPathTree<Weight>::ShortestPathTree(const Graph& graph, VertexId from, std::optional<VertexId> target)
+        : graph_(graph),
+        weights_(graph.GetVertexCount()),
+        prev_edges_(graph.GetVertexCount())
+    {
+        using QueueItem = std::pair<Weight, VertexId>;
+        std::priority_queue<QueueItem, std::vector<QueueItem>, std::greater<QueueItem>> queue;
+        weights_[from] = 0;
+        queue.push({0, from});
+        while (!queue.empty()) {
+            const auto [weight, vertex] = queue.top();
+            queue.pop();
+            if (weight > *weights_[vertex]) {
+                continue;
+            }
+            if (vertex == target) {
+                break;
+            }
+            for (const EdgeId edge_id : graph.GetIncidentEdges(vertex)) {
+                const auto& edge = graph.GetEdge(edge_id);
+                const Weight candidate_weight = weight + edge.weight;
+                auto& to_weight = weights_[edge.to];
+                if (!to_weight || candidate_weight < *to_weight) {
+                    to_weight = candidate_weight;
+                    prev_edges_[edge.to] = edge_id;
+                    queue.push({candidate_weight, edge.to});
+                }
+            }
+        }
+    }
+
+    template <typename Weight>
+        std::optional<Weight> ShortestPathTree<Weight>::GetWeight(VertexId to) const {
+            return weights_[to];
+        }
+
+    template <typename Weight>
+        std::vector<EdgeId> ShortestPathTree<Weight>::GetRouteEdges(VertexId to) const {
+            std::vector<EdgeId> edges;
+            for (std::optional<EdgeId> edge_id = prev_edges_[to];
+                    edge_id;
+                    edge_id = prev_edges_[graph_.GetEdge(*edge_id).from]) {
+                edges.push_back(*edge_id);
+            }
+            std::reverse(std::begin(edges), std::end(edges));
+            return edges;
+        }
+
+
+    // Vertices within max_weight of the source with their weights, nearest
+    // first and at most max_count of them. Heavier edges are never relaxed,
+    // so the search covers only what it returns.
+    template <typename Weight>
+        std::vector<std::pair<VertexId, Weight>> FindVerticesWithin(const DirectedWeightedGraph<Weight>& graph, VertexId from,
+                                                                    Weight max_weight,
+                                                                    size_t max_count = std::numeric_limits<size_t>::max()) {
+            std::vector<std::pair<VertexId, Weight>> vertices;
+            std::vector<std::optional<Weight>> weights(graph.GetVertexCount());
+            using QueueItem = std::pair<Weight, VertexId>;
+            std::priority_queue<QueueItem, std::vector<QueueItem>, std::greater<QueueItem>> queue;
+            if (max_weight >= 0) {
+                weights[from] = 0;
+                queue.push({0, from});
+            }
+            while (!queue.empty() && vertices.size() < max_count) {
+                const auto [weight, vertex] = queue.top();
+                queue.pop();
+                if (weight > *weights[vertex]) {
+                    continue;
+                }
+                vertices.push_back({vertex, weight});
+                for (const EdgeId edge_id : graph.GetIncidentEdges(vertex)) {
+                    const auto& edge = graph.GetEdge(edge_id);
+                    const Weight candidate_weight = weight + edge.weight;
+                    auto& to_weight = weights[edge.to];
+                    if (candidate_weight <= max_weight && (!to_weight || candidate_weight < *to_weight)) {
+                        to_weight = candidate_weight;
+                        queue.push({candidate_weight, edge.to});
+                    }
+                }
+            }
+            return vertices;
+        }
+
+
+    // Runs a single-source search per query instead of precomputing all pairs.
+    template <typename Weight>
+        class DijkstraRouter : public RouterBase<Weight> {
+            private:
+                using Graph = DirectedWeightedGraph<Weight>;
+
+            public:
+                DijkstraRouter(const Graph& graph) : graph_(graph) {}
+
+                // Nothing is precomputed, searches always see the current graph.
+                bool Update(const GraphChanges<Weight>&) override {
+                    return true;
+                }
+                std::unique_ptr<RouterBase<Weight>> Clone(const Graph& graph) const override {
+                    return std::make_unique<DijkstraRouter>(graph);
+                }
+
+                using typename RouterBase<Weight>::RouteInfo;
+
+                std::optional<RouteInfo> BuildRoute(VertexId from, VertexId to) const override {
+                    const ShortestPathTree<Weight> tree(graph_, from, to);
+                    const auto weight = tree.GetWeight(to);
+                    if (!weight) {
+                        return std::nullopt;
+                    }
+                    return this->SaveRoute(*weight, tree.GetRouteEdges(to));
+                }
+
+            private:
+                const Graph& graph_;
+        };
+
+}
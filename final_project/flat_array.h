@@ -0,0 +1,91 @@
+#pragma once
+
+#include <atomic>
+#include <cstdlib>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// Contiguous read-only array that either owns its elements or views an
+// external buffer, e.g. a memory-mapped snapshot. A viewed buffer must
+// outlive the array. Copies share the elements, Modify() gives the array
+// its own copy first if the elements are viewed or shared.
+template <typename T>
+class FlatArray {
+public:
+    FlatArray() = default;
+    FlatArray(std::vector<T> values) : owned_(std::make_shared<std::vector<T>>(std::move(values))) {
+        Attach();
+    }
+    FlatArray(const T* data, size_t size) : data_(data), size_(size) {}
+
+    FlatArray(const FlatArray& other) = default;
+    FlatArray(FlatArray&& other) {
+        *this = std::move(other);
+    }
+    FlatArray& operator = (const FlatArray& other) = default;
+    FlatArray& operator = (FlatArray&& other) {
+        if (this != &other) {
+            owned_ = std::move(other.owned_);
+            data_ = std::exchange(other.data_, nullptr);
+            size_ = std::exchange(other.size_, 0);
+        }
+        return *this;
+    }
+
+    bool IsView() const {
+        return !owned_ && data_;
+    }
+
+    // Calls modify(std::vector<T>&) on the owned elements. Other copies are
+    // left untouched, so they may be read while this one is modified. This
+    // array itself must not be copied meanwhile.
+    template <typename Modifier>
+    void Modify(Modifier modify) {
+        if (!IsOwnedAlone()) {
+            owned_ = std::make_shared<std::vector<T>>(data_, data_ + size_);
+        }
+        modify(*owned_);
+        Attach();
+    }
+
+    const T* data() const {
+        return data_;
+    }
+    size_t size() const {
+        return size_;
+    }
+    bool empty() const {
+        return size_ == 0;
+    }
+    const T& operator [] (size_t idx) const {
+        return data_[idx];
+    }
+    const T* begin() const {
+        return data_;
+    }
+    const T* end() const {
+        return data_ + size_;
+    }
+
+private:
+    // use_count() is a relaxed load. When it shows that the last other copy
+    // is gone, the fence orders that copy's reads, which precede its release
+    // of the count, before the writes of Modify.
+    bool IsOwnedAlone() const {
+        if (!owned_ || owned_.use_count() > 1) {
+            return false;
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return true;
+    }
+
+    void Attach() {
+        data_ = owned_->data();
+        size_ = owned_->size();
+    }
+
+    std::shared_ptr<std::vector<T>> owned_;
+    const T* data_ = nullptr;
+    size_t size_ = 0;
+};
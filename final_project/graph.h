@@ -1,7 +1,12 @@
 #pragma once
 
+#include "flat_array.h"
+
+#include <cstdint>
 #include <cstdlib>
 #include <deque>
+#include <iterator>
+#include <utility>
 #include <vector>
 
 template <typename It>
@@ -30,15 +35,24 @@ namespace Graph {
             Weight weight;
         };
 
+    // A graph built edge by edge keeps one incidence list per vertex. A graph
+    // built from a complete edge list stores incidence in compressed form:
+    // incidence_edges_[incidence_offsets_[v]..incidence_offsets_[v + 1]) are
+    // the edges leaving v. Both arrays may view a memory-mapped snapshot.
     template <typename Weight>
         class DirectedWeightedGraph {
             private:
                 using IncidenceList = std::vector<EdgeId>;
-                using IncidentEdgesRange = Range<typename IncidenceList::const_iterator>;
+                using IncidentEdgesRange = Range<const EdgeId*>;
 
             public:
                 DirectedWeightedGraph(size_t vertex_count);
+                DirectedWeightedGraph(size_t vertex_count, std::vector<Edge<Weight>> edges);
+                DirectedWeightedGraph(FlatArray<Edge<Weight>> edges,
+                        FlatArray<uint64_t> incidence_offsets, FlatArray<EdgeId> incidence_edges);
                 EdgeId AddEdge(const Edge<Weight>& edge);
+                VertexId AddVertex();
+                void SetEdgeWeight(EdgeId edge_id, Weight weight);
 
                 size_t GetVertexCount() const;
                 size_t GetEdgeCount() const;
@@ -46,25 +60,108 @@ namespace Graph {
                 IncidentEdgesRange GetIncidentEdges(VertexId vertex) const;
 
             private:
-                std::vector<Edge<Weight>> edges_;
+                bool IsCompressed() const {
+                    return !incidence_offsets_.empty();
+                }
+                void Decompress();
+
+                FlatArray<Edge<Weight>> edges_;
                 std::vector<IncidenceList> incidence_lists_;
+                FlatArray<uint64_t> incidence_offsets_;
+                FlatArray<EdgeId> incidence_edges_;
+        };
+
+    // Edges entering every vertex, in the same compressed form. It is built
+    // once from a graph and does not follow later changes of that graph.
+    template <typename Weight>
+        class ReverseIncidence {
+            public:
+                explicit ReverseIncidence(const DirectedWeightedGraph<Weight>& graph);
+
+                Range<const EdgeId*> GetIncomingEdges(VertexId vertex) const {
+                    return {edges_.data() + offsets_[vertex], edges_.data() + offsets_[vertex + 1]};
+                }
+
+            private:
+                std::vector<uint64_t> offsets_;
+                std::vector<EdgeId> edges_;
         };
 
 
     template <typename Weight>
         DirectedWeightedGraph<Weight>::DirectedWeightedGraph(size_t vertex_count) : incidence_lists_(vertex_count) {}
 
+    template <typename Weight>
+        DirectedWeightedGraph<Weight>::DirectedWeightedGraph(size_t vertex_count, std::vector<Edge<Weight>> edges)
+        : edges_(std::move(edges))
+    {
+        std::vector<uint64_t> offsets(vertex_count + 1);
+        for (const auto& edge : edges_) {
+            ++offsets[edge.from + 1];
+        }
+        for (VertexId vertex = 0; vertex < vertex_count; ++vertex) {
+            offsets[vertex + 1] += offsets[vertex];
+        }
+        std::vector<EdgeId> incidence(edges_.size());
+        std::vector<uint64_t> positions(offsets.begin(), offsets.end() - 1);
+        for (EdgeId id = 0; id < edges_.size(); ++id) {
+            incidence[positions[edges_[id].from]++] = id;
+        }
+        incidence_offsets_ = std::move(offsets);
+        incidence_edges_ = std::move(incidence);
+    }
+
+    template <typename Weight>
+        DirectedWeightedGraph<Weight>::DirectedWeightedGraph(FlatArray<Edge<Weight>> edges,
+                FlatArray<uint64_t> incidence_offsets, FlatArray<EdgeId> incidence_edges)
+        : edges_(std::move(edges)),
+        incidence_offsets_(std::move(incidence_offsets)),
+        incidence_edges_(std::move(incidence_edges))
+    {
+    }
+
+    template <typename Weight>
+        void DirectedWeightedGraph<Weight>::Decompress() {
+            if (!IsCompressed()) {
+                return;
+            }
+            incidence_lists_.resize(GetVertexCount());
+            for (VertexId vertex = 0; vertex < incidence_lists_.size(); ++vertex) {
+                const auto range = GetIncidentEdges(vertex);
+                incidence_lists_[vertex].assign(range.begin(), range.end());
+            }
+            incidence_offsets_ = {};
+            incidence_edges_ = {};
+        }
+
     template <typename Weight>
         EdgeId DirectedWeightedGraph<Weight>::AddEdge(const Edge<Weight>& edge) {
-            edges_.push_back(edge);
+            Decompress();
+            edges_.Modify([&edge](auto& edges) {
+                edges.push_back(edge);
+            });
             const EdgeId id = edges_.size() - 1;
             incidence_lists_[edge.from].push_back(id);
             return id;
         }
 
+    template <typename Weight>
+        VertexId DirectedWeightedGraph<Weight>::AddVertex() {
+            Decompress();
+            incidence_lists_.emplace_back();
+            return incidence_lists_.size() - 1;
+        }
+
+    template <typename Weight>
+        void DirectedWeightedGraph<Weight>::SetEdgeWeight(EdgeId edge_id, Weight weight) {
+            edges_.Modify([edge_id, weight](auto& edges) {
+                edges[edge_id].weight = weight;
+            });
+        }
+
     template <typename Weight>
         size_t DirectedWeightedGraph<Weight>::GetVertexCount() const {
-            return incidence_lists_.size();
+            return IsCompressed() ? incidence_offsets_.size() - 1 : incidence_lists_.size();
         }
 
     template <typename Weight>
@@ -80,7 +177,28 @@ namespace Graph {
     template <typename Weight>
         typename DirectedWeightedGraph<Weight>::IncidentEdgesRange
         DirectedWeightedGraph<Weight>::GetIncidentEdges(VertexId vertex) const {
+            if (IsCompressed()) {
+                const EdgeId* edges = incidence_edges_.data();
+                return {edges + incidence_offsets_[vertex], edges + incidence_offsets_[vertex + 1]};
+            }
             const auto& edges = incidence_lists_[vertex];
-            return {std::begin(edges), std::end(edges)};
+            return {edges.data(), edges.data() + edges.size()};
+        }
+
+    template <typename Weight>
+        ReverseIncidence<Weight>::ReverseIncidence(const DirectedWeightedGraph<Weight>& graph)
+        : offsets_(graph.GetVertexCount() + 1),
+        edges_(graph.GetEdgeCount())
+    {
+        for (EdgeId id = 0; id < graph.GetEdgeCount(); ++id) {
+            ++offsets_[graph.GetEdge(id).to + 1];
+        }
+        for (VertexId vertex = 0; vertex < graph.GetVertexCount(); ++vertex) {
+            offsets_[vertex + 1] += offsets_[vertex];
+        }
+        std::vector<uint64_t> positions(offsets_.begin(), offsets_.end() - 1);
+        for (EdgeId id = 0; id < graph.GetEdgeCount(); ++id) {
+            edges_[positions[graph.GetEdge(id).to]++] = id;
         }
+    }
 }
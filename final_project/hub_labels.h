@@ -0,0 +1,293 @@
+#pragma once
+
+#include "flat_array.h"
+#include "graph.h"
+#include "router_base.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <queue>
+#include <utility>
+#include <vector>
+
+namespace Graph {
+
+    // Two-hop labels from pruned landmark labeling. Every vertex keeps the
+    // hubs it reaches (forward label) and the hubs reaching it (backward
+    // label), and every route passes a hub common to both ends, so a query
+    // merges two short sorted arrays. Vertices become hubs in the order of
+    // their degree and a search from a hub stops wherever the labels built
+    // so far already give the distance. Each label entry keeps the edge next
+    // to its vertex on the way to or from the hub, and the route is unpacked
+    // by following these edges hub by hub.
+    template <typename Weight>
+        class HubLabelRouter : public RouterBase<Weight> {
+            private:
+                using Graph = DirectedWeightedGraph<Weight>;
+
+                static constexpr EdgeId NO_EDGE = std::numeric_limits<EdgeId>::max();
+
+            public:
+                // Labels of all vertices in compressed form: the entries of
+                // vertex v are [offsets[v], offsets[v + 1]), by hub rank.
+                struct LabelSet {
+                    FlatArray<uint64_t> offsets;
+                    FlatArray<uint32_t> hubs;
+                    FlatArray<Weight> weights;
+                    FlatArray<EdgeId> edges;
+
+                    size_t Find(VertexId vertex, uint32_t hub) const {
+                        const auto begin = hubs.begin() + offsets[vertex];
+                        const auto end = hubs.begin() + offsets[vertex + 1];
+                        return std::lower_bound(begin, end, hub) - hubs.begin();
+                    }
+                };
+
+                struct Labels {
+                    FlatArray<VertexId> hub_vertices;  // by rank
+                    LabelSet forward;   // edge: first one on the way to the hub
+                    LabelSet backward;  // edge: last one on the way from the hub
+                };
+
+                explicit HubLabelRouter(const Graph& graph);
+                // Shares the labels of another router over the same graph.
+                HubLabelRouter(const Graph& graph, std::shared_ptr<const Labels> labels)
+                    : graph_(graph), labels_(std::move(labels)) {}
+
+                using typename RouterBase<Weight>::RouteInfo;
+
+                std::optional<RouteInfo> BuildRoute(VertexId from, VertexId to) const override;
+                std::optional<Weight> GetRouteWeight(VertexId from, VertexId to) const override;
+                // Labels are not updated, a changed graph gets new ones.
+                std::unique_ptr<RouterBase<Weight>> Clone(const Graph& graph) const override {
+                    return std::make_unique<HubLabelRouter>(graph, labels_);
+                }
+
+                // Forward and backward entries of all vertices together.
+                size_t GetLabelEntryCount() const {
+                    return labels_->forward.hubs.size() + labels_->backward.hubs.size();
+                }
+                const Labels& GetLabels() const {
+                    return *labels_;
+                }
+
+            private:
+                // Weight of the shortest route and the rank of its hub.
+                std::optional<std::pair<Weight, uint32_t>> Query(VertexId from, VertexId to) const;
+
+                static std::shared_ptr<const Labels> BuildLabels(const Graph& graph);
+
+                const Graph& graph_;
+                std::shared_ptr<const Labels> labels_;
+        };
+
+
+    template <typename Weight>
+        HubLabelRouter<Weight>::HubLabelRouter(const Graph& graph)
+        : graph_(graph),
+        labels_(BuildLabels(graph))
+    {
+    }
+
+    template <typename Weight>
+        std::shared_ptr<const typename HubLabelRouter<Weight>::Labels> HubLabelRouter<Weight>::BuildLabels(const Graph& graph) {
+            struct Entry {
+                uint32_t hub;
+                Weight weight;
+                EdgeId edge;
+            };
+            using Label = std::vector<Entry>;
+
+            const size_t vertex_count = graph.GetVertexCount();
+            const ReverseIncidence<Weight> reverse_incidence(graph);
+
+            auto labels = std::make_shared<Labels>();
+            std::vector<VertexId> hub_vertices(vertex_count);
+            std::vector<size_t> degrees(vertex_count);
+            for (VertexId vertex = 0; vertex < vertex_count; ++vertex) {
+                hub_vertices[vertex] = vertex;
+                const auto outgoing = graph.GetIncidentEdges(vertex);
+                const auto incoming = reverse_incidence.GetIncomingEdges(vertex);
+                degrees[vertex] = (outgoing.end() - outgoing.begin()) + (incoming.end() - incoming.begin());
+            }
+            std::stable_sort(hub_vertices.begin(), hub_vertices.end(), [&degrees](VertexId lhs, VertexId rhs) {
+                return degrees[lhs] > degrees[rhs];
+            });
+
+            std::vector<Label> forward(vertex_count), backward(vertex_count);
+            // Distances between the current hub and the hubs of its own label,
+            // by hub rank, for the pruning test.
+            std::vector<std::optional<Weight>> hub_weights(vertex_count);
+            // Search state, reset through the list of touched vertices.
+            std::vector<std::optional<Weight>> weights(vertex_count);
+            std::vector<EdgeId> prev_edges(vertex_count, NO_EDGE);
+            std::vector<VertexId> touched;
+
+            // Search from the hub over outgoing edges fills backward labels,
+            // over incoming edges it fills forward labels.
+            const auto search = [&](uint32_t rank, bool is_forward) {
+                const VertexId hub_vertex = hub_vertices[rank];
+                const Label& hub_label = is_forward ? forward[hub_vertex] : backward[hub_vertex];
+                std::vector<Label>& filled_labels = is_forward ? backward : forward;
+                for (const Entry& entry : hub_label) {
+                    hub_weights[entry.hub] = entry.weight;
+                }
+
+                using QueueItem = std::pair<Weight, VertexId>;
+                std::priority_queue<QueueItem, std::vector<QueueItem>, std::greater<QueueItem>> queue;
+                weights[hub_vertex] = 0;
+                touched.push_back(hub_vertex);
+                queue.push({0, hub_vertex});
+                while (!queue.empty()) {
+                    // Plain copies, relax below captures them.
+                    const Weight weight = queue.top().first;
+                    const VertexId vertex = queue.top().second;
+                    queue.pop();
+                    if (weight > *weights[vertex]) {
+                        continue;
+                    }
+                    bool is_covered = false;
+                    for (const Entry& entry : filled_labels[vertex]) {
+                        if (hub_weights[entry.hub] && *hub_weights[entry.hub] + entry.weight <= weight) {
+                            is_covered = true;
+                            break;
+                        }
+                    }
+                    if (is_covered) {
+                        continue;
+                    }
+                    filled_labels[vertex].push_back({rank, weight, prev_edges[vertex]});
+
+                    const auto relax = [&](EdgeId edge_id, VertexId next) {
+                        const Weight candidate_weight = weight + graph.GetEdge(edge_id).weight;
+                        auto& next_weight = weights[next];
+                        if (!next_weight) {
+                            touched.push_back(next);
+                        } else if (candidate_weight >= *next_weight) {
+                            return;
+                        }
+                        next_weight = candidate_weight;
+                        prev_edges[next] = edge_id;
+                        queue.push({candidate_weight, next});
+                    };
+                    if (is_forward) {
+                        for (const EdgeId edge_id : graph.GetIncidentEdges(vertex)) {
+                            relax(edge_id, graph.GetEdge(edge_id).to);
+                        }
+                    } else {
+                        for (const EdgeId edge_id : reverse_incidence.GetIncomingEdges(vertex)) {
+                            relax(edge_id, graph.GetEdge(edge_id).from);
+                        }
+                    }
+                }
+
+                for (const VertexId vertex : touched) {
+                    weights[vertex].reset();
+                    prev_edges[vertex] = NO_EDGE;
+                }
+                touched.clear();
+                for (const Entry& entry : hub_label) {
+                    hub_weights[entry.hub].reset();
+                }
+            };
+            for (uint32_t rank = 0; rank < vertex_count; ++rank) {
+                search(rank, true);
+                search(rank, false);
+            }
+
+            // Hubs are added in rank order, so every label is already sorted.
+            const auto compress = [vertex_count](std::vector<Label>& vertex_labels, LabelSet& label_set) {
+                std::vector<uint64_t> offsets(vertex_count + 1);
+                for (VertexId vertex = 0; vertex < vertex_count; ++vertex) {
+                    offsets[vertex + 1] = offsets[vertex] + vertex_labels[vertex].size();
+                }
+                std::vector<uint32_t> hubs;
+                std::vector<Weight> weights;
+                std::vector<EdgeId> edges;
+                hubs.reserve(offsets.back());
+                weights.reserve(offsets.back());
+                edges.reserve(offsets.back());
+                for (auto& label : vertex_labels) {
+                    for (const Entry& entry : label) {
+                        hubs.push_back(entry.hub);
+                        weights.push_back(entry.weight);
+                        edges.push_back(entry.edge);
+                    }
+                    Label().swap(label);
+                }
+                label_set = {std::move(offsets), std::move(hubs), std::move(weights), std::move(edges)};
+            };
+            compress(forward, labels->forward);
+            compress(backward, labels->backward);
+            labels->hub_vertices = std::move(hub_vertices);
+            return labels;
+        }
+
+    template <typename Weight>
+        std::optional<std::pair<Weight, uint32_t>> HubLabelRouter<Weight>::Query(VertexId from, VertexId to) const {
+            const LabelSet& forward = labels_->forward;
+            const LabelSet& backward = labels_->backward;
+            uint64_t forward_idx = forward.offsets[from];
+            const uint64_t forward_end = forward.offsets[from + 1];
+            uint64_t backward_idx = backward.offsets[to];
+            const uint64_t backward_end = backward.offsets[to + 1];
+
+            std::optional<std::pair<Weight, uint32_t>> best;
+            while (forward_idx < forward_end && backward_idx < backward_end) {
+                const uint32_t forward_hub = forward.hubs[forward_idx];
+                const uint32_t backward_hub = backward.hubs[backward_idx];
+                if (forward_hub < backward_hub) {
+                    ++forward_idx;
+                } else if (backward_hub < forward_hub) {
+                    ++backward_idx;
+                } else {
+                    const Weight weight = forward.weights[forward_idx] + backward.weights[backward_idx];
+                    if (!best || weight < best->first) {
+                        best = {weight, forward_hub};
+                    }
+                    ++forward_idx;
+                    ++backward_idx;
+                }
+            }
+            return best;
+        }
+
+    template <typename Weight>
+        std::optional<Weight> HubLabelRouter<Weight>::GetRouteWeight(VertexId from, VertexId to) const {
+            const auto best = Query(from, to);
+            if (!best) {
+                return std::nullopt;
+            }
+            return best->first;
+        }
+
+    template <typename Weight>
+        std::optional<typename HubLabelRouter<Weight>::RouteInfo> HubLabelRouter<Weight>::BuildRoute(VertexId from, VertexId to) const {
+            const auto best = Query(from, to);
+            if (!best) {
+                return std::nullopt;
+            }
+            const auto [weight, hub] = *best;
+            const VertexId hub_vertex = labels_->hub_vertices[hub];
+
+            std::vector<EdgeId> edges;
+            for (VertexId vertex = from; vertex != hub_vertex; ) {
+                const EdgeId edge_id = labels_->forward.edges[labels_->forward.Find(vertex, hub)];
+                edges.push_back(edge_id);
+                vertex = graph_.GetEdge(edge_id).to;
+            }
+            const size_t to_hub_edge_count = edges.size();
+            for (VertexId vertex = to; vertex != hub_vertex; ) {
+                const EdgeId edge_id = labels_->backward.edges[labels_->backward.Find(vertex, hub)];
+                edges.push_back(edge_id);
+                vertex = graph_.GetEdge(edge_id).from;
+            }
+            std::reverse(edges.begin() + to_hub_edge_count, edges.end());
+            return this->SaveRoute(weight, std::move(edges));
+        }
+
+}
@@ -99,7 +99,9 @@ namespace Json {
     return Document{LoadNode(input)};
   }
 
-  ostream& operator << (ostream& stream, const Node& node) {
+  static ostream& PrintNode(ostream& stream, const Node& node, bool multiline) {
+      const char* open_separator = multiline ? "\n" : "";
+      const char* item_separator = multiline ? ",\n" : ",";
 
       if (holds_alternative<string>(node)) {
           return stream << "\"" << node.AsString() << "\"";
@@ -115,29 +117,49 @@ namespace Json {
           }
       }
       if (holds_alternative<map<string, Node>>(node)) {
-          stream << "{\n";
+          stream << "{" << open_separator;
           bool first = true;
           for (const auto& kv : node.AsMap()) {
               if (!first) {
-                  stream << ",\n";
+                  stream << item_separator;
               }
               first = false;
-              stream << "\"" << kv.first << "\"" << ": " << kv.second;
+              stream << "\"" << kv.first << "\"" << ": ";
+              PrintNode(stream, kv.second, multiline);
           }
-          return stream << "\n}";
+          return stream << open_separator << "}";
       }
       if (holds_alternative<vector<Node>>(node)) {
-          stream << "[\n";
+          // Rows of numbers, e.g. of a time matrix, stay on one line.
+          const auto& items = node.AsVector();
+          bool is_row = multiline && !items.empty();
+          for (const auto& x : items) {
+              is_row = is_row && holds_alternative<double>(x);
+          }
+          if (is_row) {
+              PrintCompact(stream, node);
+              return stream;
+          }
+          stream << "[" << open_separator;
           bool first = true;
-          for (const auto& x : node.AsVector()) {
+          for (const auto& x : items) {
               if (!first) {
-                  stream << ",\n";
+                  stream << item_separator;
               }
               first = false;
-              stream << x;
+              PrintNode(stream, x, multiline);
           }
-          return stream << "\n]";
+          return stream << open_separator << "]";
       }
+      return stream;
+  }
+
+  ostream& operator << (ostream& stream, const Node& node) {
+      return PrintNode(stream, node, true);
+  }
+
+  void PrintCompact(ostream& stream, const Node& node) {
+      PrintNode(stream, node, false);
   }
 
   ostream& operator << (std::ostream& stream, const Document& document) {
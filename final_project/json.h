@@ -54,5 +54,7 @@ namespace Json {
   Document Load(std::istream& input);
 
   std::ostream& operator << (std::ostream& stream, const Node& node);
+  // Same as operator << but on a single line, for line-delimited streams.
+  void PrintCompact(std::ostream& stream, const Node& node);
   std::ostream& operator << (std::ostream& stream, const Document& document);
 }
@@ -2,11 +2,27 @@
 #include "geo.h"
 #include "transport_system.h"
 #include "request.h"
+#include "transport_system_versions.h"
+#include "server.h"
+#include "bounded_queue.h"
+#include "memory_accounting.h"
+#include "metrics.h"
+#include "perf_counters.h"
+#include "trace.h"
 
+#include <csignal>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <set>
 #include <sstream>
 #include <fstream>
+#include <thread>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 using namespace std;
 
@@ -725,6 +741,1068 @@ void TestFullFlow() {
     ASSERT_EQUAL(our_ans, model_ans);
 }
 
+void TestBuildGraphThreadCount() {
+    ifstream request_stream;
+    request_stream.open("./full_flow_test.txt", ifstream::in);
+    const auto [write_requests, read_requests] = ReadRequests(request_stream);
+
+    TransportSystem sequential_ts;
+    ProcessWriteRequests(write_requests, sequential_ts);
+    sequential_ts.BuildGraph(1);
+    const auto expected = ProcessReadRequests(read_requests, sequential_ts);
+
+    for (size_t thread_count : {2, 4, 16}) {
+        TransportSystem ts;
+        ProcessWriteRequests(write_requests, ts);
+        ts.BuildGraph(thread_count);
+        ASSERT(ProcessReadRequests(read_requests, ts) == expected);
+    }
+}
+
+void TestNestedParallelFor() {
+    // Inner loops stay on the thread of their outer iteration.
+    vector<size_t> sums(8);
+    vector<char> same_thread(8, true);
+    ParallelFor(sums.size(), 4, [&](size_t i) {
+        const auto outer_thread = this_thread::get_id();
+        vector<size_t> values(100);
+        ParallelFor(values.size(), 4, [&](size_t j) {
+            values[j] = j;
+            if (this_thread::get_id() != outer_thread) {
+                same_thread[i] = false;
+            }
+        });
+        for (const size_t value : values) {
+            sums[i] += value;
+        }
+    });
+    ASSERT(sums == vector<size_t>(8, 4950));
+    ASSERT(same_thread == vector<char>(8, true));
+}
+
+void TestProcessReadRequestsThreadCount() {
+    ifstream request_stream;
+    request_stream.open("./full_flow_test.txt", ifstream::in);
+    const auto [write_requests, read_requests] = ReadRequests(request_stream);
+
+    TransportSystem ts;
+    ProcessWriteRequests(write_requests, ts);
+    ts.BuildGraph();
+    const auto expected = ProcessReadRequests(read_requests, ts, 1);
+
+    for (size_t thread_count : {2, 4, 32}) {
+        ASSERT(ProcessReadRequests(read_requests, ts, thread_count) == expected);
+    }
+}
+
+void TestRouteCache() {
+    TransportSystem ts;
+    ts.SetParams(2, 1);
+    ts.AddStop("A", 0, 0, {{"B", 10}});
+    ts.AddStop("B", 0, 0, {{"C", 20}});
+    ts.AddStop("C", 0, 0);
+    ts.AddStraightBus("bus", {"A", "B", "C"});
+    ts.BuildGraph();
+
+    const auto first = ts.FindRoute(0, 2);
+    ASSERT(first != nullptr);
+    ASSERT_EQUAL(first->total_time, 32.0);
+    ASSERT_EQUAL(first->items.AsVector().size(), 2);
+    ASSERT(ts.FindRoute(0, 2) == first);
+    ASSERT_EQUAL(ts.GetRouteCacheStats().hits, 1);
+    ASSERT_EQUAL(ts.GetRouteCacheStats().misses, 1);
+
+    ts.AddStop("A", 0, 0, {{"B", 5}});
+    ASSERT_EQUAL(ts.GetRouteCacheStats().size, 0);
+    ts.BuildGraph();
+    ASSERT_EQUAL(ts.FindRoute(0, 2)->total_time, 27.0);
+    ASSERT_EQUAL(ts.GetRouteCacheStats().misses, 2);
+
+    ts.SetRouteCacheCapacity(0);
+    ts.FindRoute(0, 2);
+    ts.FindRoute(0, 2);
+    ASSERT_EQUAL(ts.GetRouteCacheStats().size, 0);
+    ASSERT_EQUAL(ts.GetRouteCacheStats().misses, 4);
+
+    // Keys of a few stops spread over all shards, far more of them than
+    // one shard holds stay cached.
+    const RouteCache cache(1024);
+    const auto answer = make_shared<const RouteAnswer>(RouteAnswer{1, Json::Node(vector<Json::Node>{})});
+    for (size_t from = 0; from < 20; ++from) {
+        for (size_t to = 0; to < 10; ++to) {
+            cache.Put({from, to}, answer);
+        }
+    }
+    ASSERT_EQUAL(cache.GetStats().size, 200u);
+    for (size_t from = 0; from < 20; ++from) {
+        for (size_t to = 0; to < 10; ++to) {
+            ASSERT(cache.Get({from, to}).has_value());
+        }
+    }
+}
+
+void TestDijkstraRouter() {
+    ifstream request_stream;
+    request_stream.open("./full_flow_test.txt", ifstream::in);
+    const auto [write_requests, read_requests] = ReadRequests(request_stream);
+
+    TransportSystem all_pairs_ts;
+    ProcessWriteRequests(write_requests, all_pairs_ts);
+    all_pairs_ts.BuildGraph();
+    const auto expected = ProcessReadRequests(read_requests, all_pairs_ts);
+
+    TransportSystem dijkstra_ts;
+    ProcessWriteRequests(write_requests, dijkstra_ts);
+    dijkstra_ts.SetRouterType(TransportSystem::RouterType::DIJKSTRA);
+    dijkstra_ts.BuildGraph();
+    const auto responses = ProcessReadRequests(read_requests, dijkstra_ts);
+
+    ASSERT_EQUAL(responses.AsVector().size(), expected.AsVector().size());
+    for (size_t i = 0; i < responses.AsVector().size(); ++i) {
+        const auto& response = responses.AsVector()[i].AsMap();
+        const auto& expected_response = expected.AsVector()[i].AsMap();
+        ASSERT_EQUAL(response.at("request_id").AsInt(), expected_response.at("request_id").AsInt());
+        ASSERT_EQUAL(response.count("total_time"), expected_response.count("total_time"));
+        if (response.count("total_time")) {
+            ASSERT(abs(response.at("total_time").AsDouble() - expected_response.at("total_time").AsDouble()) < 1e-9);
+        }
+    }
+}
+
+// Answers of a system with the given router against the all-pairs one.
+static void AssertSameRouteTimes(TransportSystem::RouterType router_type) {
+    ifstream request_stream;
+    request_stream.open("./full_flow_test.txt", ifstream::in);
+    const auto [write_requests, read_requests] = ReadRequests(request_stream);
+
+    TransportSystem all_pairs_ts;
+    ProcessWriteRequests(write_requests, all_pairs_ts);
+    all_pairs_ts.BuildGraph();
+    const auto expected = ProcessReadRequests(read_requests, all_pairs_ts);
+
+    TransportSystem ts;
+    ProcessWriteRequests(write_requests, ts);
+    ts.SetRouterType(router_type);
+    ts.BuildGraph();
+    const auto responses = ProcessReadRequests(read_requests, ts);
+    ASSERT_EQUAL(responses.AsVector().size(), expected.AsVector().size());
+    for (size_t i = 0; i < responses.AsVector().size(); ++i) {
+        const auto& response = responses.AsVector()[i].AsMap();
+        const auto& expected_response = expected.AsVector()[i].AsMap();
+        ASSERT_EQUAL(response.count("total_time"), expected_response.count("total_time"));
+        if (response.count("total_time")) {
+            ASSERT(abs(response.at("total_time").AsDouble() - expected_response.at("total_time").AsDouble()) < 1e-9);
+        }
+    }
+}
+
+// Small graph with a cycle, a zero edge and an unreachable vertex 5.
+static Graph::DirectedWeightedGraph<double> MakeRouterTestGraph() {
+    return Graph::DirectedWeightedGraph<double>(6, {
+        {0, 1, 1}, {1, 2, 2}, {0, 2, 4}, {2, 3, 1}, {3, 0, 1}, {1, 3, 5}, {4, 3, 2}, {3, 4, 0}
+    });
+}
+
+// Every pair of vertices: same weight as the matrix, and the route is a
+// chain of edges from one end to the other of that weight.
+static void AssertRoutesMatchMatrix(const Graph::DirectedWeightedGraph<double>& graph,
+                                    const Graph::RouterBase<double>& router) {
+    const Graph::Router<double> matrix(graph);
+    for (Graph::VertexId from = 0; from < graph.GetVertexCount(); ++from) {
+        for (Graph::VertexId to = 0; to < graph.GetVertexCount(); ++to) {
+            const auto expected_weight = matrix.GetRouteWeight(from, to);
+            const auto route = router.BuildRoute(from, to);
+            ASSERT_EQUAL(route.has_value(), expected_weight.has_value());
+            if (!route) {
+                continue;
+            }
+            ASSERT_EQUAL(route->weight, *expected_weight);
+            Graph::VertexId vertex = from;
+            double weight = 0;
+            for (size_t edge_idx = 0; edge_idx < route->edge_count; ++edge_idx) {
+                const auto& edge = graph.GetEdge(router.GetRouteEdge(route->id, edge_idx));
+                ASSERT_EQUAL(edge.from, vertex);
+                vertex = edge.to;
+                weight += edge.weight;
+            }
+            router.ReleaseRoute(route->id);
+            ASSERT_EQUAL(vertex, to);
+            ASSERT_EQUAL(weight, *expected_weight);
+        }
+    }
+}
+
+void TestHubLabelRouter() {
+    AssertSameRouteTimes(TransportSystem::RouterType::HUB_LABELS);
+
+    const auto graph = MakeRouterTestGraph();
+    const Graph::HubLabelRouter<double> hub_labels(graph);
+    ASSERT(hub_labels.GetLabelEntryCount() < 2 * 6 * 6);
+    AssertRoutesMatchMatrix(graph, hub_labels);
+}
+
+void TestAltRouter() {
+    AssertSameRouteTimes(TransportSystem::RouterType::ALT);
+
+    const auto graph = MakeRouterTestGraph();
+    for (size_t landmark_count : {1, 2, 16}) {
+        const Graph::AltRouter<double> alt(graph, landmark_count, 2);
+        ASSERT(!alt.GetLandmarks().empty());
+        ASSERT(alt.GetLandmarks().size() <= landmark_count);
+        const set<Graph::VertexId> landmarks(alt.GetLandmarks().begin(), alt.GetLandmarks().end());
+        ASSERT_EQUAL(landmarks.size(), alt.GetLandmarks().size());
+        // Twice over the same pooled states.
+        AssertRoutesMatchMatrix(graph, alt);
+        AssertRoutesMatchMatrix(graph, alt);
+    }
+
+    // Vertex 0 reaches nothing, landmarks must still cover the cycle.
+    const Graph::DirectedWeightedGraph<double> sink_graph(5, {
+        {1, 0, 1}, {1, 2, 1}, {2, 3, 2}, {3, 4, 3}, {4, 1, 1}
+    });
+    const Graph::AltRouter<double> sink_alt(sink_graph, 2, 2);
+    ASSERT_EQUAL(sink_alt.GetLandmarks().size(), 2u);
+    AssertRoutesMatchMatrix(sink_graph, sink_alt);
+}
+
+void TestBidirectionalDijkstraRouter() {
+    AssertSameRouteTimes(TransportSystem::RouterType::BIDIRECTIONAL_DIJKSTRA);
+
+    // Twice over the same states, stale marks of the first round must not
+    // leak into the second.
+    auto graph = MakeRouterTestGraph();
+    Graph::BidirectionalDijkstraRouter<double> router(graph);
+    AssertRoutesMatchMatrix(graph, router);
+    AssertRoutesMatchMatrix(graph, router);
+
+    Graph::GraphChanges<double> changes{graph.GetVertexCount()};
+    const Graph::VertexId vertex = graph.AddVertex();
+    changes.added_edges.push_back(graph.AddEdge({5, vertex, 3}));
+    changes.added_edges.push_back(graph.AddEdge({vertex, 0, 1}));
+    ASSERT(router.Update(changes));
+    AssertRoutesMatchMatrix(graph, router);
+}
+
+void TestComponentRouter() {
+    // {0, 1, 2} is a cycle leading to 3, {4, 5} another cycle, 6 is alone
+    // and 7 has only a loop.
+    Graph::DirectedWeightedGraph<double> graph(8, {
+        {0, 1, 1}, {1, 2, 2}, {2, 0, 1}, {2, 3, 5}, {4, 5, 1}, {5, 4, 1}, {7, 7, 1}
+    });
+    const auto components = Graph::ComputeComponents(graph);
+    ASSERT_EQUAL(components.weak_count, 4);
+    ASSERT_EQUAL(components.weak, vector<uint32_t>({0, 0, 0, 0, 1, 1, 2, 3}));
+    ASSERT_EQUAL(components.strong_count, 5);
+    ASSERT_EQUAL(components.strong[0], components.strong[2]);
+    ASSERT(components.strong[3] < components.strong[0]);
+    ASSERT_EQUAL(components.strong[4], components.strong[5]);
+
+    const auto factory = [](const Graph::DirectedWeightedGraph<double>& component_graph, size_t) {
+        return make_unique<Graph::Router<double>>(component_graph);
+    };
+    Graph::ComponentRouter<double> router(graph, factory, {}, {}, 2);
+    ASSERT_EQUAL(router.GetComponentCount(), 4);
+    ASSERT(router.GetComponentRouter(0) != nullptr);
+    ASSERT(router.GetComponentRouter(2) == nullptr);
+    AssertRoutesMatchMatrix(graph, router);
+
+    // A change inside one component goes to its own router.
+    const auto copy = graph;
+    const auto clone = router.Clone(copy);
+    Graph::GraphChanges<double> changes{graph.GetVertexCount()};
+    graph.SetEdgeWeight(4, 3);
+    changes.reweighted_edges.push_back({4, 1});
+    ASSERT(router.Update(changes));
+    AssertRoutesMatchMatrix(graph, router);
+
+    // Components merge and a new vertex joins one.
+    changes.Reset(graph.GetVertexCount());
+    const Graph::VertexId vertex = graph.AddVertex();
+    changes.added_edges.push_back(graph.AddEdge({3, 4, 1}));
+    changes.added_edges.push_back(graph.AddEdge({6, vertex, 2}));
+    changes.added_edges.push_back(graph.AddEdge({1, 0, 4}));
+    ASSERT(router.Update(changes));
+    ASSERT_EQUAL(router.GetComponentCount(), 3);
+    AssertRoutesMatchMatrix(graph, router);
+
+    // The clone kept the routes of the graph it was made for.
+    AssertRoutesMatchMatrix(copy, *clone);
+}
+
+static void AssertIsPermutation(const vector<uint32_t>& ranks) {
+    vector<uint32_t> sorted_ranks = ranks;
+    sort(sorted_ranks.begin(), sorted_ranks.end());
+    for (size_t i = 0; i < sorted_ranks.size(); ++i) {
+        ASSERT_EQUAL(sorted_ranks[i], i);
+    }
+}
+
+void TestVertexOrder() {
+    const auto graph = MakeRouterTestGraph();
+    const auto breadth_first_ranks = Graph::ComputeBreadthFirstRanks(graph);
+    ASSERT_EQUAL(breadth_first_ranks.size(), graph.GetVertexCount());
+    AssertIsPermutation(breadth_first_ranks);
+    ASSERT_EQUAL(breadth_first_ranks[0], 0u);
+    const auto cuthill_mckee_ranks = Graph::ComputeCuthillMcKeeRanks(graph);
+    ASSERT_EQUAL(cuthill_mckee_ranks.size(), graph.GetVertexCount());
+    AssertIsPermutation(cuthill_mckee_ranks);
+
+    // Routes and their edges stay in the ids of the graph.
+    const auto factory = [](const Graph::DirectedWeightedGraph<double>& component_graph, size_t) {
+        return make_unique<Graph::Router<double>>(component_graph);
+    };
+    for (const auto& ranks : {breadth_first_ranks, cuthill_mckee_ranks, vector<uint32_t>{5, 4, 3, 2, 1, 0}}) {
+        const Graph::ComponentRouter<double> router(graph, factory, ranks);
+        ASSERT(router.GetVertexRanks() == ranks);
+        AssertRoutesMatchMatrix(graph, router);
+    }
+    bool thrown = false;
+    try {
+        Graph::ComponentRouter<double> router(graph, factory, {0, 1, 2, 3, 4, 4});
+    } catch (invalid_argument&) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+
+    ifstream request_stream;
+    request_stream.open("./full_flow_test.txt", ifstream::in);
+    const auto [write_requests, read_requests] = ReadRequests(request_stream);
+    TransportSystem input_ts;
+    ProcessWriteRequests(write_requests, input_ts);
+    input_ts.BuildGraph();
+    const auto expected = ProcessReadRequests(read_requests, input_ts);
+    for (auto vertex_order : {TransportSystem::VertexOrder::BREADTH_FIRST, TransportSystem::VertexOrder::CUTHILL_MCKEE,
+                              TransportSystem::VertexOrder::HILBERT}) {
+        TransportSystem ts;
+        ProcessWriteRequests(write_requests, ts);
+        ts.SetVertexOrder(vertex_order);
+        ts.BuildGraph();
+        ASSERT(ProcessReadRequests(read_requests, ts) == expected);
+
+        stringstream snapshot;
+        ts.SaveSnapshot(snapshot);
+        TransportSystem loaded_ts;
+        loaded_ts.LoadSnapshot(snapshot);
+        ASSERT(loaded_ts.GetVertexOrder() == vertex_order);
+        ASSERT(ProcessReadRequests(read_requests, loaded_ts) == expected);
+    }
+}
+
+void TestParallelEdgePruning() {
+    // Three edges from 0 to 1, two of them equal, and two from 1 to 2.
+    Graph::DirectedWeightedGraph<double> graph(4, {
+        {0, 1, 5}, {0, 1, 3}, {0, 1, 3}, {1, 2, 1}, {1, 2, 2}, {2, 3, 1}, {3, 0, 1}
+    });
+    const auto factory = [](const Graph::DirectedWeightedGraph<double>& component_graph, size_t) {
+        return make_unique<Graph::Router<double>>(component_graph);
+    };
+    const auto first_route_edge = [](const Graph::RouterBase<double>& router, Graph::VertexId from, Graph::VertexId to) {
+        const auto route = router.BuildRoute(from, to);
+        const Graph::EdgeId edge_id = router.GetRouteEdge(route->id, 0);
+        router.ReleaseRoute(route->id);
+        return edge_id;
+    };
+
+    Graph::ComponentRouter<double> router(graph, factory);
+    ASSERT_EQUAL(router.GetPrunedEdgeCount(), 3);
+    ASSERT_EQUAL(first_route_edge(router, 0, 1), 1);
+    AssertRoutesMatchMatrix(graph, router);
+    const Graph::ComponentRouter<double> later_first_router(graph, factory, {}, [](Graph::EdgeId lhs, Graph::EdgeId rhs) {
+        return lhs > rhs;
+    });
+    ASSERT_EQUAL(first_route_edge(later_first_router, 0, 1), 2);
+
+    // The kept edge gets slower, its twin takes over.
+    Graph::GraphChanges<double> changes{graph.GetVertexCount()};
+    graph.SetEdgeWeight(1, 10);
+    changes.reweighted_edges.push_back({1, 3});
+    ASSERT(router.Update(changes));
+    ASSERT_EQUAL(first_route_edge(router, 0, 1), 2);
+    AssertRoutesMatchMatrix(graph, router);
+
+    // A faster new parallel edge and a new single one.
+    changes.Reset(graph.GetVertexCount());
+    changes.added_edges.push_back(graph.AddEdge({2, 3, 0.5}));
+    changes.added_edges.push_back(graph.AddEdge({3, 1, 1}));
+    ASSERT(router.Update(changes));
+    ASSERT_EQUAL(router.GetPrunedEdgeCount(), 4);
+    ASSERT_EQUAL(first_route_edge(router, 2, 3), 7);
+    AssertRoutesMatchMatrix(graph, router);
+
+    // Buses 297 and 635 both go from Biryulyovo Tovarnaya to Universam.
+    ifstream request_stream;
+    request_stream.open("./full_flow_test.txt", ifstream::in);
+    const auto [write_requests, read_requests] = ReadRequests(request_stream);
+    TransportSystem ts;
+    ProcessWriteRequests(write_requests, ts);
+    ASSERT_EQUAL(ts.GetPrunedEdgeCount(), 0);
+    ts.BuildGraph();
+    ASSERT(ts.GetPrunedEdgeCount() > 0);
+}
+
+void TestBatchedRoutesPruned() {
+    // Both buses take as long from A to B, the one added first with a stop
+    // in between. A route alone and one in a batch both take the direct one.
+    for (auto router_type : {TransportSystem::RouterType::DIJKSTRA, TransportSystem::RouterType::BIDIRECTIONAL_DIJKSTRA}) {
+        TransportSystem ts;
+        ts.SetParams(2, 60);
+        ts.SetRouterType(router_type);
+        ts.AddStop("A", 0, 0, {{"B", 1000}, {"C", 500}});
+        ts.AddStop("B", 0, 0);
+        ts.AddStop("C", 0, 0, {{"B", 500}});
+        ts.AddStraightBus("slow2", {"A", "C", "B"});
+        ts.AddStraightBus("fast1", {"A", "B"});
+        ts.SetRouteCacheCapacity(0);
+        ts.BuildGraph();
+
+        const auto single = ts.FindRoute(0, 1);
+        const auto batched = ts.FindRoutes(0, {1, 2});
+        ASSERT(single != nullptr && batched[0] != nullptr);
+        ASSERT_EQUAL(single->total_time, batched[0]->total_time);
+        ASSERT(single->items == batched[0]->items);
+        const auto& bus = single->items.AsVector()[1].AsMap();
+        ASSERT_EQUAL(bus.at("bus").AsString(), "fast1");
+        ASSERT_EQUAL(bus.at("span_count").AsInt(), 1);
+
+        ASSERT_EQUAL(ts.GetTravelTimes({0}, {1})[0], single->total_time);
+        const auto stops = ts.FindStopsWithin(0, single->total_time);
+        ASSERT_EQUAL(stops.size(), 3u);
+        ASSERT_EQUAL(stops[0].first, 0u);
+    }
+}
+
+void TestTimeMatrix() {
+    ifstream request_stream;
+    request_stream.open("./full_flow_test.txt", ifstream::in);
+    const auto [write_requests, read_requests] = ReadRequests(request_stream);
+
+    for (auto router_type : {TransportSystem::RouterType::ALL_PAIRS, TransportSystem::RouterType::DIJKSTRA,
+                             TransportSystem::RouterType::BIDIRECTIONAL_DIJKSTRA}) {
+        TransportSystem ts;
+        ProcessWriteRequests(write_requests, ts);
+        ts.SetRouterType(router_type);
+        ts.AddDummyStop("Lonely");
+        ts.BuildGraph();
+
+        stringstream request_stream = stringstream(
+                    "{"
+                    "\"type\": \"TimeMatrix\","
+                    "\"from\": [\"Biryulyovo Zapadnoye\", \"Universam\"],"
+                    "\"to\": [\"Universam\", \"Prazhskaya\", \"Biryulyovo Zapadnoye\"],"
+                    "\"id\": 42"
+                    "}"
+                    );
+        Json::Document request_json = Json::Load(request_stream);
+        RequestHolder request_holder = ParseReadRequest(request_json.GetRoot());
+        ASSERT_EQUAL(request_holder->type, Request::Type::READ_TIME_MATRIX);
+        const auto& request = static_cast<const ReadTimeMatrixRequest&>(*request_holder);
+        Json::Node response = request.Process(ts);
+        ASSERT_EQUAL(response.AsMap().at("request_id").AsInt(), 42);
+        const auto& rows = response.AsMap().at("total_times").AsVector();
+        ASSERT_EQUAL(rows.size(), 2);
+        for (size_t row = 0; row < rows.size(); ++row) {
+            ASSERT_EQUAL(rows[row].AsVector().size(), 3);
+            for (size_t col = 0; col < 3; ++col) {
+                const auto route = ts.FindRoute(
+                        ts.GetStop(request.from[row])->id, ts.GetStop(request.to[col])->id);
+                ASSERT(route != nullptr);
+                ASSERT(abs(rows[row].AsVector()[col].AsDouble() - route->total_time) < 1e-9);
+            }
+        }
+        ASSERT_EQUAL(rows[0].AsVector()[2].AsDouble(), 0.0);
+        ASSERT_EQUAL(rows[0].AsVector()[0].AsDouble(), 11.235);
+
+        // One line per row of the matrix.
+        ostringstream output;
+        PrintResponses(Json::Node(vector<Json::Node>{response}), output);
+        ASSERT_EQUAL(output.str(), "[\n{\n\"request_id\": 42,\n\"total_times\": [\n"
+                                   "[11.235,24.21,0],\n[0,12.975,9.75]\n]\n}\n]");
+
+        const auto times = ts.GetTravelTimes({0}, {ts.GetStop("Lonely")->id});
+        ASSERT(isinf(times[0]));
+    }
+}
+
+void TestIsochrone() {
+    ifstream request_stream;
+    request_stream.open("./full_flow_test.txt", ifstream::in);
+    const auto [write_requests, read_requests] = ReadRequests(request_stream);
+    TransportSystem ts;
+    ProcessWriteRequests(write_requests, ts);
+    ts.AddDummyStop("Lonely");
+    ts.BuildGraph();
+
+    const auto process = [&ts](const string& request_str) {
+        stringstream request_stream(request_str);
+        Json::Document request_json = Json::Load(request_stream);
+        RequestHolder request_holder = ParseReadRequest(request_json.GetRoot());
+        ASSERT_EQUAL(request_holder->type, Request::Type::READ_ISOCHRONE);
+        const auto& request = static_cast<const ReadIsochroneRequest&>(*request_holder);
+        return request.Process(ts);
+    };
+
+    // Every stop with a route of at most 30 minutes, at the time of that
+    // route and nearest first.
+    const double max_time = 30;
+    const auto from = ts.GetStop("Biryulyovo Zapadnoye");
+    const Json::Node response = process(
+                "{\"type\": \"Isochrone\", \"from\": \"Biryulyovo Zapadnoye\", \"max_time\": 30, \"id\": 42}");
+    ASSERT_EQUAL(response.AsMap().at("request_id").AsInt(), 42);
+    const auto& stops = response.AsMap().at("stops").AsVector();
+    set<string> reached;
+    double last_time = 0;
+    for (const auto& stop : stops) {
+        const string& stop_name = stop.AsMap().at("stop_name").AsString();
+        const double time = stop.AsMap().at("time").AsDouble();
+        const auto route = ts.FindRoute(from->id, ts.GetStop(stop_name)->id);
+        ASSERT(route != nullptr);
+        ASSERT(abs(route->total_time - time) < 1e-9);
+        ASSERT(time >= last_time);
+        last_time = time;
+        reached.insert(stop_name);
+    }
+    ASSERT_EQUAL(stops.at(0).AsMap().at("stop_name").AsString(), from->name);
+    ASSERT(!reached.count("Lonely"));
+    // "Lonely" came last.
+    for (Stop::ID stop_id = 0; stop_id <= ts.GetStop("Lonely")->id; ++stop_id) {
+        const auto route = ts.FindRoute(from->id, stop_id);
+        ASSERT_EQUAL(route && route->total_time <= max_time, reached.count(ts.GetStop(stop_id)->name) > 0);
+    }
+
+    // A cap keeps the nearest stops.
+    const Json::Node capped_response = process(
+                "{\"type\": \"Isochrone\", \"from\": \"Biryulyovo Zapadnoye\", \"max_time\": 30, \"max_count\": 2,"
+                " \"id\": 43}");
+    const auto& capped_stops = capped_response.AsMap().at("stops").AsVector();
+    ASSERT_EQUAL(capped_stops.size(), min<size_t>(2, stops.size()));
+    for (size_t i = 0; i < capped_stops.size(); ++i) {
+        ASSERT_EQUAL(capped_stops[i], stops[i]);
+    }
+
+    const Json::Node missing_response = process(
+                "{\"type\": \"Isochrone\", \"from\": \"Samara\", \"max_time\": 30, \"id\": 44}");
+    ASSERT_EQUAL(missing_response.AsMap().at("error_message").AsString(), "not found");
+
+    // A negative cap is rejected instead of wrapping around to no cap.
+    bool thrown = false;
+    try {
+        process("{\"type\": \"Isochrone\", \"from\": \"Biryulyovo Zapadnoye\", \"max_time\": 30, \"max_count\": -1,"
+                " \"id\": 45}");
+    } catch (invalid_argument&) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+}
+
+void TestSnapshot() {
+    ifstream request_stream;
+    request_stream.open("./full_flow_test.txt", ifstream::in);
+    const auto [write_requests, read_requests] = ReadRequests(request_stream);
+
+    for (auto router_type : {TransportSystem::RouterType::ALL_PAIRS, TransportSystem::RouterType::DIJKSTRA,
+                             TransportSystem::RouterType::HUB_LABELS, TransportSystem::RouterType::ALT,
+                             TransportSystem::RouterType::BIDIRECTIONAL_DIJKSTRA}) {
+        TransportSystem ts;
+        ProcessWriteRequests(write_requests, ts);
+        ts.SetRouterType(router_type);
+        ts.BuildGraph();
+        stringstream snapshot;
+        ts.SaveSnapshot(snapshot);
+
+        TransportSystem loaded_ts;
+        loaded_ts.LoadSnapshot(snapshot);
+        ASSERT(loaded_ts.GetRouterType() == router_type);
+        ASSERT_EQUAL(loaded_ts.GetWaitTime(), ts.GetWaitTime());
+        ASSERT_EQUAL(loaded_ts.GetVelocity(), ts.GetVelocity());
+        ASSERT(ProcessReadRequests(read_requests, loaded_ts) == ProcessReadRequests(read_requests, ts));
+
+        const string snapshot_path = "./snapshot_test.bin";
+        {
+            ofstream snapshot_file(snapshot_path, ios::binary);
+            ts.SaveSnapshot(snapshot_file);
+        }
+        TransportSystem mapped_ts;
+        mapped_ts.MapSnapshot(snapshot_path);
+        remove(snapshot_path.c_str());
+        ASSERT(ProcessReadRequests(read_requests, mapped_ts) == ProcessReadRequests(read_requests, ts));
+
+        // Mapped parts are updated on copies.
+        for (auto* changed_ts : {&ts, &mapped_ts}) {
+            changed_ts->AddStop("Tolstopaltsevo", 55.611087, 37.20829, {{"Prazhskaya", 1000}});
+            changed_ts->AddStraightBus("750", {"Tolstopaltsevo", "Prazhskaya", "Biryulyovo Zapadnoye"});
+        }
+        ASSERT(ProcessReadRequests(read_requests, mapped_ts) == ProcessReadRequests(read_requests, ts));
+        ASSERT(mapped_ts.FindRoute(ts.GetStop("Tolstopaltsevo")->id, ts.GetStop("Biryulyovo Zapadnoye")->id) != nullptr);
+    }
+
+    stringstream broken_snapshot("not a snapshot");
+    TransportSystem ts;
+    bool thrown = false;
+    try {
+        ts.LoadSnapshot(broken_snapshot);
+    } catch (runtime_error&) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+
+    // Router type and vertex order follow the two doubles at the start of META,
+    // whose offset is the first one in the header.
+    ProcessWriteRequests(write_requests, ts);
+    ts.BuildGraph();
+    for (size_t byte : {2 * sizeof(double), 2 * sizeof(double) + 1}) {
+        stringstream snapshot;
+        ts.SaveSnapshot(snapshot);
+        string bytes = snapshot.str();
+        uint64_t meta_offset;
+        memcpy(&meta_offset, bytes.data() + 2 * sizeof(uint32_t), sizeof(meta_offset));
+        bytes[meta_offset + byte] = char(0x7f);
+        stringstream corrupted_snapshot(bytes);
+        TransportSystem loaded_ts;
+        thrown = false;
+        try {
+            loaded_ts.LoadSnapshot(corrupted_snapshot);
+        } catch (runtime_error& e) {
+            thrown = string(e.what()).find("corrupted snapshot") == 0;
+        }
+        ASSERT(thrown);
+    }
+}
+
+void TestIncrementalUpdate() {
+    ifstream request_stream;
+    request_stream.open("./full_flow_test.txt", ifstream::in);
+    const auto [write_requests, read_requests] = ReadRequests(request_stream);
+
+    const auto change_network = [](TransportSystem& ts) {
+        const auto universam = ts.GetStop("Universam");
+        ts.AddStop("Universam", universam->lat, universam->lon,
+                {{"Prazhskaya", 9000}, {"Biryulyovo Tovarnaya", 300}, {"Biryulyovo Zapadnoye", 2500}});
+        ts.AddStop("Tolstopaltsevo", 55.611087, 37.20829, {{"Prazhskaya", 1000}});
+        ts.AddStraightBus("750", {"Tolstopaltsevo", "Prazhskaya", "Marushkino"});
+        ts.AddStop("Marushkino", 55.595884, 37.209755);
+    };
+
+    for (auto router_type : {TransportSystem::RouterType::ALL_PAIRS, TransportSystem::RouterType::DIJKSTRA,
+                             TransportSystem::RouterType::BIDIRECTIONAL_DIJKSTRA}) {
+        TransportSystem updated_ts;
+        ProcessWriteRequests(write_requests, updated_ts);
+        updated_ts.SetRouterType(router_type);
+        updated_ts.BuildGraph();
+        updated_ts.FindRoute(0, 1);
+        change_network(updated_ts);
+
+        TransportSystem rebuilt_ts;
+        ProcessWriteRequests(write_requests, rebuilt_ts);
+        rebuilt_ts.SetRouterType(router_type);
+        change_network(rebuilt_ts);
+        rebuilt_ts.BuildGraph();
+
+        vector<Stop::ID> stop_ids;
+        for (Stop::ID id = 0; id <= rebuilt_ts.GetStop("Marushkino")->id; ++id) {
+            stop_ids.push_back(id);
+        }
+        const auto times = updated_ts.GetTravelTimes(stop_ids, stop_ids);
+        const auto expected_times = rebuilt_ts.GetTravelTimes(stop_ids, stop_ids);
+        ASSERT_EQUAL(times.size(), expected_times.size());
+        for (size_t i = 0; i < times.size(); ++i) {
+            ASSERT(times[i] == expected_times[i] || abs(times[i] - expected_times[i]) < 1e-9);
+        }
+
+        for (Stop::ID from : stop_ids) {
+            for (Stop::ID to : stop_ids) {
+                const auto route = updated_ts.FindRoute(from, to);
+                const auto expected_route = rebuilt_ts.FindRoute(from, to);
+                ASSERT_EQUAL(route == nullptr, expected_route == nullptr);
+                if (route) {
+                    ASSERT(abs(route->total_time - expected_route->total_time) < 1e-9);
+                }
+            }
+        }
+    }
+}
+
+void TestTransportSystemVersions() {
+    ifstream request_stream;
+    request_stream.open("./full_flow_test.txt", ifstream::in);
+    const auto [write_requests, read_requests] = ReadRequests(request_stream);
+
+    auto initial_ts = make_unique<TransportSystem>();
+    ProcessWriteRequests(write_requests, *initial_ts);
+    initial_ts->BuildGraph();
+    TransportSystemVersions versions(move(initial_ts));
+
+    const auto all_times = [](const TransportSystem& ts) {
+        vector<Stop::ID> stop_ids;
+        for (Stop::ID id = 0; id <= ts.GetStop("Prazhskaya")->id; ++id) {
+            stop_ids.push_back(id);
+        }
+        return ts.GetTravelTimes(stop_ids, stop_ids, 1);
+    };
+    const auto old_version = versions.Pin();
+    const auto old_times = all_times(*old_version);
+    const auto old_distances = old_version->GetStop("Universam")->distances;
+
+    const auto change_network = [](TransportSystem& ts) {
+        const auto universam = ts.GetStop("Universam");
+        ts.AddStop("Universam", universam->lat, universam->lon,
+                {{"Prazhskaya", 9000}, {"Biryulyovo Tovarnaya", 300}, {"Biryulyovo Zapadnoye", 2500}});
+        ts.AddStraightBus("750", {"Biryulyovo Zapadnoye", "Prazhskaya"});
+    };
+
+    TransportSystem rebuilt_ts;
+    ProcessWriteRequests(write_requests, rebuilt_ts);
+    change_network(rebuilt_ts);
+    rebuilt_ts.BuildGraph();
+    const auto new_times = all_times(rebuilt_ts);
+
+    vector<thread> readers;
+    atomic<bool> is_updated = false;
+    atomic<size_t> mismatches = 0;
+    for (size_t i = 0; i < 4; ++i) {
+        readers.emplace_back([&] {
+            do {
+                const auto version = versions.Pin();
+                const auto times = all_times(*version);
+                if (times != old_times && times != new_times) {
+                    ++mismatches;
+                }
+            } while (!is_updated);
+        });
+    }
+    versions.Update(change_network);
+    is_updated = true;
+    for (auto& reader : readers) {
+        reader.join();
+    }
+    ASSERT_EQUAL(mismatches.load(), size_t(0));
+
+    ASSERT(all_times(*old_version) == old_times);
+    ASSERT_EQUAL(old_version->GetStop("Universam")->distances, old_distances);
+    ASSERT(old_version->GetBus("750") == nullptr);
+    ASSERT(all_times(*versions.Pin()) == new_times);
+    ASSERT(versions.Pin()->GetBus("750") != nullptr);
+}
+
+void TestServer() {
+    ifstream request_stream;
+    request_stream.open("./full_flow_test.txt", ifstream::in);
+    const Json::Document document = Json::Load(request_stream);
+    const auto [write_requests, read_requests] = ReadRequests(document);
+
+    auto ts = make_unique<TransportSystem>();
+    ProcessWriteRequests(write_requests, *ts);
+    ts->BuildGraph();
+    map<int64_t, string> expected;
+    const auto responses = ProcessReadRequests(read_requests, *ts);
+    for (const auto& response : responses.AsVector()) {
+        ostringstream line;
+        Json::PrintCompact(line, response);
+        expected[response.AsMap().at("request_id").AsInt()] = line.str();
+    }
+
+    string requests;
+    for (const auto& request : document.GetRoot().AsMap().at("stat_requests").AsVector()) {
+        ostringstream line;
+        Json::PrintCompact(line, request);
+        requests += line.str() + "\n";
+    }
+    // Invalid requests are answered with their id when it can be read.
+    requests += "{\"type\": \"Unknown\", \"id\": 100}\n";
+    requests += "{\"type\": \"Route\"\n";
+
+    const auto check_responses = [&expected](const string& output) {
+        istringstream lines(output);
+        map<int64_t, string> responses;
+        vector<int64_t> error_ids;
+        size_t error_count = 0;
+        for (string line; getline(lines, line); ) {
+            istringstream line_stream(line);
+            const auto response = Json::Load(line_stream).GetRoot();
+            const auto& fields = response.AsMap();
+            if (fields.count("error_message") && fields.at("error_message").AsString() == "invalid request") {
+                ++error_count;
+                if (fields.count("request_id")) {
+                    error_ids.push_back(fields.at("request_id").AsInt());
+                }
+            } else {
+                responses[fields.at("request_id").AsInt()] = line;
+            }
+        }
+        ASSERT_EQUAL(responses, expected);
+        ASSERT_EQUAL(error_count, 2u);
+        ASSERT_EQUAL(error_ids, vector<int64_t>{100});
+    };
+
+    TransportSystemVersions versions(move(ts));
+    RequestServer server(versions, 2);
+    {
+        istringstream input(requests);
+        ostringstream output;
+        server.Serve(input, output);
+        check_responses(output.str());
+        ASSERT_EQUAL(server.GetLatencyStats().request_count, expected.size() + 2);
+    }
+
+    {
+        const string socket_path = "./server_test.sock";
+        remove(socket_path.c_str());
+        thread server_thread([&server, &socket_path] {
+            server.ServeUnixSocket(socket_path);
+        });
+
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        copy(socket_path.begin(), socket_path.end(), address.sun_path);
+        const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        while (connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0) {
+            this_thread::yield();
+        }
+        ASSERT_EQUAL(write(fd, requests.data(), requests.size()), ssize_t(requests.size()));
+        shutdown(fd, SHUT_WR);
+        string output;
+        char buffer[4096];
+        for (ssize_t size; (size = read(fd, buffer, sizeof(buffer))) > 0; ) {
+            output.append(buffer, size);
+        }
+        close(fd);
+
+        server.Stop();
+        server_thread.join();
+        check_responses(output);
+    }
+
+    // Requests read after an update see it, the ones before do not.
+    {
+        istringstream input(
+                "{\"type\": \"Bus\", \"name\": \"750\", \"id\": 200}\n"
+                "{\"base_requests\": [{\"type\": \"Bus\", \"name\": \"750\", \"stops\": [\"Universam\", \"Prazhskaya\"],"
+                " \"is_roundtrip\": false}], \"id\": 201}\n"
+                "{\"type\": \"Bus\", \"name\": \"750\", \"id\": 202}\n"
+                "{\"base_requests\": [{\"type\": \"Unknown\"}], \"id\": 203}\n");
+        ostringstream output;
+        server.Serve(input, output);
+        istringstream lines(output.str());
+        map<int64_t, Json::Node> update_responses;
+        for (string line; getline(lines, line); ) {
+            istringstream line_stream(line);
+            const auto response = Json::Load(line_stream).GetRoot();
+            update_responses[response.AsMap().at("request_id").AsInt()] = response;
+        }
+        ASSERT_EQUAL(update_responses.size(), 4u);
+        ASSERT_EQUAL(update_responses.at(200).AsMap().at("error_message").AsString(), "not found");
+        ASSERT_EQUAL(update_responses.at(201).AsMap().size(), 1u);
+        ASSERT_EQUAL(update_responses.at(202).AsMap().at("stop_count").AsInt(), 3);
+        ASSERT_EQUAL(update_responses.at(203).AsMap().at("error_message").AsString(), "invalid request");
+        ASSERT(versions.Pin()->GetBus("750") != nullptr);
+    }
+}
+
+void TestBoundedQueue() {
+    BoundedQueue<int> queue(3);
+    int value = 1;
+    for (; value <= 4; ++value) {
+        ASSERT(queue.TryPush(value));
+    }
+    ASSERT(!queue.TryPush(value));
+    ASSERT_EQUAL(value, 5);
+    ASSERT_EQUAL(queue.Pop(), 1);
+    ASSERT(queue.TryPush(value));
+
+    const int PRODUCER_COUNT = 3;
+    const int VALUE_COUNT = 10000;
+    BoundedQueue<int> shared_queue(16);
+    vector<thread> producers;
+    for (int producer = 0; producer < PRODUCER_COUNT; ++producer) {
+        producers.emplace_back([&shared_queue] {
+            for (int value = 1; value <= VALUE_COUNT; ++value) {
+                shared_queue.Push(value);
+            }
+        });
+    }
+    vector<int64_t> sums(2);
+    vector<thread> consumers;
+    for (auto& sum : sums) {
+        consumers.emplace_back([&shared_queue, &sum] {
+            for (int value; (value = shared_queue.Pop()) != 0; ) {
+                sum += value;
+            }
+        });
+    }
+    for (auto& producer : producers) {
+        producer.join();
+    }
+    for (size_t consumer = 0; consumer < consumers.size(); ++consumer) {
+        shared_queue.Push(0);
+    }
+    for (auto& consumer : consumers) {
+        consumer.join();
+    }
+    ASSERT_EQUAL(sums[0] + sums[1], int64_t(PRODUCER_COUNT) * VALUE_COUNT * (VALUE_COUNT + 1) / 2);
+}
+
+void TestProcessReadRequestsPipelined() {
+    ifstream request_stream;
+    request_stream.open("./full_flow_test.txt", ifstream::in);
+    const Json::Document document = Json::Load(request_stream);
+    const auto [write_requests, read_requests] = ReadRequests(document);
+
+    TransportSystem ts;
+    ProcessWriteRequests(write_requests, ts);
+    ts.BuildGraph();
+
+    // Enough copies of the requests to fill many chunks.
+    vector<Json::Node> requests_json;
+    vector<RequestHolder> requests;
+    for (size_t copy = 0; copy < 100; ++copy) {
+        const auto& stat_requests = ReadStatRequestsJson(document);
+        requests_json.insert(requests_json.end(), stat_requests.begin(), stat_requests.end());
+        requests.insert(requests.end(), read_requests.begin(), read_requests.end());
+    }
+    ostringstream expected;
+    PrintResponses(ProcessReadRequests(requests, ts), expected);
+
+    for (size_t thread_count : {1, 2, 3, 8}) {
+        ostringstream output;
+        ProcessReadRequestsPipelined(requests_json, ts, output, thread_count);
+        ASSERT_EQUAL(output.str(), expected.str());
+    }
+
+    ostringstream expected_empty, output_empty;
+    PrintResponses(ProcessReadRequests({}, ts), expected_empty);
+    ProcessReadRequestsPipelined({}, ts, output_empty);
+    ASSERT_EQUAL(output_empty.str(), expected_empty.str());
+}
+
+void TestLatencyHistogram() {
+    Metrics::LatencyHistogram histogram;
+    ASSERT_EQUAL(histogram.GetQuantile(0.5), 0);
+    for (uint64_t value = 1; value <= 1000; ++value) {
+        histogram.Record(value * 1000);
+    }
+    ASSERT_EQUAL(histogram.GetCount(), 1000);
+    ASSERT_EQUAL(histogram.GetMax(), 1000000);
+    for (double fraction : {0.5, 0.9, 0.99}) {
+        const double expected = fraction * 1000000;
+        ASSERT(abs(histogram.GetQuantile(fraction) - expected) <= expected / 16);
+    }
+    ASSERT_EQUAL(histogram.GetQuantile(1), 1000000);
+    histogram.Record(7);
+    ASSERT_EQUAL(histogram.GetQuantile(0), 7);
+
+    stringstream request_stream("{\"type\": \"Metrics\", \"id\": 5}");
+    const auto request = ParseReadRequest(Json::Load(request_stream).GetRoot());
+    ASSERT_EQUAL(request->type, Request::Type::READ_METRICS);
+    TransportSystem ts;
+    const auto response = static_cast<const ReadMetricsRequest&>(*request).Process(ts);
+    ASSERT_EQUAL(response.AsMap().at("request_id").AsInt(), 5);
+    ASSERT(response.AsMap().count("metrics"));
+}
+
+void TestTrace() {
+    ifstream request_stream;
+    request_stream.open("./full_flow_test.txt", ifstream::in);
+    const auto [write_requests, read_requests] = ReadRequests(request_stream);
+
+    Trace::Enable();
+    TransportSystem ts;
+    ProcessWriteRequests(write_requests, ts);
+    ts.BuildGraph(2);
+    thread([] {
+        TRACE_SCOPE("TestTrace thread");
+    }).join();
+
+    stringstream trace;
+    Trace::WriteJson(trace);
+    const auto events = Json::Load(trace).GetRoot().AsMap().at("traceEvents").AsVector();
+    map<string, set<int64_t>> name_to_threads;
+    for (const auto& event : events) {
+        const auto& fields = event.AsMap();
+        ASSERT_EQUAL(fields.at("ph").AsString(), "X");
+        ASSERT(fields.at("dur").AsDouble() >= 0);
+        name_to_threads[fields.at("name").AsString()].insert(fields.at("tid").AsInt());
+    }
+    ASSERT(name_to_threads.count("ProcessWriteRequests"));
+    ASSERT(name_to_threads.count("BuildGraph"));
+    ASSERT(name_to_threads.count("Router construction"));
+    ASSERT(name_to_threads.count("CollectRouteEdges"));
+    ASSERT_EQUAL(name_to_threads["TestTrace thread"].size(), 1);
+    ASSERT(!name_to_threads["BuildGraph"].count(*name_to_threads["TestTrace thread"].begin()));
+}
+
+void TestMemoryAccounting() {
+    ASSERT(Memory::GetCurrentSubsystem() == Memory::Subsystem::OTHER);
+    {
+        Memory::Scope router_scope(Memory::Subsystem::ROUTER);
+        ASSERT(Memory::GetCurrentSubsystem() == Memory::Subsystem::ROUTER);
+        {
+            Memory::Scope json_scope(Memory::Subsystem::JSON);
+            ASSERT(Memory::GetCurrentSubsystem() == Memory::Subsystem::JSON);
+        }
+        ASSERT(Memory::GetCurrentSubsystem() == Memory::Subsystem::ROUTER);
+    }
+    ASSERT(Memory::GetCurrentSubsystem() == Memory::Subsystem::OTHER);
+
+    // Real allocations may be counted too in a -DTRANSPORT_MEMORY build, so
+    // only differences are checked, on a subsystem the test alone touches.
+    const auto before = Memory::GetStats(Memory::Subsystem::EDGE_DESCRIPTIONS);
+    Memory::RecordAllocation(Memory::Subsystem::EDGE_DESCRIPTIONS, 1 << 20);
+    Memory::RecordAllocation(Memory::Subsystem::EDGE_DESCRIPTIONS, 1 << 20);
+    Memory::RecordFree(Memory::Subsystem::EDGE_DESCRIPTIONS, 1 << 20);
+    const auto after = Memory::GetStats(Memory::Subsystem::EDGE_DESCRIPTIONS);
+    ASSERT_EQUAL(after.current_bytes - before.current_bytes, 1 << 20);
+    ASSERT_EQUAL(after.allocation_count - before.allocation_count, 2);
+    ASSERT(after.peak_bytes >= before.current_bytes + (2 << 20));
+    Memory::RecordFree(Memory::Subsystem::EDGE_DESCRIPTIONS, 1 << 20);
+
+    Memory::RecordPhase("TestMemoryAccounting");
+    const auto report = Memory::ToJson();
+    ASSERT_EQUAL(report.AsMap().at("subsystems").AsMap().size(), size_t(Memory::Subsystem::COUNT));
+    const auto& phase = report.AsMap().at("phases").AsVector().back().AsMap();
+    ASSERT_EQUAL(phase.at("phase").AsString(), "TestMemoryAccounting");
+    ASSERT(phase.at("rss_bytes").AsDouble() > 0);
+    ASSERT(report.AsMap().at("peak_rss_bytes").AsDouble() >= phase.at("rss_bytes").AsDouble());
+}
+
+void TestPerfCounters() {
+    // Hardware counters are often missing in containers, the test only
+    // relies on what the report must hold either way.
+    Perf::Enable();
+    ASSERT(Perf::Scope::GetCurrent() == nullptr);
+    for (int call = 0; call < 2; ++call) {
+        Perf::Scope outer("TestPerfCounters outer");
+        outer.AddElements(10);
+        {
+            Perf::Scope inner("TestPerfCounters inner");
+            ASSERT(Perf::Scope::GetCurrent() == &inner);
+            volatile double sum = 0;
+            for (int i = 0; i < 100000; ++i) {
+                sum = sum + i;
+            }
+        }
+        ASSERT(Perf::Scope::GetCurrent() == &outer);
+    }
+    ASSERT(Perf::Scope::GetCurrent() == nullptr);
+
+    const auto report = Perf::ToJson();
+    map<string, map<string, Json::Node>> scopes;
+    for (const auto& scope : report.AsMap().at("scopes").AsVector()) {
+        scopes[scope.AsMap().at("scope").AsString()] = scope.AsMap();
+    }
+    ASSERT_EQUAL(scopes["TestPerfCounters outer"].at("calls").AsInt(), 2);
+    ASSERT_EQUAL(scopes["TestPerfCounters outer"].at("elements").AsInt(), 20);
+    ASSERT_EQUAL(scopes["TestPerfCounters inner"].at("elements").AsInt(), 0);
+    const auto& unavailable = report.AsMap().at("unavailable_counters").AsMap();
+    for (size_t counter = 0; counter < size_t(Perf::Counter::COUNT); ++counter) {
+        const string name = Perf::GetCounterName(Perf::Counter(counter));
+        ASSERT_EQUAL(Perf::IsAvailable(Perf::Counter(counter)), !unavailable.count(name));
+        ASSERT_EQUAL(scopes["TestPerfCounters outer"].count(name), size_t(Perf::IsAvailable(Perf::Counter(counter))));
+    }
+    if (Perf::IsAvailable(Perf::Counter::TASK_CLOCK)) {
+        ASSERT(scopes["TestPerfCounters outer"].at("task_clock_ns").AsDouble()
+               >= scopes["TestPerfCounters inner"].at("task_clock_ns").AsDouble());
+    }
+}
+
 void TestLoadJson() {
     stringstream stream;
     stream
@@ -754,10 +1832,125 @@ void TestLoadJson() {
     ASSERT_EQUAL(document.GetRoot().AsMap().at("longitude").AsDouble(), 37.209755);
 }
 
-int main() {
-    cout.precision(6);
+void TestBenchRunner() {
+    BenchRunner br("", chrono::microseconds(100), 5);
+    size_t calls = 0;
+    const auto result = br.RunBench([&calls] {
+        DoNotOptimize(++calls);
+    }, "TestBenchRunner loop");
+    ASSERT(result.iterations > 0);
+    ASSERT(calls >= result.iterations * 5);
+    ASSERT(result.min_ns <= result.median_ns);
+    ASSERT(result.stddev_ns >= 0);
+
+    BenchRunner filtered("BuildRoute");
+    calls = 0;
+    ASSERT_EQUAL(filtered.RunBench([&calls] { ++calls; }, "JsonLoad").iterations, 0);
+    ASSERT_EQUAL(calls, 0);
+}
+
+// City for micro-benchmarks: a square grid of stops with a bus along every
+// row and every column, one bus in two going round.
+static const size_t BENCH_GRID_SIDE = 20;
+
+static unique_ptr<TransportSystem> MakeBenchSystem(TransportSystem::RouterType router_type) {
+    auto ts = make_unique<TransportSystem>();
+    ts->SetParams(6, 40 * 1000.0 / 60.0);
+    ts->SetRouterType(router_type);
+    const auto stop_name = [](size_t row, size_t col) {
+        return "Stop " + to_string(row) + "-" + to_string(col);
+    };
+    for (size_t row = 0; row < BENCH_GRID_SIDE; ++row) {
+        for (size_t col = 0; col < BENCH_GRID_SIDE; ++col) {
+            ts->AddStop(stop_name(row, col), 55.6 + row * 0.005, 37.5 + col * 0.008);
+        }
+    }
+    for (size_t line = 0; line < BENCH_GRID_SIDE; ++line) {
+        vector<string> row_stops, col_stops;
+        for (size_t i = 0; i < BENCH_GRID_SIDE; ++i) {
+            row_stops.push_back(stop_name(line, i));
+            col_stops.push_back(stop_name(i, line));
+        }
+        if (line % 2 == 0) {
+            row_stops.push_back(row_stops.front());
+            ts->AddRoundBus("Row " + to_string(line), row_stops);
+        } else {
+            ts->AddStraightBus("Row " + to_string(line), row_stops);
+        }
+        ts->AddStraightBus("Column " + to_string(line), col_stops);
+    }
+    ts->BuildGraph();
+    return ts;
+}
+
+// Next pair of stops to route between, the same sequence on every run.
+static pair<Stop::ID, Stop::ID> NextBenchRoute() {
+    static size_t query = 0;
+    const size_t stop_count = BENCH_GRID_SIDE * BENCH_GRID_SIDE;
+    ++query;
+    return {query * 7919 % stop_count, query * 104729 % stop_count};
+}
+
+static void BenchBuildRoute(const TransportSystem& ts) {
+    const auto [from, to] = NextBenchRoute();
+    const auto route = ts.router->BuildRoute(from, to);
+    DoNotOptimize(route);
+    if (route) {
+        ts.router->ReleaseRoute(route->id);
+    }
+}
+
+void BenchCalculateGeoDistance() {
+    static double lat = 55.611087;
+    lat += 1e-9;
+    DoNotOptimize(lat);
+    DoNotOptimize(CalculateGeoDistance(lat, 37.20829, 55.595884, 37.209755));
+}
+
+void BenchJsonLoad() {
+    static const string input = [] {
+        ifstream request_stream("./full_flow_test.txt");
+        return string(istreambuf_iterator<char>(request_stream), {});
+    }();
+    istringstream stream(input);
+    DoNotOptimize(Json::Load(stream));
+}
+
+void BenchBuildRouteAllPairs() {
+    static const auto ts = MakeBenchSystem(TransportSystem::RouterType::ALL_PAIRS);
+    BenchBuildRoute(*ts);
+}
+
+void BenchBuildRouteDijkstra() {
+    static const auto ts = MakeBenchSystem(TransportSystem::RouterType::DIJKSTRA);
+    BenchBuildRoute(*ts);
+}
 
-    /*
+void BenchBuildRouteHubLabels() {
+    static const auto ts = MakeBenchSystem(TransportSystem::RouterType::HUB_LABELS);
+    BenchBuildRoute(*ts);
+}
+
+void BenchBuildRouteAlt() {
+    static const auto ts = MakeBenchSystem(TransportSystem::RouterType::ALT);
+    BenchBuildRoute(*ts);
+}
+
+void BenchBuildRouteBidirectionalDijkstra() {
+    static const auto ts = MakeBenchSystem(TransportSystem::RouterType::BIDIRECTIONAL_DIJKSTRA);
+    BenchBuildRoute(*ts);
+}
+
+void BenchRouteRequest() {
+    static const auto ts = MakeBenchSystem(TransportSystem::RouterType::ALL_PAIRS);
+    ReadRouteRequest request;
+    request.request_id = 1;
+    request.from = "Stop 0-0";
+    request.to = "Stop 19-19";
+    DoNotOptimize(request.Process(*ts));
+}
+
+void RunTests() {
     TestRunner tr;
     RUN_TEST(tr, TestCreate);
     RUN_TEST(tr, TestAddStop);
@@ -785,16 +1978,231 @@ int main() {
     RUN_TEST(tr, TestReadRequestParseStop);
     RUN_TEST(tr, TestParseReadRequest);
     RUN_TEST(tr, TestProcessReadRequest);
-    */
+
+    RUN_TEST(tr, TestBuildGraphThreadCount);
+    RUN_TEST(tr, TestNestedParallelFor);
+    RUN_TEST(tr, TestProcessReadRequestsThreadCount);
+    RUN_TEST(tr, TestRouteCache);
+    RUN_TEST(tr, TestDijkstraRouter);
+    RUN_TEST(tr, TestTimeMatrix);
+    RUN_TEST(tr, TestIsochrone);
+    RUN_TEST(tr, TestSnapshot);
+    RUN_TEST(tr, TestIncrementalUpdate);
+    RUN_TEST(tr, TestTransportSystemVersions);
+    RUN_TEST(tr, TestServer);
+    RUN_TEST(tr, TestBoundedQueue);
+    RUN_TEST(tr, TestProcessReadRequestsPipelined);
+    RUN_TEST(tr, TestLatencyHistogram);
+    RUN_TEST(tr, TestTrace);
+    RUN_TEST(tr, TestBenchRunner);
+    RUN_TEST(tr, TestMemoryAccounting);
+    RUN_TEST(tr, TestPerfCounters);
+    RUN_TEST(tr, TestHubLabelRouter);
+    RUN_TEST(tr, TestAltRouter);
+    RUN_TEST(tr, TestBidirectionalDijkstraRouter);
+    RUN_TEST(tr, TestComponentRouter);
+    RUN_TEST(tr, TestVertexOrder);
+    RUN_TEST(tr, TestParallelEdgePruning);
+    RUN_TEST(tr, TestBatchedRoutesPruned);
 
     // RUN_TEST(tr, TestFullFlow);
+}
+
+void RunBenchmarks(const string& filter) {
+    BenchRunner br(filter);
+    RUN_BENCH(br, BenchCalculateGeoDistance);
+    RUN_BENCH(br, BenchJsonLoad);
+    RUN_BENCH(br, BenchBuildRouteAllPairs);
+    RUN_BENCH(br, BenchBuildRouteDijkstra);
+    RUN_BENCH(br, BenchBuildRouteHubLabels);
+    RUN_BENCH(br, BenchBuildRouteAlt);
+    RUN_BENCH(br, BenchBuildRouteBidirectionalDijkstra);
+    RUN_BENCH(br, BenchRouteRequest);
+}
+
+#ifdef TRANSPORT_TESTS
+
+// Built with -DTRANSPORT_TESTS the binary runs the unit tests, or the
+// micro-benchmarks whose names contain FILTER with "bench [FILTER]". Run it
+// from this directory, the tests read the full flow files.
+int main(int argc, const char* argv[]) {
+    const string mode = argc > 1 ? argv[1] : "test";
+    if (mode == "test") {
+        RunTests();
+    } else if (mode == "bench") {
+        RunBenchmarks(argc > 2 ? argv[2] : "");
+    } else {
+        cerr << "Usage: " << argv[0] << " [test|bench [FILTER]]" << endl;
+        return 1;
+    }
+    return 0;
+}
+
+#else
+
+// Builds with -DTRANSPORT_METRICS report request latencies to stderr on exit.
+static void DumpMetrics() {
+#ifdef TRANSPORT_METRICS
+    Json::PrintCompact(cerr, Metrics::ToJson());
+    cerr << endl;
+#endif
+}
+
+// Builds with -DTRANSPORT_MEMORY report heap usage per subsystem and the
+// RSS after every phase to stderr on exit.
+static void DumpMemory() {
+#ifdef TRANSPORT_MEMORY
+    Json::PrintCompact(cerr, Memory::ToJson());
+    cerr << endl;
+#endif
+}
+
+// Builds with -DTRANSPORT_PERF report hardware event counts per phase to
+// stderr on exit, and next to them the parallel edges the router left out.
+static void DumpPerf([[maybe_unused]] const TransportSystem& ts) {
+#ifdef TRANSPORT_PERF
+    auto report = Perf::ToJson().AsMap();
+    report["pruned_edges"] = Json::Node(double(ts.GetPrunedEdgeCount()));
+    Json::PrintCompact(cerr, Json::Node(move(report)));
+    cerr << endl;
+#endif
+}
+
+[[maybe_unused]] static size_t CountRequests(const Json::Document& document) {
+    size_t count = ReadStatRequestsJson(document).size();
+    if (auto it = document.GetRoot().AsMap().find("base_requests"); it != document.GetRoot().AsMap().end()) {
+        count += it->second.AsVector().size();
+    }
+    return count;
+}
+
+// With TRANSPORT_TRACE=<file> in the environment the run is traced and
+// the timeline is written to that file on exit.
+struct TraceFile {
+    const char* path = getenv("TRANSPORT_TRACE");
+
+    TraceFile() {
+        if (path) {
+            Trace::Enable();
+        }
+    }
+    ~TraceFile() {
+        if (path) {
+            ofstream output(path);
+            Trace::WriteJson(output);
+        }
+    }
+};
+
+static RequestServer* server_to_stop = nullptr;
+
+static void StopServer(int) {
+    if (server_to_stop) {
+        server_to_stop->Stop();
+    }
+}
+
+static int Serve(const string& snapshot_file, const optional<string>& socket_path) {
+    auto ts = make_unique<TransportSystem>();
+    ts->MapSnapshot(snapshot_file);
+    TransportSystemVersions versions(move(ts));
+    RequestServer server(versions);
+    Metrics::Reset();
+    if (socket_path) {
+        server_to_stop = &server;
+        signal(SIGINT, StopServer);
+        signal(SIGTERM, StopServer);
+        server.ServeUnixSocket(*socket_path);
+        server_to_stop = nullptr;
+    } else {
+        server.Serve(cin, cout);
+    }
+    const auto stats = server.GetLatencyStats();
+    cerr << "requests: " << stats.request_count
+         << ", latency p50: " << stats.p50_us << " us, p99: " << stats.p99_us << " us" << endl;
+    DumpMetrics();
+    return 0;
+}
+
+int main(int argc, const char* argv[]) {
+    cout.precision(6);
+
+    // Without arguments the whole document is processed at once. "make_base"
+    // builds the system from base requests and saves it to the snapshot file,
+    // "process_requests" loads that snapshot and answers stat requests.
+    // "serve" loads a snapshot and answers line-delimited stat requests and
+    // updates from stdin, or from a Unix socket if its path is given, until
+    // stopped.
+    const TraceFile trace_file;
+    PERF_ENABLE();
+    const string mode = argc > 1 ? argv[1] : "";
+    if (mode == "serve" && argc > 2) {
+        return Serve(argv[2], argc > 3 ? optional<string>(argv[3]) : nullopt);
+    }
+    if (!mode.empty() && mode != "make_base" && mode != "process_requests") {
+        cerr << "Usage: " << argv[0] << " [make_base|process_requests]" << endl;
+        cerr << "       " << argv[0] << " serve SNAPSHOT_FILE [SOCKET_PATH]" << endl;
+        return 1;
+    }
+
+    const Json::Document document = [] {
+        TRACE_SCOPE("Json::Load");
+        MEMORY_SCOPE(JSON);
+        PERF_SCOPE("json_load");
+        auto document = Json::Load(cin);
+        PERF_ELEMENTS(CountRequests(document));
+        return document;
+    }();
+    MEMORY_PHASE("json_load");
+    const auto write_requests = [&document] {
+        TRACE_SCOPE("ReadRequests");
+        PERF_SCOPE("parse_requests");
+        auto write_requests = ReadWriteRequests(document);
+        PERF_ELEMENTS(write_requests.size());
+        return write_requests;
+    }();
+    MEMORY_PHASE("parse_requests");
+    const auto serialization_settings = ReadSerializationSettings(document);
+    if (!mode.empty() && !serialization_settings) {
+        cerr << "serialization_settings are required in " << mode << " mode" << endl;
+        return 1;
+    }
 
     TransportSystem ts;
-    const auto [write_requests, read_requests] = ReadRequests();
-    ProcessWriteRequests(write_requests, ts);
-    ts.BuildGraph();
-    const auto responses = ProcessReadRequests(read_requests, ts);
-    PrintResponses(responses);
+    if (mode == "process_requests") {
+        ts.MapSnapshot(serialization_settings->file);
+    } else {
+        {
+            PERF_SCOPE("write_requests");
+            PERF_ELEMENTS(write_requests.size());
+            ProcessWriteRequests(write_requests, ts);
+        }
+        MEMORY_PHASE("write_requests");
+        ts.BuildGraph();
+    }
+    MEMORY_PHASE("build_graph");
+
+    if (mode == "make_base") {
+        ofstream snapshot(serialization_settings->file, ios::binary);
+        ts.SaveSnapshot(snapshot);
+        DumpMemory();
+        DumpPerf(ts);
+        return 0;
+    }
+
+    Metrics::Reset();
+    {
+        // Printing runs along with answering, so it is counted here too.
+        PERF_SCOPE("read_requests");
+        PERF_ELEMENTS(ReadStatRequestsJson(document).size());
+        ProcessReadRequestsPipelined(ReadStatRequestsJson(document), ts);
+    }
+    MEMORY_PHASE("read_requests");
+    DumpMetrics();
+    DumpMemory();
+    DumpPerf(ts);
 
     return 0;
 }
+
+#endif
@@ -0,0 +1,247 @@
+#include "memory_accounting.h"
+
+#include <array>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace Memory {
+
+    namespace {
+
+        struct Counters {
+            atomic<int64_t> current_bytes = 0;
+            atomic<int64_t> peak_bytes = 0;
+            atomic<uint64_t> allocation_count = 0;
+        };
+
+        // Constant initialized, so allocations made before main are counted.
+        array<Counters, size_t(Subsystem::COUNT)> counters;
+
+        // A plain integer needs no thread_local constructor, which must not
+        // run inside operator new.
+        thread_local uint8_t current_subsystem = uint8_t(Subsystem::OTHER);
+
+        struct Phase {
+            string name;
+            size_t rss;
+            array<int64_t, size_t(Subsystem::COUNT)> current_bytes;
+        };
+
+        mutex phases_mutex;
+        vector<Phase> phases;
+
+    }
+
+    const char* GetSubsystemName(Subsystem subsystem) {
+        switch (subsystem) {
+            case Subsystem::OTHER:
+                return "other";
+            case Subsystem::JSON:
+                return "json";
+            case Subsystem::REQUESTS:
+                return "requests";
+            case Subsystem::STOPS:
+                return "stops";
+            case Subsystem::GRAPH:
+                return "graph";
+            case Subsystem::EDGE_DESCRIPTIONS:
+                return "edge_descriptions";
+            case Subsystem::ROUTER:
+                return "router";
+            case Subsystem::RESPONSES:
+                return "responses";
+            default:
+                return "unknown";
+        }
+    }
+
+    void RecordAllocation(Subsystem subsystem, size_t size) {
+        auto& subsystem_counters = counters[size_t(subsystem)];
+        const int64_t current = subsystem_counters.current_bytes.fetch_add(size, memory_order_relaxed) + size;
+        subsystem_counters.allocation_count.fetch_add(1, memory_order_relaxed);
+        for (int64_t peak = subsystem_counters.peak_bytes.load(memory_order_relaxed);
+                current > peak && !subsystem_counters.peak_bytes.compare_exchange_weak(peak, current, memory_order_relaxed); ) {
+        }
+    }
+
+    void RecordFree(Subsystem subsystem, size_t size) {
+        counters[size_t(subsystem)].current_bytes.fetch_sub(size, memory_order_relaxed);
+    }
+
+    SubsystemStats GetStats(Subsystem subsystem) {
+        const auto& subsystem_counters = counters[size_t(subsystem)];
+        return {
+            subsystem_counters.current_bytes.load(memory_order_relaxed),
+            subsystem_counters.peak_bytes.load(memory_order_relaxed),
+            subsystem_counters.allocation_count.load(memory_order_relaxed)
+        };
+    }
+
+    Subsystem GetCurrentSubsystem() {
+        return Subsystem(current_subsystem);
+    }
+
+    Scope::Scope(Subsystem subsystem) : previous_(GetCurrentSubsystem()) {
+        current_subsystem = uint8_t(subsystem);
+    }
+
+    Scope::~Scope() {
+        current_subsystem = uint8_t(previous_);
+    }
+
+    size_t GetCurrentRss() {
+        FILE* statm = fopen("/proc/self/statm", "r");
+        if (!statm) {
+            return 0;
+        }
+        unsigned long size_pages = 0, resident_pages = 0;
+        const bool is_read = fscanf(statm, "%lu %lu", &size_pages, &resident_pages) == 2;
+        fclose(statm);
+        return is_read ? resident_pages * sysconf(_SC_PAGESIZE) : 0;
+    }
+
+    size_t GetPeakRss() {
+        rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) != 0) {
+            return 0;
+        }
+        return size_t(usage.ru_maxrss) * 1024;
+    }
+
+    void RecordPhase(const string& phase) {
+        Phase record{phase, GetCurrentRss(), {}};
+        for (size_t subsystem = 0; subsystem < size_t(Subsystem::COUNT); ++subsystem) {
+            record.current_bytes[subsystem] = counters[subsystem].current_bytes.load(memory_order_relaxed);
+        }
+        lock_guard<mutex> guard(phases_mutex);
+        phases.push_back(move(record));
+    }
+
+    Json::Node ToJson() {
+        map<string, Json::Node> subsystems;
+        for (size_t subsystem = 0; subsystem < size_t(Subsystem::COUNT); ++subsystem) {
+            const auto stats = GetStats(Subsystem(subsystem));
+            map<string, Json::Node> subsystem_node;
+            subsystem_node["current_bytes"] = Json::Node(double(stats.current_bytes));
+            subsystem_node["peak_bytes"] = Json::Node(double(stats.peak_bytes));
+            subsystem_node["allocations"] = Json::Node(double(stats.allocation_count));
+            subsystems[GetSubsystemName(Subsystem(subsystem))] = Json::Node(move(subsystem_node));
+        }
+
+        vector<Json::Node> phase_nodes;
+        {
+            lock_guard<mutex> guard(phases_mutex);
+            for (const auto& phase : phases) {
+                map<string, Json::Node> current_bytes;
+                for (size_t subsystem = 0; subsystem < size_t(Subsystem::COUNT); ++subsystem) {
+                    current_bytes[GetSubsystemName(Subsystem(subsystem))] = Json::Node(double(phase.current_bytes[subsystem]));
+                }
+                map<string, Json::Node> phase_node;
+                phase_node["phase"] = Json::Node(phase.name);
+                phase_node["rss_bytes"] = Json::Node(double(phase.rss));
+                phase_node["current_bytes"] = Json::Node(move(current_bytes));
+                phase_nodes.emplace_back(move(phase_node));
+            }
+        }
+
+        // Built by inserts rather than initializer lists, whose copies of
+        // variant nodes GCC reports as maybe uninitialized.
+        map<string, Json::Node> result;
+        result["subsystems"] = Json::Node(move(subsystems));
+        result["phases"] = Json::Node(move(phase_nodes));
+        result["peak_rss_bytes"] = Json::Node(double(GetPeakRss()));
+        return Json::Node(move(result));
+    }
+
+}
+
+#ifdef TRANSPORT_MEMORY
+
+// Every block carries a header with its size and subsystem. It is 16 bytes
+// so that the block keeps the alignment malloc gives. Over-aligned new and
+// delete are left to the standard library and not counted.
+namespace {
+
+    struct alignas(16) BlockHeader {
+        size_t size;
+        Memory::Subsystem subsystem;
+    };
+
+    void* AllocateCounted(size_t size) {
+        void* block = malloc(sizeof(BlockHeader) + size);
+        if (!block) {
+            return nullptr;
+        }
+        auto* header = static_cast<BlockHeader*>(block);
+        header->size = size;
+        header->subsystem = Memory::GetCurrentSubsystem();
+        Memory::RecordAllocation(header->subsystem, size);
+        return header + 1;
+    }
+
+    // Kept out of line: inlined into operator delete, GCC takes the block
+    // for one from operator new and warns about the free below.
+    [[gnu::noinline]] void FreeCounted(void* pointer) {
+        if (!pointer) {
+            return;
+        }
+        auto* header = static_cast<BlockHeader*>(pointer) - 1;
+        Memory::RecordFree(header->subsystem, header->size);
+        free(header);
+    }
+
+}
+
+void* operator new(size_t size) {
+    if (void* pointer = AllocateCounted(size)) {
+        return pointer;
+    }
+    throw bad_alloc();
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void* operator new(size_t size, const nothrow_t&) noexcept {
+    return AllocateCounted(size);
+}
+
+void* operator new[](size_t size, const nothrow_t&) noexcept {
+    return AllocateCounted(size);
+}
+
+void operator delete(void* pointer) noexcept {
+    FreeCounted(pointer);
+}
+
+void operator delete[](void* pointer) noexcept {
+    FreeCounted(pointer);
+}
+
+void operator delete(void* pointer, size_t) noexcept {
+    FreeCounted(pointer);
+}
+
+void operator delete[](void* pointer, size_t) noexcept {
+    FreeCounted(pointer);
+}
+
+void operator delete(void* pointer, const nothrow_t&) noexcept {
+    FreeCounted(pointer);
+}
+
+void operator delete[](void* pointer, const nothrow_t&) noexcept {
+    FreeCounted(pointer);
+}
+
+#endif
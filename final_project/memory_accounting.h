@@ -0,0 +1,78 @@
+#pragma once
+#include "json.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Heap usage split by subsystem. With -DTRANSPORT_MEMORY the global
+// operator new and delete are replaced: every allocation is charged to the
+// subsystem of the innermost MEMORY_SCOPE on its thread, and its free goes
+// back to the same subsystem wherever it happens. Without the flag the
+// scopes and phases compile to nothing and all counters stay at zero.
+namespace Memory {
+
+    enum class Subsystem : uint8_t {
+        OTHER,              // everything outside a scope
+        JSON,               // loaded Json::Document trees
+        REQUESTS,           // parsed requests and their holders
+        STOPS,              // stops with their road distance maps
+        GRAPH,
+        EDGE_DESCRIPTIONS,
+        ROUTER,             // router matrix or search state
+        RESPONSES,          // answers to stat requests
+        COUNT
+    };
+
+    const char* GetSubsystemName(Subsystem subsystem);
+
+    struct SubsystemStats {
+        int64_t current_bytes = 0;
+        int64_t peak_bytes = 0;
+        uint64_t allocation_count = 0;
+    };
+
+    void RecordAllocation(Subsystem subsystem, size_t size);
+    void RecordFree(Subsystem subsystem, size_t size);
+    SubsystemStats GetStats(Subsystem subsystem);
+
+    Subsystem GetCurrentSubsystem();
+
+    class Scope {
+    public:
+        explicit Scope(Subsystem subsystem);
+        ~Scope();
+
+        Scope(const Scope&) = delete;
+        Scope& operator = (const Scope&) = delete;
+
+    private:
+        Subsystem previous_;
+    };
+
+    // Resident set size of the process now and at its peak, 0 where the
+    // system does not tell.
+    size_t GetCurrentRss();
+    size_t GetPeakRss();
+
+    // Remembers the RSS and the bytes held by every subsystem at the end of
+    // a phase of the run.
+    void RecordPhase(const std::string& phase);
+
+    // Stats of every subsystem and the recorded phases.
+    Json::Node ToJson();
+
+}
+
+#define MEMORY_CONCAT_IMPL(left, right) left ## right
+#define MEMORY_CONCAT(left, right) MEMORY_CONCAT_IMPL(left, right)
+
+#ifdef TRANSPORT_MEMORY
+#define MEMORY_SCOPE(subsystem) \
+    Memory::Scope MEMORY_CONCAT(memory_scope_, __LINE__)(Memory::Subsystem::subsystem)
+#define MEMORY_PHASE(phase) Memory::RecordPhase(phase)
+#else
+#define MEMORY_SCOPE(subsystem)
+#define MEMORY_PHASE(phase)
+#endif
@@ -0,0 +1,134 @@
+#include "metrics.h"
+
+#include <map>
+#include <string>
+
+using namespace std;
+
+namespace Metrics {
+
+    const char* GetMetricName(Metric metric) {
+        switch (metric) {
+            case Metric::BUS_REQUEST:
+                return "Bus";
+            case Metric::STOP_REQUEST:
+                return "Stop";
+            case Metric::ROUTE_REQUEST:
+                return "Route";
+            case Metric::TIME_MATRIX_REQUEST:
+                return "TimeMatrix";
+            case Metric::ISOCHRONE_REQUEST:
+                return "Isochrone";
+            case Metric::ROUTE_GROUP:
+                return "route_group";
+            case Metric::STOP_LOOKUP:
+                return "stop_lookup";
+            case Metric::BUILD_ROUTE:
+                return "build_route";
+            case Metric::RENDER_ROUTE:
+                return "render_route";
+            default:
+                return "unknown";
+        }
+    }
+
+    size_t LatencyHistogram::GetBucket(uint64_t value) {
+        if (value < SUB_BUCKET_COUNT) {
+            return value;
+        }
+        const int exponent = 63 - __builtin_clzll(value);
+        const int shift = exponent - SUB_BUCKET_BITS;
+        const size_t sub_bucket = (value >> shift) - SUB_BUCKET_COUNT;
+        return SUB_BUCKET_COUNT * (shift + 1) + sub_bucket;
+    }
+
+    uint64_t LatencyHistogram::GetBucketMiddle(size_t bucket) {
+        if (bucket < SUB_BUCKET_COUNT) {
+            return bucket;
+        }
+        const int shift = bucket / SUB_BUCKET_COUNT - 1;
+        const uint64_t lower = (SUB_BUCKET_COUNT + bucket % SUB_BUCKET_COUNT) << shift;
+        return lower + ((uint64_t(1) << shift) >> 1);
+    }
+
+    void LatencyHistogram::Record(uint64_t value_ns) {
+        buckets_[GetBucket(value_ns)].fetch_add(1, memory_order_relaxed);
+        count_.fetch_add(1, memory_order_relaxed);
+        for (uint64_t max = max_.load(memory_order_relaxed);
+                value_ns > max && !max_.compare_exchange_weak(max, value_ns, memory_order_relaxed); ) {
+        }
+    }
+
+    uint64_t LatencyHistogram::GetQuantile(double fraction) const {
+        // Buckets are read one by one while others may record, so the total
+        // is taken from the buckets themselves.
+        array<uint64_t, BUCKET_COUNT> counts;
+        uint64_t total = 0;
+        for (size_t bucket = 0; bucket < BUCKET_COUNT; ++bucket) {
+            counts[bucket] = buckets_[bucket].load(memory_order_relaxed);
+            total += counts[bucket];
+        }
+        if (total == 0) {
+            return 0;
+        }
+        const uint64_t rank = max<uint64_t>(1, fraction * total + 0.5);
+        if (rank >= total) {
+            return GetMax();
+        }
+        uint64_t seen = 0;
+        for (size_t bucket = 0; bucket < BUCKET_COUNT; ++bucket) {
+            seen += counts[bucket];
+            if (seen >= rank) {
+                return min(GetBucketMiddle(bucket), GetMax());
+            }
+        }
+        return GetMax();
+    }
+
+    void LatencyHistogram::Reset() {
+        for (auto& bucket : buckets_) {
+            bucket.store(0, memory_order_relaxed);
+        }
+        count_.store(0, memory_order_relaxed);
+        max_.store(0, memory_order_relaxed);
+    }
+
+    static array<LatencyHistogram, size_t(Metric::COUNT)> histograms;
+    static atomic<chrono::steady_clock::rep> start_time = chrono::steady_clock::now().time_since_epoch().count();
+
+    LatencyHistogram& GetHistogram(Metric metric) {
+        return histograms[size_t(metric)];
+    }
+
+    Json::Node ToJson() {
+        const chrono::steady_clock::duration elapsed =
+                chrono::steady_clock::now().time_since_epoch() - chrono::steady_clock::duration(start_time.load());
+        const double elapsed_s = chrono::duration<double>(elapsed).count();
+
+        map<string, Json::Node> result;
+        for (size_t metric = 0; metric < size_t(Metric::COUNT); ++metric) {
+            const auto& histogram = histograms[metric];
+            const uint64_t count = histogram.GetCount();
+            if (count == 0) {
+                continue;
+            }
+            result[GetMetricName(Metric(metric))] = Json::Node(map<string, Json::Node>{
+                {"count", Json::Node(double(count))},
+                {"p50_us", Json::Node(histogram.GetQuantile(0.5) / 1e3)},
+                {"p90_us", Json::Node(histogram.GetQuantile(0.9) / 1e3)},
+                {"p99_us", Json::Node(histogram.GetQuantile(0.99) / 1e3)},
+                {"max_us", Json::Node(histogram.GetMax() / 1e3)},
+                {"per_second", Json::Node(elapsed_s > 0 ? count / elapsed_s : 0.0)}
+            });
+        }
+        return Json::Node(move(result));
+    }
+
+    void Reset() {
+        for (auto& histogram : histograms) {
+            histogram.Reset();
+        }
+        start_time = chrono::steady_clock::now().time_since_epoch().count();
+    }
+
+}
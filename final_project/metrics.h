@@ -0,0 +1,95 @@
+#pragma once
+#include "json.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// Latency histograms of request processing and its steps. Timers are only
+// compiled in with -DTRANSPORT_METRICS, otherwise METRICS_TIMER expands to
+// nothing and all histograms stay empty.
+namespace Metrics {
+
+    enum class Metric {
+        BUS_REQUEST,
+        STOP_REQUEST,
+        ROUTE_REQUEST,
+        TIME_MATRIX_REQUEST,
+        ISOCHRONE_REQUEST,
+        ROUTE_GROUP,      // all route requests from one stop in a batch
+        STOP_LOOKUP,
+        BUILD_ROUTE,      // router query or shortest path tree
+        RENDER_ROUTE,     // route edges into response items
+        COUNT
+    };
+
+    const char* GetMetricName(Metric metric);
+
+    // Log-linear buckets in the manner of HDR histograms: values below 16 ns
+    // are exact, larger ones keep 4 significant bits, so quantiles are off by
+    // at most 1/16. Recording is a few relaxed atomic increments.
+    class LatencyHistogram {
+    public:
+        void Record(uint64_t value_ns);
+
+        uint64_t GetCount() const {
+            return count_.load(std::memory_order_relaxed);
+        }
+        uint64_t GetMax() const {
+            return max_.load(std::memory_order_relaxed);
+        }
+        // Value below which the given fraction of recorded values lies.
+        uint64_t GetQuantile(double fraction) const;
+        void Reset();
+
+    private:
+        static const int SUB_BUCKET_BITS = 4;
+        static const size_t SUB_BUCKET_COUNT = 1 << SUB_BUCKET_BITS;
+        static const size_t BUCKET_COUNT = SUB_BUCKET_COUNT * (64 - SUB_BUCKET_BITS + 1);
+
+        static size_t GetBucket(uint64_t value);
+        static uint64_t GetBucketMiddle(size_t bucket);
+
+        std::array<std::atomic<uint64_t>, BUCKET_COUNT> buckets_ = {};
+        std::atomic<uint64_t> count_ = 0;
+        std::atomic<uint64_t> max_ = 0;
+    };
+
+    LatencyHistogram& GetHistogram(Metric metric);
+
+    // Every metric that has values: count, p50/p90/p99/max in microseconds
+    // and count per second since the last reset.
+    Json::Node ToJson();
+    void Reset();
+
+    class ScopedTimer {
+    public:
+        explicit ScopedTimer(Metric metric)
+            : metric_(metric)
+            , start_(std::chrono::steady_clock::now())
+            {}
+        ~ScopedTimer() {
+            const auto duration = std::chrono::steady_clock::now() - start_;
+            GetHistogram(metric_).Record(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+        }
+
+        ScopedTimer(const ScopedTimer&) = delete;
+        ScopedTimer& operator = (const ScopedTimer&) = delete;
+
+    private:
+        Metric metric_;
+        std::chrono::steady_clock::time_point start_;
+    };
+
+}
+
+#define METRICS_CONCAT_IMPL(left, right) left ## right
+#define METRICS_CONCAT(left, right) METRICS_CONCAT_IMPL(left, right)
+
+#ifdef TRANSPORT_METRICS
+#define METRICS_TIMER(metric) \
+    Metrics::ScopedTimer METRICS_CONCAT(metrics_timer_, __LINE__)(Metrics::Metric::metric)
+#else
+#define METRICS_TIMER(metric)
+#endif
@@ -0,0 +1,146 @@
+#pragma once
+#include "memory_accounting.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+inline size_t DefaultThreadCount() {
+    return std::max<size_t>(1, std::thread::hardware_concurrency());
+}
+
+namespace Detail {
+
+    // Set on the threads of a running ParallelFor, the caller included.
+    inline thread_local bool is_in_parallel_for = false;
+
+    class ParallelForScope {
+    public:
+        ParallelForScope() : was_in_parallel_for_(is_in_parallel_for) {
+            is_in_parallel_for = true;
+        }
+        ~ParallelForScope() {
+            is_in_parallel_for = was_in_parallel_for_;
+        }
+
+        ParallelForScope(const ParallelForScope&) = delete;
+        ParallelForScope& operator = (const ParallelForScope&) = delete;
+
+    private:
+        bool was_in_parallel_for_;
+    };
+
+    // Chunks [begin, end) still owned by one worker. The owner takes chunks
+    // from the front, thieves take the back half.
+    struct ChunkQueue {
+        std::mutex mutex;
+        size_t begin = 0;
+        size_t end = 0;
+
+        bool PopFront(size_t& chunk) {
+            std::lock_guard<std::mutex> guard(mutex);
+            if (begin == end) {
+                return false;
+            }
+            chunk = begin++;
+            return true;
+        }
+
+        bool StealHalf(size_t& steal_begin, size_t& steal_end) {
+            std::lock_guard<std::mutex> guard(mutex);
+            if (begin == end) {
+                return false;
+            }
+            steal_end = end;
+            end -= (end - begin + 1) / 2;
+            steal_begin = end;
+            return true;
+        }
+
+        size_t Size() {
+            std::lock_guard<std::mutex> guard(mutex);
+            return end - begin;
+        }
+    };
+
+}
+
+// Calls func(i) for every i in [0, count) on thread_count threads, the calling
+// thread included. The range is cut into chunks of chunk_size indices; every
+// worker starts with a contiguous share of chunks and steals from the busiest
+// worker once its own share is exhausted. A call from inside another
+// ParallelFor runs on its calling thread alone, the outer one already keeps
+// every thread busy. Threads are started per call rather than pooled, so
+// that per-thread perf counts join the scope that started them.
+template <typename Func>
+void ParallelFor(size_t count, size_t thread_count, Func func, size_t chunk_size = 1) {
+    chunk_size = std::max<size_t>(1, chunk_size);
+    const size_t chunk_count = (count + chunk_size - 1) / chunk_size;
+    thread_count = std::max<size_t>(1, std::min(thread_count, chunk_count));
+    if (thread_count <= 1 || Detail::is_in_parallel_for) {
+        for (size_t i = 0; i < count; ++i) {
+            func(i);
+        }
+        return;
+    }
+
+    std::vector<Detail::ChunkQueue> queues(thread_count);
+    for (size_t worker = 0; worker < thread_count; ++worker) {
+        queues[worker].begin = chunk_count * worker / thread_count;
+        queues[worker].end = chunk_count * (worker + 1) / thread_count;
+    }
+
+    auto process_chunk = [&func, count, chunk_size](size_t chunk) {
+        const size_t end = std::min(count, (chunk + 1) * chunk_size);
+        for (size_t i = chunk * chunk_size; i < end; ++i) {
+            func(i);
+        }
+    };
+
+    // Workers charge their allocations where the caller does.
+    const Memory::Subsystem subsystem = Memory::GetCurrentSubsystem();
+    auto run_worker = [&queues, &process_chunk, thread_count, subsystem](size_t worker) {
+        const Memory::Scope memory_scope(subsystem);
+        const Detail::ParallelForScope parallel_for_scope;
+        auto& own = queues[worker];
+        while (true) {
+            for (size_t chunk; own.PopFront(chunk); ) {
+                process_chunk(chunk);
+            }
+
+            size_t victim = worker;
+            size_t victim_size = 0;
+            for (size_t other = 0; other < thread_count; ++other) {
+                if (other == worker) {
+                    continue;
+                }
+                if (const size_t size = queues[other].Size(); size > victim_size) {
+                    victim = other;
+                    victim_size = size;
+                }
+            }
+            size_t steal_begin, steal_end;
+            if (victim == worker || !queues[victim].StealHalf(steal_begin, steal_end)) {
+                if (victim_size == 0) {
+                    return;
+                }
+                continue;
+            }
+            std::lock_guard<std::mutex> guard(own.mutex);
+            own.begin = steal_begin;
+            own.end = steal_end;
+        }
+    };
+
+    std::vector<std::thread> workers;
+    workers.reserve(thread_count - 1);
+    for (size_t worker = 1; worker < thread_count; ++worker) {
+        workers.emplace_back(run_worker, worker);
+    }
+    run_worker(0);
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
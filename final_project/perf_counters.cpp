@@ -0,0 +1,260 @@
+#include "perf_counters.h"
+
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace Perf {
+
+    namespace {
+
+        struct CounterFile {
+            int fd = -1;
+            // Position among the values of a group read, -1 if read alone.
+            int group_index = -1;
+            string error;
+        };
+
+        struct Totals {
+            size_t call_count = 0;
+            size_t element_count = 0;
+            Values values = {};
+        };
+
+        struct Registry {
+            mutex registry_mutex;
+            bool is_enabled = false;
+            array<CounterFile, size_t(Counter::COUNT)> files;
+            // Counters in the group led by cycles, 0 if it could not open.
+            size_t group_size = 0;
+            // Scope names in the order they first ended.
+            vector<const char*> names;
+            map<string, Totals> totals;
+        };
+
+        Registry& GetRegistry() {
+            static Registry registry;
+            return registry;
+        }
+
+        thread_local Scope* current_scope = nullptr;
+
+        pair<uint32_t, uint64_t> GetEventType(Counter counter) {
+            switch (counter) {
+                case Counter::CYCLES:
+                    return {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES};
+                case Counter::INSTRUCTIONS:
+                    return {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS};
+                case Counter::CACHE_MISSES:
+                    return {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES};
+                case Counter::BRANCH_MISSES:
+                    return {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES};
+                default:
+                    return {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK};
+            }
+        }
+
+        // With group_fd the counter joins the group of that leader, with
+        // is_grouped but no group_fd it leads a new one.
+        CounterFile OpenCounter(Counter counter, int group_fd, bool is_grouped) {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            tie(attr.type, attr.config) = GetEventType(counter);
+            attr.inherit = 1;
+            // Allowed without privileges up to perf_event_paranoid 2.
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            if (is_grouped) {
+                attr.read_format |= PERF_FORMAT_GROUP;
+            }
+            const int fd = syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+            if (fd < 0) {
+                return {-1, -1, strerror(errno)};
+            }
+            return {fd, -1, {}};
+        }
+
+        // Scales a value up to the whole time enabled when counters were
+        // multiplexed.
+        uint64_t Scale(uint64_t value, uint64_t time_enabled, uint64_t time_running) {
+            return time_running == time_enabled ? value : uint64_t(double(value) * time_enabled / time_running);
+        }
+
+    }
+
+    const char* GetCounterName(Counter counter) {
+        switch (counter) {
+            case Counter::CYCLES:
+                return "cycles";
+            case Counter::INSTRUCTIONS:
+                return "instructions";
+            case Counter::CACHE_MISSES:
+                return "cache_misses";
+            case Counter::BRANCH_MISSES:
+                return "branch_misses";
+            case Counter::TASK_CLOCK:
+                return "task_clock_ns";
+            default:
+                return "unknown";
+        }
+    }
+
+    bool Enable() {
+        auto& registry = GetRegistry();
+        lock_guard<mutex> guard(registry.registry_mutex);
+        if (!registry.is_enabled) {
+            registry.is_enabled = true;
+            // Cycles leads a group, so the counters are scheduled together
+            // and their ratios come from the same intervals even when the
+            // PMU multiplexes. A counter the group cannot take, say past the
+            // hardware counters available, is opened alone instead.
+            auto& files = registry.files;
+            auto& leader = files[size_t(Counter::CYCLES)];
+            leader = OpenCounter(Counter::CYCLES, -1, true);
+            if (leader.fd >= 0) {
+                leader.group_index = registry.group_size++;
+            }
+            for (size_t counter = 0; counter < size_t(Counter::COUNT); ++counter) {
+                if (counter == size_t(Counter::CYCLES)) {
+                    continue;
+                }
+                if (leader.fd >= 0) {
+                    files[counter] = OpenCounter(Counter(counter), leader.fd, true);
+                    if (files[counter].fd >= 0) {
+                        files[counter].group_index = registry.group_size++;
+                        continue;
+                    }
+                }
+                files[counter] = OpenCounter(Counter(counter), -1, false);
+            }
+        }
+        for (const auto& file : registry.files) {
+            if (file.fd >= 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool IsAvailable(Counter counter) {
+        auto& registry = GetRegistry();
+        lock_guard<mutex> guard(registry.registry_mutex);
+        return registry.files[size_t(counter)].fd >= 0;
+    }
+
+    Values Read() {
+        // Files are opened once and never closed, so no lock is needed to
+        // read them after Enable.
+        const auto& registry = GetRegistry();
+        Values values = {};
+        if (registry.group_size > 0) {
+            // Count, time enabled, time running, then the values in the
+            // order the counters joined the group.
+            uint64_t data[3 + size_t(Counter::COUNT)];
+            const ssize_t size = (3 + registry.group_size) * sizeof(uint64_t);
+            const int leader_fd = registry.files[size_t(Counter::CYCLES)].fd;
+            if (read(leader_fd, data, sizeof(data)) == size && data[2] != 0) {
+                for (size_t counter = 0; counter < size_t(Counter::COUNT); ++counter) {
+                    const int group_index = registry.files[counter].group_index;
+                    if (group_index >= 0) {
+                        values[counter] = Scale(data[3 + group_index], data[1], data[2]);
+                    }
+                }
+            }
+        }
+        for (size_t counter = 0; counter < size_t(Counter::COUNT); ++counter) {
+            const auto& file = registry.files[counter];
+            uint64_t data[3];  // value, time enabled, time running
+            if (file.fd < 0 || file.group_index >= 0 || read(file.fd, data, sizeof(data)) != sizeof(data) || data[2] == 0) {
+                continue;
+            }
+            values[counter] = Scale(data[0], data[1], data[2]);
+        }
+        return values;
+    }
+
+    Scope::Scope(const char* name)
+        : name_(name)
+        , start_(Read())
+        , parent_(current_scope)
+    {
+        current_scope = this;
+    }
+
+    Scope::~Scope() {
+        const Values end = Read();
+        current_scope = parent_;
+
+        auto& registry = GetRegistry();
+        lock_guard<mutex> guard(registry.registry_mutex);
+        auto [it, inserted] = registry.totals.try_emplace(name_);
+        if (inserted) {
+            registry.names.push_back(name_);
+        }
+        Totals& totals = it->second;
+        ++totals.call_count;
+        totals.element_count += element_count_;
+        for (size_t counter = 0; counter < size_t(Counter::COUNT); ++counter) {
+            totals.values[counter] += end[counter] - start_[counter];
+        }
+    }
+
+    Scope* Scope::GetCurrent() {
+        return current_scope;
+    }
+
+    Json::Node ToJson() {
+        auto& registry = GetRegistry();
+        lock_guard<mutex> guard(registry.registry_mutex);
+
+        map<string, Json::Node> unavailable;
+        for (size_t counter = 0; counter < size_t(Counter::COUNT); ++counter) {
+            const auto& file = registry.files[counter];
+            if (file.fd < 0) {
+                unavailable[GetCounterName(Counter(counter))] =
+                        Json::Node(registry.is_enabled ? file.error : string("not enabled"));
+            }
+        }
+
+        vector<Json::Node> scopes;
+        for (const char* name : registry.names) {
+            const Totals& totals = registry.totals.at(name);
+            map<string, Json::Node> scope;
+            scope["scope"] = Json::Node(string(name));
+            scope["calls"] = Json::Node(double(totals.call_count));
+            scope["elements"] = Json::Node(double(totals.element_count));
+            for (size_t counter = 0; counter < size_t(Counter::COUNT); ++counter) {
+                if (registry.files[counter].fd < 0) {
+                    continue;
+                }
+                const string counter_name = GetCounterName(Counter(counter));
+                const double value = totals.values[counter];
+                scope[counter_name] = Json::Node(value);
+                if (totals.element_count > 0) {
+                    scope[counter_name + "_per_element"] = Json::Node(value / totals.element_count);
+                }
+            }
+            const auto cycles = totals.values[size_t(Counter::CYCLES)];
+            if (registry.files[size_t(Counter::INSTRUCTIONS)].fd >= 0 && cycles > 0) {
+                scope["ipc"] = Json::Node(double(totals.values[size_t(Counter::INSTRUCTIONS)]) / cycles);
+            }
+            scopes.emplace_back(move(scope));
+        }
+
+        map<string, Json::Node> result;
+        result["unavailable_counters"] = Json::Node(move(unavailable));
+        result["scopes"] = Json::Node(move(scopes));
+        return Json::Node(move(result));
+    }
+
+}
@@ -0,0 +1,80 @@
+#pragma once
+#include "json.h"
+
+#include <array>
+#include <cstdint>
+#include <string>
+
+// Hardware event counts per phase from perf_event_open. Counters are opened
+// once for the whole process with -DTRANSPORT_PERF, as one group led by
+// cycles where the PMU takes them all, and inherited by threads
+// started afterwards; a thread's counts join the totals when it exits, so a
+// scope sees the work of the threads it started and joined. Scopes are
+// meant for the thread that enabled the counters. Where the kernel or the
+// container refuses a counter it is reported as unavailable and the rest
+// still work; without the flag the macros compile to nothing.
+namespace Perf {
+
+    enum class Counter {
+        CYCLES,
+        INSTRUCTIONS,
+        CACHE_MISSES,
+        BRANCH_MISSES,
+        TASK_CLOCK,     // nanoseconds on the CPU, a software counter
+        COUNT
+    };
+
+    const char* GetCounterName(Counter counter);
+
+    using Values = std::array<uint64_t, size_t(Counter::COUNT)>;
+
+    // Opens every counter that the system allows. Returns false if none.
+    bool Enable();
+    bool IsAvailable(Counter counter);
+    // Values since Enable, scaled up when counters were multiplexed.
+    Values Read();
+
+    // Adds the events counted during its life to the totals of its name.
+    // Scopes nest, every one counts its nested scopes too.
+    class Scope {
+    public:
+        // name must be a string literal or otherwise outlive the report.
+        explicit Scope(const char* name);
+        ~Scope();
+
+        // Elements processed in this scope, for the events per element.
+        void AddElements(size_t count) {
+            element_count_ += count;
+        }
+        static Scope* GetCurrent();
+
+        Scope(const Scope&) = delete;
+        Scope& operator = (const Scope&) = delete;
+
+    private:
+        const char* name_;
+        Values start_;
+        size_t element_count_ = 0;
+        Scope* parent_;
+    };
+
+    // Every named scope with its calls, elements, event totals, IPC and
+    // events per element, plus the counters that could not be opened.
+    Json::Node ToJson();
+
+}
+
+#define PERF_CONCAT_IMPL(left, right) left ## right
+#define PERF_CONCAT(left, right) PERF_CONCAT_IMPL(left, right)
+
+#ifdef TRANSPORT_PERF
+#define PERF_ENABLE() Perf::Enable()
+#define PERF_SCOPE(name) Perf::Scope PERF_CONCAT(perf_scope_, __LINE__)(name)
+// Counts elements in the innermost scope of the thread.
+#define PERF_ELEMENTS(count) \
+    do { if (Perf::Scope* perf_scope = Perf::Scope::GetCurrent()) perf_scope->AddElements(count); } while (false)
+#else
+#define PERF_ENABLE()
+#define PERF_SCOPE(name)
+#define PERF_ELEMENTS(count)
+#endif
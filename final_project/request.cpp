@@ -1,7 +1,20 @@
 #include "request.h"
-
+#include "bounded_queue.h"
+#include "memory_accounting.h"
+#include "metrics.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <limits>
+#include <map>
+#include <mutex>
 #include <sstream>
 #include <set>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
 
 using namespace std;
 
@@ -21,18 +34,68 @@ RequestHolder Request::Create(Request::Type type) {
       return make_shared<ReadStopRequest>();
     case Request::Type::READ_ROUTE:
       return make_shared<ReadRouteRequest>();
+    case Request::Type::READ_TIME_MATRIX:
+      return make_shared<ReadTimeMatrixRequest>();
+    case Request::Type::READ_METRICS:
+      return make_shared<ReadMetricsRequest>();
+    case Request::Type::READ_ISOCHRONE:
+      return make_shared<ReadIsochroneRequest>();
     default:
       return nullptr;
   }
 }
 
+optional<TransportSystem::RouterType> ReadRouterTypeFromJson(const Json::Node& router_json) {
+    const string& type_str = router_json.AsString();
+    if (type_str == "all_pairs") {
+        return TransportSystem::RouterType::ALL_PAIRS;
+    } else if (type_str == "dijkstra") {
+        return TransportSystem::RouterType::DIJKSTRA;
+    } else if (type_str == "hub_labels") {
+        return TransportSystem::RouterType::HUB_LABELS;
+    } else if (type_str == "alt") {
+        return TransportSystem::RouterType::ALT;
+    } else if (type_str == "bidirectional_dijkstra") {
+        return TransportSystem::RouterType::BIDIRECTIONAL_DIJKSTRA;
+    } else {
+        return nullopt;
+    }
+}
+
+optional<TransportSystem::VertexOrder> ReadVertexOrderFromJson(const Json::Node& vertex_order_json) {
+    const string& order_str = vertex_order_json.AsString();
+    if (order_str == "input") {
+        return TransportSystem::VertexOrder::INPUT;
+    } else if (order_str == "bfs") {
+        return TransportSystem::VertexOrder::BREADTH_FIRST;
+    } else if (order_str == "rcm") {
+        return TransportSystem::VertexOrder::CUTHILL_MCKEE;
+    } else if (order_str == "hilbert") {
+        return TransportSystem::VertexOrder::HILBERT;
+    } else {
+        return nullopt;
+    }
+}
+
 void AddParamsRequest::ParseFrom(const Json::Node& node) {
     wait_time = node.AsMap().at("bus_wait_time").AsDouble();
     velocity = node.AsMap().at("bus_velocity").AsDouble();
+    if (auto it = node.AsMap().find("router"); it != node.AsMap().end()) {
+        router_type = ReadRouterTypeFromJson(it->second);
+    }
+    if (auto it = node.AsMap().find("vertex_order"); it != node.AsMap().end()) {
+        vertex_order = ReadVertexOrderFromJson(it->second);
+    }
 }
 
 void AddParamsRequest::Process(TransportSystem& ts) const {
     ts.SetParams(wait_time, velocity * 1000.0 / 60.0);
+    if (router_type) {
+        ts.SetRouterType(*router_type);
+    }
+    if (vertex_order) {
+        ts.SetVertexOrder(*vertex_order);
+    }
 }
 
 void AddStopRequest::ParseFrom(const Json::Node& node)  {
@@ -76,6 +139,7 @@ void ReadBusRequest::ParseFrom(const Json::Node& node) {
 }
 
 Json::Node ReadBusRequest::Process(const TransportSystem& ts) const {
+    METRICS_TIMER(BUS_REQUEST);
     map<string, Json::Node> result;
     result["request_id"] = Json::Node(double(request_id));
 
@@ -98,6 +162,7 @@ void ReadStopRequest::ParseFrom(const Json::Node& node) {
 }
 
 Json::Node ReadStopRequest::Process(const TransportSystem& ts) const {
+    METRICS_TIMER(STOP_REQUEST);
     map<string, Json::Node> result;
     result["request_id"] = Json::Node(double(request_id));
 
@@ -130,27 +195,134 @@ void ReadRouteRequest::ParseFrom(const Json::Node& node) {
 }
 
 Json::Node ReadRouteRequest::Process(const TransportSystem& ts) const {
+    METRICS_TIMER(ROUTE_REQUEST);
+    shared_ptr<Stop> from_stop, to_stop;
+    {
+        METRICS_TIMER(STOP_LOOKUP);
+        from_stop = ts.GetStop(from);
+        to_stop = ts.GetStop(to);
+    }
+    if (!from_stop || !to_stop) {
+        return MakeResponse(nullptr);
+    }
+    return MakeResponse(ts.FindRoute(from_stop->id, to_stop->id));
+}
+
+Json::Node ReadRouteRequest::MakeResponse(const RouteAnswerHolder& route) const {
     map<string, Json::Node> result;
     result["request_id"] = Json::Node(double(request_id));
 
-    size_t from_id = ts.GetStop(from)->id;
-    size_t to_id = ts.GetStop(to)->id;
-    auto route = ts.router->BuildRoute(from_id * 2, to_id * 2);
-
     if (!route) {
         result["error_message"] = Json::Node(string("not found"));
     } else {
-        result["total_time"] = route->weight;
-        vector<Json::Node> items;
-        for (size_t i = 0; i < route->edge_count; ++i) {
-            items.push_back(ts.GetEdgeDescription(ts.router->GetRouteEdge(route->id, i)));
+        result["total_time"] = route->total_time;
+        result["items"] = route->items;
+    }
+
+    return Json::Node(result);
+}
+
+void ReadTimeMatrixRequest::ParseFrom(const Json::Node& node) {
+    request_id = node.AsMap().at("id").AsInt();
+    for (const auto& stop_node : node.AsMap().at("from").AsVector()) {
+        from.push_back(stop_node.AsString());
+    }
+    for (const auto& stop_node : node.AsMap().at("to").AsVector()) {
+        to.push_back(stop_node.AsString());
+    }
+}
+
+static optional<vector<Stop::ID>> GetStopIds(const TransportSystem& ts, const vector<string>& stop_names) {
+    vector<Stop::ID> stop_ids;
+    stop_ids.reserve(stop_names.size());
+    for (const auto& stop_name : stop_names) {
+        auto stop = ts.GetStop(stop_name);
+        if (!stop) {
+            return nullopt;
+        }
+        stop_ids.push_back(stop->id);
+    }
+    return stop_ids;
+}
+
+Json::Node ReadTimeMatrixRequest::Process(const TransportSystem& ts) const {
+    METRICS_TIMER(TIME_MATRIX_REQUEST);
+    map<string, Json::Node> result;
+    result["request_id"] = Json::Node(double(request_id));
+
+    const auto from_ids = GetStopIds(ts, from);
+    const auto to_ids = GetStopIds(ts, to);
+    if (!from_ids || !to_ids) {
+        result["error_message"] = Json::Node(string("not found"));
+        return Json::Node(result);
+    }
+
+    const auto times = ts.GetTravelTimes(*from_ids, *to_ids);
+    vector<Json::Node> rows;
+    rows.reserve(from.size());
+    for (size_t row = 0; row < from.size(); ++row) {
+        vector<Json::Node> row_times;
+        row_times.reserve(to.size());
+        for (size_t col = 0; col < to.size(); ++col) {
+            const double time = times[row * to.size() + col];
+            row_times.push_back(Json::Node(isinf(time) ? -1.0 : time));
+        }
+        rows.push_back(Json::Node(move(row_times)));
+    }
+    result["total_times"] = Json::Node(move(rows));
+
+    return Json::Node(result);
+}
+
+void ReadIsochroneRequest::ParseFrom(const Json::Node& node) {
+    request_id = node.AsMap().at("id").AsInt();
+    from = node.AsMap().at("from").AsString();
+    max_time = node.AsMap().at("max_time").AsDouble();
+    if (auto it = node.AsMap().find("max_count"); it != node.AsMap().end()) {
+        const int64_t count = it->second.AsInt();
+        if (count < 0) {
+            throw invalid_argument("negative max_count");
         }
-        result["items"] = Json::Node(items);
+        max_count = count;
+    }
+}
+
+Json::Node ReadIsochroneRequest::Process(const TransportSystem& ts) const {
+    METRICS_TIMER(ISOCHRONE_REQUEST);
+    map<string, Json::Node> result;
+    result["request_id"] = Json::Node(double(request_id));
+
+    const auto from_stop = ts.GetStop(from);
+    if (!from_stop) {
+        result["error_message"] = Json::Node(string("not found"));
+        return Json::Node(result);
+    }
+
+    const auto stops = ts.FindStopsWithin(from_stop->id, max_time, max_count.value_or(numeric_limits<size_t>::max()));
+    vector<Json::Node> items;
+    items.reserve(stops.size());
+    for (const auto& [stop_id, time] : stops) {
+        map<string, Json::Node> item;
+        item["stop_name"] = Json::Node(ts.GetStop(stop_id)->name);
+        item["time"] = Json::Node(time);
+        items.push_back(Json::Node(move(item)));
     }
+    result["stops"] = Json::Node(move(items));
 
     return Json::Node(result);
 }
 
+void ReadMetricsRequest::ParseFrom(const Json::Node& node) {
+    request_id = node.AsMap().at("id").AsInt();
+}
+
+Json::Node ReadMetricsRequest::Process(const TransportSystem&) const {
+    map<string, Json::Node> result;
+    result["request_id"] = Json::Node(double(request_id));
+    result["metrics"] = Metrics::ToJson();
+    return Json::Node(result);
+}
+
 optional<Request::Type> ReadWriteRequestTypeFromString(string_view& request_str) {
     string_view type_str = ReadToken(request_str, " ");
     if (type_str == "Stop") {
@@ -186,6 +358,7 @@ optional<Request::Type> ReadWriteRequestTypeFromJson(const Json::Node& request_j
 }
 
 RequestHolder ParseWriteRequest(const Json::Node& request_json) {
+    MEMORY_SCOPE(REQUESTS);
     const auto request_type = ReadWriteRequestTypeFromJson(request_json);
     if (!request_type) {
         return nullptr;
@@ -218,6 +391,12 @@ optional<Request::Type> ReadReadRequestTypeFromJson(const Json::Node& request_js
         return Request::Type::READ_STOP;
     } else if (type_str == "Route") {
         return Request::Type::READ_ROUTE;
+    } else if (type_str == "TimeMatrix") {
+        return Request::Type::READ_TIME_MATRIX;
+    } else if (type_str == "Metrics") {
+        return Request::Type::READ_METRICS;
+    } else if (type_str == "Isochrone") {
+        return Request::Type::READ_ISOCHRONE;
     } else {
         return nullopt;
     }
@@ -225,6 +404,7 @@ optional<Request::Type> ReadReadRequestTypeFromJson(const Json::Node& request_js
 
 
 RequestHolder ParseReadRequest(const Json::Node& request_json) {
+    MEMORY_SCOPE(REQUESTS);
     const auto request_type = ReadReadRequestTypeFromJson(request_json);
     if (!request_type) {
         return nullptr;
@@ -237,19 +417,50 @@ RequestHolder ParseReadRequest(const Json::Node& request_json) {
 }
 
 pair<vector<RequestHolder>, vector<RequestHolder>> ReadRequests(istream& in_stream) {
-    vector<RequestHolder> write_requests, read_requests;
-    Json::Document requests_json = Json::Load(in_stream);
-    {
-        write_requests.push_back(ParseWriteRequest(requests_json.GetRoot().AsMap().at("routing_settings")));
+    return ReadRequests(Json::Load(in_stream));
+}
+
+pair<vector<RequestHolder>, vector<RequestHolder>> ReadRequests(const Json::Document& requests_json) {
+    MEMORY_SCOPE(REQUESTS);
+    vector<RequestHolder> read_requests;
+    for (const auto& request_json : ReadStatRequestsJson(requests_json)) {
+        read_requests.push_back(ParseReadRequest(request_json));
     }
-    for (const auto& request_json : requests_json.GetRoot().AsMap().at("base_requests").AsVector()) {
-        write_requests.push_back(ParseWriteRequest(request_json));
+    return {ReadWriteRequests(requests_json), read_requests};
+}
+
+vector<RequestHolder> ReadWriteRequests(const Json::Document& requests_json) {
+    MEMORY_SCOPE(REQUESTS);
+    vector<RequestHolder> write_requests;
+    const auto& root = requests_json.GetRoot().AsMap();
+    if (root.count("routing_settings")) {
+        write_requests.push_back(ParseWriteRequest(root.at("routing_settings")));
     }
-    for (const auto& request_json : requests_json.GetRoot().AsMap().at("stat_requests").AsVector()) {
-        read_requests.push_back(ParseReadRequest(request_json));
+    if (root.count("base_requests")) {
+        for (const auto& request_json : root.at("base_requests").AsVector()) {
+            write_requests.push_back(ParseWriteRequest(request_json));
+        }
+    }
+    return write_requests;
+}
+
+const vector<Json::Node>& ReadStatRequestsJson(const Json::Document& requests_json) {
+    static const vector<Json::Node> NO_REQUESTS;
+    const auto& root = requests_json.GetRoot().AsMap();
+    if (!root.count("stat_requests")) {
+        return NO_REQUESTS;
     }
-    return {write_requests, read_requests};
+    return root.at("stat_requests").AsVector();
 }
+
+optional<SerializationSettings> ReadSerializationSettings(const Json::Document& requests_json) {
+    const auto& root = requests_json.GetRoot().AsMap();
+    if (!root.count("serialization_settings")) {
+        return nullopt;
+    }
+    return SerializationSettings{root.at("serialization_settings").AsMap().at("file").AsString()};
+}
+
 /*
 vector<RequestHolder> ReadWriteRequests(istream& in_stream) {
     const size_t request_count = ReadNumberOnLine<size_t>(in_stream);
@@ -269,6 +480,7 @@ vector<RequestHolder> ReadWriteRequests(istream& in_stream) {
 */
 
 void ProcessWriteRequests(const vector<RequestHolder>& requests, TransportSystem& ts) {
+    TRACE_SCOPE("ProcessWriteRequests");
     for (const auto& request_holder : requests) {
         const auto& request = static_cast<const WriteRequest&>(*request_holder);
         request.Process(ts);
@@ -293,16 +505,219 @@ vector<RequestHolder> ReadReadRequests(istream& in_stream) {
 }
 */
 
-Json::Node ProcessReadRequests(const vector<RequestHolder>& requests, TransportSystem& ts) {
-    vector<Json::Node> responses;
-    for (const auto& request_holder : requests) {
-        const auto& request = static_cast<const ReadRequest<Json::Node>&>(*request_holder);
-        responses.push_back(request.Process(ts));
+Json::Node ProcessReadRequests(const vector<RequestHolder>& requests, const TransportSystem& ts, size_t thread_count) {
+    MEMORY_SCOPE(RESPONSES);
+    // Read requests only look at a const TransportSystem, so they are answered
+    // in parallel and every response is written into its own slot.
+    static const size_t CHUNK_SIZE = 16;
+    vector<Json::Node> responses(requests.size());
+
+    // Route requests are grouped by source stop, so that a search-based
+    // router answers all targets of one source from a single search.
+    struct RouteGroup {
+        Stop::ID from;
+        vector<Stop::ID> to;
+        vector<size_t> request_indices;
+    };
+    vector<RouteGroup> route_groups;
+    unordered_map<Stop::ID, size_t> source_to_group;
+    vector<size_t> other_requests;
+    for (size_t request_idx = 0; request_idx < requests.size(); ++request_idx) {
+        if (requests[request_idx]->type == Request::Type::READ_ROUTE) {
+            const auto& request = static_cast<const ReadRouteRequest&>(*requests[request_idx]);
+            auto from_stop = ts.GetStop(request.from);
+            auto to_stop = ts.GetStop(request.to);
+            if (from_stop && to_stop) {
+                auto [it, inserted] = source_to_group.emplace(from_stop->id, route_groups.size());
+                if (inserted) {
+                    route_groups.push_back({from_stop->id, {}, {}});
+                }
+                route_groups[it->second].to.push_back(to_stop->id);
+                route_groups[it->second].request_indices.push_back(request_idx);
+                continue;
+            }
+        }
+        other_requests.push_back(request_idx);
     }
-    return Json::Node(responses);
+
+    ParallelFor(route_groups.size(), thread_count, [&](size_t group_idx) {
+        METRICS_TIMER(ROUTE_GROUP);
+        const auto& group = route_groups[group_idx];
+        const auto answers = ts.FindRoutes(group.from, group.to);
+        for (size_t i = 0; i < answers.size(); ++i) {
+            const size_t request_idx = group.request_indices[i];
+            const auto& request = static_cast<const ReadRouteRequest&>(*requests[request_idx]);
+            responses[request_idx] = request.MakeResponse(answers[i]);
+        }
+    });
+    ParallelFor(other_requests.size(), thread_count, [&](size_t i) {
+        const size_t request_idx = other_requests[i];
+        const auto& request = static_cast<const ReadRequest<Json::Node>&>(*requests[request_idx]);
+        responses[request_idx] = request.Process(ts);
+    }, CHUNK_SIZE);
+    return Json::Node(move(responses));
 }
 
 void PrintResponses(const Json::Node& responses, ostream& stream) {
     stream << responses;
 }
 
+namespace {
+
+    // Route requests of a whole batch grouped by source stop. A group is
+    // answered by the first chunk that needs it, for every target of its
+    // source in the batch, so a source is searched once however the batch
+    // is chunked.
+    class RoutePlan {
+    public:
+        RoutePlan(const vector<Json::Node>& requests_json, const TransportSystem& ts);
+
+        // Answer of the request at request_idx of the batch, nullopt if it
+        // is no route request between known stops.
+        optional<RouteAnswerHolder> GetAnswer(size_t request_idx) const;
+
+    private:
+        static constexpr uint32_t NONE = numeric_limits<uint32_t>::max();
+
+        struct Group {
+            Stop::ID from;
+            vector<Stop::ID> to;
+            once_flag answered;
+            vector<RouteAnswerHolder> answers;
+        };
+
+        const TransportSystem& ts_;
+        mutable deque<Group> groups_;  // once_flag cannot move
+        // Group and position in it of every request.
+        vector<pair<uint32_t, uint32_t>> slots_;
+    };
+
+    RoutePlan::RoutePlan(const vector<Json::Node>& requests_json, const TransportSystem& ts)
+        : ts_(ts)
+        , slots_(requests_json.size(), {NONE, NONE})
+    {
+        unordered_map<Stop::ID, uint32_t> source_to_group;
+        for (size_t request_idx = 0; request_idx < requests_json.size(); ++request_idx) {
+            const auto& request_json = requests_json[request_idx];
+            if (ReadReadRequestTypeFromJson(request_json) != Request::Type::READ_ROUTE) {
+                continue;
+            }
+            const auto from_stop = ts.GetStop(request_json.AsMap().at("from").AsString());
+            const auto to_stop = ts.GetStop(request_json.AsMap().at("to").AsString());
+            if (!from_stop || !to_stop) {
+                continue;
+            }
+            auto [it, inserted] = source_to_group.emplace(from_stop->id, groups_.size());
+            if (inserted) {
+                groups_.emplace_back();
+                groups_.back().from = from_stop->id;
+            }
+            auto& group = groups_[it->second];
+            slots_[request_idx] = {it->second, group.to.size()};
+            group.to.push_back(to_stop->id);
+        }
+    }
+
+    optional<RouteAnswerHolder> RoutePlan::GetAnswer(size_t request_idx) const {
+        const auto [group_idx, position] = slots_[request_idx];
+        if (group_idx == NONE) {
+            return nullopt;
+        }
+        auto& group = groups_[group_idx];
+        call_once(group.answered, [this, &group] {
+            METRICS_TIMER(ROUTE_GROUP);
+            group.answers = ts_.FindRoutes(group.from, group.to);
+        });
+        return group.answers[position];
+    }
+
+}
+
+void ProcessReadRequestsPipelined(const vector<Json::Node>& requests_json, const TransportSystem& ts,
+                                  ostream& stream, size_t thread_count) {
+    TRACE_SCOPE("ProcessReadRequestsPipelined");
+    static const size_t CHUNK_SIZE = 64;
+    static const size_t QUEUE_CAPACITY = 64;
+
+    struct ParsedChunk {
+        size_t index = 0;
+        vector<RequestHolder> requests;
+    };
+    struct AnsweredChunk {
+        size_t index = 0;
+        Json::Node responses;
+    };
+
+    const RoutePlan route_plan(requests_json, ts);
+    const size_t chunk_count = (requests_json.size() + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    // The parser and the writer take a thread each, the rest answer requests.
+    const size_t worker_count = max<size_t>(1, thread_count > 2 ? thread_count - 2 : 1);
+    BoundedQueue<ParsedChunk> parsed_chunks(QUEUE_CAPACITY);
+    BoundedQueue<AnsweredChunk> answered_chunks(QUEUE_CAPACITY);
+
+    thread parser([&] {
+        for (size_t chunk_idx = 0; chunk_idx < chunk_count; ++chunk_idx) {
+            TRACE_SCOPE("ParseRequests");
+            MEMORY_SCOPE(REQUESTS);
+            ParsedChunk chunk{chunk_idx, {}};
+            const size_t end = min(requests_json.size(), (chunk_idx + 1) * CHUNK_SIZE);
+            for (size_t request_idx = chunk_idx * CHUNK_SIZE; request_idx < end; ++request_idx) {
+                chunk.requests.push_back(ParseReadRequest(requests_json[request_idx]));
+            }
+            parsed_chunks.Push(move(chunk));
+        }
+        // A chunk past the end stops one worker.
+        for (size_t worker = 0; worker < worker_count; ++worker) {
+            parsed_chunks.Push({chunk_count, {}});
+        }
+    });
+
+    vector<thread> workers;
+    for (size_t worker = 0; worker < worker_count; ++worker) {
+        workers.emplace_back([&] {
+            for (ParsedChunk chunk = parsed_chunks.Pop(); chunk.index < chunk_count; chunk = parsed_chunks.Pop()) {
+                TRACE_SCOPE("ProcessReadRequests");
+                MEMORY_SCOPE(RESPONSES);
+                vector<Json::Node> responses(chunk.requests.size());
+                for (size_t i = 0; i < chunk.requests.size(); ++i) {
+                    const auto& request = *chunk.requests[i];
+                    if (auto answer = route_plan.GetAnswer(chunk.index * CHUNK_SIZE + i)) {
+                        responses[i] = static_cast<const ReadRouteRequest&>(request).MakeResponse(*answer);
+                    } else {
+                        responses[i] = static_cast<const ReadRequest<Json::Node>&>(request).Process(ts);
+                    }
+                }
+                answered_chunks.Push({chunk.index, Json::Node(move(responses))});
+            }
+        });
+    }
+
+    // The calling thread writes chunks in order, keeping the ones that are
+    // answered early until their turn. The output is the same as printing
+    // all responses with PrintResponses.
+    map<size_t, Json::Node> early_chunks;
+    bool is_first = true;
+    stream << "[\n";
+    for (size_t next_chunk = 0; next_chunk < chunk_count; ) {
+        AnsweredChunk chunk = answered_chunks.Pop();
+        early_chunks.emplace(chunk.index, move(chunk.responses));
+        for (auto it = early_chunks.begin(); it != early_chunks.end() && it->first == next_chunk;
+                it = early_chunks.erase(it), ++next_chunk) {
+            TRACE_SCOPE("PrintResponses");
+            for (const auto& response : it->second.AsVector()) {
+                if (!is_first) {
+                    stream << ",\n";
+                }
+                is_first = false;
+                stream << response;
+            }
+        }
+    }
+    stream << "\n]";
+
+    parser.join();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
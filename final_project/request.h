@@ -5,6 +5,7 @@
 
 #include <string>
 #include <memory>
+#include <optional>
 #include <vector>
 #include <string_view>
 #include <utility>
@@ -20,7 +21,10 @@ struct Request {
         ADD_PARAMS = 3,
         READ_BUS = 4,
         READ_STOP = 5,
-        READ_ROUTE = 6
+        READ_ROUTE = 6,
+        READ_TIME_MATRIX = 7,
+        READ_METRICS = 8,
+        READ_ISOCHRONE = 9
     };
 
     Request(Type type) : type(type) {}
@@ -49,6 +53,8 @@ struct AddParamsRequest : WriteRequest {
     void Process(TransportSystem& ts) const override;
 
     double wait_time, velocity;
+    std::optional<TransportSystem::RouterType> router_type;
+    std::optional<TransportSystem::VertexOrder> vertex_order;
 };
 
 struct AddStopRequest : WriteRequest {
@@ -101,17 +107,64 @@ struct ReadRouteRequest : ReadRequest<Json::Node> {
     ReadRouteRequest(): ReadRequest(Type::READ_ROUTE) {}
     void ParseFrom(const Json::Node& node) override;
     Json::Node Process(const TransportSystem& ts) const override;
+    Json::Node MakeResponse(const RouteAnswerHolder& route) const;
 
     std::string from, to;
 };
 
+// Travel times between every pair of stops from two lists. Rows follow
+// "from", columns follow "to", and -1 marks pairs without a route.
+struct ReadTimeMatrixRequest : ReadRequest<Json::Node> {
+    ReadTimeMatrixRequest(): ReadRequest(Type::READ_TIME_MATRIX) {}
+    void ParseFrom(const Json::Node& node) override;
+    Json::Node Process(const TransportSystem& ts) const override;
+
+    std::vector<std::string> from, to;
+};
+
+// Stops reachable from "from" within max_time minutes with their travel
+// times, nearest first. max_count, if given, keeps only the nearest ones.
+struct ReadIsochroneRequest : ReadRequest<Json::Node> {
+    ReadIsochroneRequest(): ReadRequest(Type::READ_ISOCHRONE) {}
+    void ParseFrom(const Json::Node& node) override;
+    Json::Node Process(const TransportSystem& ts) const override;
+
+    std::string from;
+    double max_time;
+    std::optional<size_t> max_count;
+};
+
+// Latency histograms recorded so far, empty unless built with metrics.
+struct ReadMetricsRequest : ReadRequest<Json::Node> {
+    ReadMetricsRequest(): ReadRequest(Type::READ_METRICS) {}
+    void ParseFrom(const Json::Node& node) override;
+    Json::Node Process(const TransportSystem& ts) const override;
+};
+
 RequestHolder ParseWriteRequest(const Json::Node& request_json);
 RequestHolder ParseReadRequest(const Json::Node& request_json);
 
 std::pair<std::vector<RequestHolder>, std::vector<RequestHolder>> ReadRequests(std::istream& in_stream = std::cin);
+std::pair<std::vector<RequestHolder>, std::vector<RequestHolder>> ReadRequests(const Json::Document& requests_json);
+
+struct SerializationSettings {
+    std::string file;
+};
+std::optional<SerializationSettings> ReadSerializationSettings(const Json::Document& requests_json);
 // std::vector<RequestHolder> ReadWriteRequests(std::istream& in_stream = std::cin);
+std::vector<RequestHolder> ReadWriteRequests(const Json::Document& requests_json);
+const std::vector<Json::Node>& ReadStatRequestsJson(const Json::Document& requests_json);
 void ProcessWriteRequests(const std::vector<RequestHolder>& requests, TransportSystem& ts);
 //std::vector<RequestHolder> ReadReadRequests(std::istream& in_stream = std::cin);
-Json::Node ProcessReadRequests(const std::vector<RequestHolder>& requests, TransportSystem& ts);
+Json::Node ProcessReadRequests(const std::vector<RequestHolder>& requests, const TransportSystem& ts,
+                               size_t thread_count = DefaultThreadCount());
 void PrintResponses(const Json::Node& responses, std::ostream& stream = std::cout);
+// Prints the same as ProcessReadRequests followed by PrintResponses. Stat
+// requests go in chunks through three stages running at once: a parser
+// thread, workers answering chunks and the calling thread printing them in
+// order. The stages are linked by bounded lock-free queues. Route requests
+// are grouped by source over the whole batch first, so every source is
+// searched once as in ProcessReadRequests.
+void ProcessReadRequestsPipelined(const std::vector<Json::Node>& requests_json, const TransportSystem& ts,
+                                  std::ostream& stream = std::cout, size_t thread_count = DefaultThreadCount());
 
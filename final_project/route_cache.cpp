@@ -0,0 +1,77 @@
+#include "route_cache.h"
+
+#include <algorithm>
+
+using namespace std;
+
+RouteCache::RouteCache(size_t capacity)
+    : shards_(SHARD_COUNT)
+{
+    SetCapacity(capacity);
+}
+
+RouteCache::Shard& RouteCache::GetShard(const Key& key) const {
+    // The low bits feed the shard's own hash table, so pick the shard by
+    // the top ones.
+    const uint64_t hash = KeyHasher()(key);
+    return shards_[hash >> (64 - SHARD_BITS)];
+}
+
+optional<RouteAnswerHolder> RouteCache::Get(const Key& key) const {
+    if (shard_capacity_ == 0) {
+        ++misses_;
+        return nullopt;
+    }
+    Shard& shard = GetShard(key);
+    lock_guard<mutex> guard(shard.mutex);
+    auto it = shard.index.find(key);
+    if (it == shard.index.end()) {
+        ++misses_;
+        return nullopt;
+    }
+    ++hits_;
+    shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+    return it->second->second;
+}
+
+void RouteCache::Put(const Key& key, RouteAnswerHolder answer) const {
+    if (shard_capacity_ == 0) {
+        return;
+    }
+    Shard& shard = GetShard(key);
+    lock_guard<mutex> guard(shard.mutex);
+    if (auto it = shard.index.find(key); it != shard.index.end()) {
+        it->second->second = move(answer);
+        shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+        return;
+    }
+    shard.entries.emplace_front(key, move(answer));
+    shard.index[key] = shard.entries.begin();
+    if (shard.entries.size() > shard_capacity_) {
+        shard.index.erase(shard.entries.back().first);
+        shard.entries.pop_back();
+    }
+}
+
+void RouteCache::Clear() const {
+    for (auto& shard : shards_) {
+        lock_guard<mutex> guard(shard.mutex);
+        shard.entries.clear();
+        shard.index.clear();
+    }
+}
+
+void RouteCache::SetCapacity(size_t capacity) {
+    Clear();
+    capacity_ = capacity;
+    shard_capacity_ = (capacity + SHARD_COUNT - 1) / SHARD_COUNT;
+}
+
+RouteCache::Stats RouteCache::GetStats() const {
+    size_t size = 0;
+    for (auto& shard : shards_) {
+        lock_guard<mutex> guard(shard.mutex);
+        size += shard.entries.size();
+    }
+    return {hits_.load(), misses_.load(), size};
+}
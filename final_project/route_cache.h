@@ -0,0 +1,83 @@
+#pragma once
+#include "json.h"
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+struct RouteAnswer {
+    double total_time;
+    Json::Node items;
+};
+
+// nullptr means that there is no route between the stops.
+using RouteAnswerHolder = std::shared_ptr<const RouteAnswer>;
+
+// Bounded LRU cache of rendered route answers keyed by (from_id, to_id).
+// Keys are spread over independently locked shards, so concurrent readers
+// rarely wait for each other.
+class RouteCache {
+public:
+    using Key = std::pair<size_t, size_t>;
+
+    struct Stats {
+        uint64_t hits;
+        uint64_t misses;
+        size_t size;
+    };
+
+    explicit RouteCache(size_t capacity = DEFAULT_CAPACITY);
+
+    std::optional<RouteAnswerHolder> Get(const Key& key) const;
+    void Put(const Key& key, RouteAnswerHolder answer) const;
+    void Clear() const;
+
+    void SetCapacity(size_t capacity);
+    size_t GetCapacity() const {
+        return capacity_;
+    }
+    Stats GetStats() const;
+
+    static const size_t DEFAULT_CAPACITY = 1 << 16;
+
+private:
+    static const int SHARD_BITS = 4;
+    static const size_t SHARD_COUNT = 1 << SHARD_BITS;
+
+    // std::hash of an integer is the identity in libstdc++, and stop ids
+    // are small, so the packed key is mixed (murmur3 fmix64) for all bits
+    // to count.
+    struct KeyHasher {
+        size_t operator()(const Key& key) const {
+            uint64_t hash = (uint64_t(key.first) << 32) ^ key.second;
+            hash ^= hash >> 33;
+            hash *= 0xff51afd7ed558ccdULL;
+            hash ^= hash >> 33;
+            hash *= 0xc4ceb9fe1a85ec53ULL;
+            hash ^= hash >> 33;
+            return hash;
+        }
+    };
+
+    struct Shard {
+        using Entry = std::pair<Key, RouteAnswerHolder>;
+
+        std::mutex mutex;
+        std::list<Entry> entries;  // most recently used first
+        std::unordered_map<Key, std::list<Entry>::iterator, KeyHasher> index;
+    };
+
+    Shard& GetShard(const Key& key) const;
+
+    size_t capacity_;
+    size_t shard_capacity_;
+    mutable std::vector<Shard> shards_;
+    mutable std::atomic<uint64_t> hits_ = 0;
+    mutable std::atomic<uint64_t> misses_ = 0;
+};
@@ -1,92 +1,124 @@
 #pragma once
 
+#include "flat_array.h"
 #include "graph.h"
+#include "router_base.h"
+#include "dijkstra.h"
 
 #include <algorithm>
 #include <cassert>
 #include <cstdint>
 #include <iterator>
+#include <limits>
+#include <memory>
 #include <optional>
-#include <unordered_map>
+#include <stdexcept>
 #include <utility>
 #include <vector>
 
 namespace Graph {
 
     template <typename Weight>
-        class Router {
+        class Router : public RouterBase<Weight> {
             private:
                 using Graph = DirectedWeightedGraph<Weight>;
 
             public:
+                // Route between a pair of vertices. prev_edge is the last edge
+                // of the route, NO_EDGE for an empty route and NO_ROUTE when
+                // there is no route at all.
+                struct RouteInternalData {
+                    Weight weight;
+                    EdgeId prev_edge;
+
+                    bool HasRoute() const {
+                        return prev_edge != NO_ROUTE;
+                    }
+                };
+                static constexpr EdgeId NO_ROUTE = std::numeric_limits<EdgeId>::max();
+                static constexpr EdgeId NO_EDGE = NO_ROUTE - 1;
+
+                // Row-major vertex_count x vertex_count matrix. It has no
+                // pointers inside, so it can be saved as is and used in place
+                // from a memory-mapped snapshot.
+                using RoutesInternalData = FlatArray<RouteInternalData>;
+
                 Router(const Graph& graph);
+                // Uses precomputed routes instead of computing them.
+                Router(const Graph& graph, RoutesInternalData routes_internal_data);
 
-                using RouteId = uint64_t;
+                const RoutesInternalData& GetRoutesInternalData() const {
+                    return routes_internal_data_;
+                }
 
-                struct RouteInfo {
-                    RouteId id;
-                    Weight weight;
-                    size_t edge_count;
-                };
+                using typename RouterBase<Weight>::RouteInfo;
 
-                std::optional<RouteInfo> BuildRoute(VertexId from, VertexId to) const;
-                EdgeId GetRouteEdge(RouteId route_id, size_t edge_idx) const;
-                void ReleaseRoute(RouteId route_id);
+                std::optional<RouteInfo> BuildRoute(VertexId from, VertexId to) const override;
+                std::optional<Weight> GetRouteWeight(VertexId from, VertexId to) const override;
+                // New vertices get empty rows and columns. Sources whose
+                // shortest path trees used an edge that got heavier are
+                // recomputed with Dijkstra. New and lighter edges are then
+                // applied one by one, relaxing only the pairs they improve.
+                bool Update(const GraphChanges<Weight>& changes) override;
+                std::unique_ptr<RouterBase<Weight>> Clone(const Graph& graph) const override {
+                    return std::make_unique<Router>(graph, routes_internal_data_);
+                }
 
             private:
                 const Graph& graph_;
+                size_t vertex_count_;
 
-                struct RouteInternalData {
-                    Weight weight;
-                    std::optional<EdgeId> prev_edge;
-                };
-                using RoutesInternalData = std::vector<std::vector<std::optional<RouteInternalData>>>;
-
-                using ExpandedRoute = std::vector<EdgeId>;
-                mutable RouteId next_route_id_ = 0;
-                mutable std::unordered_map<RouteId, ExpandedRoute> expanded_routes_cache_;
+                const RouteInternalData& GetRouteInternalData(VertexId from, VertexId to) const {
+                    return routes_internal_data_[from * vertex_count_ + to];
+                }
 
-                void InitializeRoutesInternalData(const Graph& graph) {
+                static void InitializeRoutesInternalData(const Graph& graph, std::vector<RouteInternalData>& routes) {
                     const size_t vertex_count = graph.GetVertexCount();
                     for (VertexId vertex = 0; vertex < vertex_count; ++vertex) {
-                        routes_internal_data_[vertex][vertex] = RouteInternalData{0, std::nullopt};
+                        routes[vertex * vertex_count + vertex] = RouteInternalData{0, NO_EDGE};
                         for (const EdgeId edge_id : graph.GetIncidentEdges(vertex)) {
                             const auto& edge = graph.GetEdge(edge_id);
                             assert(edge.weight >= 0);
-                            auto& route_internal_data = routes_internal_data_[vertex][edge.to];
-                            if (!route_internal_data || route_internal_data->weight > edge.weight) {
+                            auto& route_internal_data = routes[vertex * vertex_count + edge.to];
+                            if (!route_internal_data.HasRoute() || route_internal_data.weight > edge.weight) {
                                 route_internal_data = RouteInternalData{edge.weight, edge_id};
                             }
                         }
                     }
                 }
 
-                void RelaxRoute(VertexId vertex_from, VertexId vertex_to,
+                static void RelaxRoute(RouteInternalData& route_relaxing,
                         const RouteInternalData& route_from, const RouteInternalData& route_to) {
-                    auto& route_relaxing = routes_internal_data_[vertex_from][vertex_to];
                     const Weight candidate_weight = route_from.weight + route_to.weight;
-                    if (!route_relaxing || candidate_weight < route_relaxing->weight) {
+                    if (!route_relaxing.HasRoute() || candidate_weight < route_relaxing.weight) {
                         route_relaxing = {
                             candidate_weight,
-                            route_to.prev_edge
+                            route_to.prev_edge != NO_EDGE
                                 ? route_to.prev_edge
                                 : route_from.prev_edge
                         };
                     }
                 }
 
-                void RelaxRoutesInternalDataThroughVertex(size_t vertex_count, VertexId vertex_through) {
+                static void RelaxRoutesInternalDataThroughVertex(std::vector<RouteInternalData>& routes,
+                        size_t vertex_count, VertexId vertex_through) {
+                    const RouteInternalData* through_row = routes.data() + vertex_through * vertex_count;
                     for (VertexId vertex_from = 0; vertex_from < vertex_count; ++vertex_from) {
-                        if (const auto& route_from = routes_internal_data_[vertex_from][vertex_through]) {
+                        RouteInternalData* from_row = routes.data() + vertex_from * vertex_count;
+                        if (const auto& route_from = from_row[vertex_through]; route_from.HasRoute()) {
                             for (VertexId vertex_to = 0; vertex_to < vertex_count; ++vertex_to) {
-                                if (const auto& route_to = routes_internal_data_[vertex_through][vertex_to]) {
-                                    RelaxRoute(vertex_from, vertex_to, *route_from, *route_to);
+                                if (const auto& route_to = through_row[vertex_to]; route_to.HasRoute()) {
+                                    RelaxRoute(from_row[vertex_to], route_from, route_to);
                                 }
                             }
                         }
                     }
                 }
 
+                void ResizeRoutesInternalData(std::vector<RouteInternalData>& routes, size_t vertex_count);
+                void RecomputeSource(std::vector<RouteInternalData>& routes, VertexId source) const;
+                void RelaxThroughEdge(std::vector<RouteInternalData>& routes, EdgeId edge_id) const;
+
                 RoutesInternalData routes_internal_data_;
         };
 
@@ -94,45 +126,151 @@ namespace Graph {
     template <typename Weight>
         Router<Weight>::Router(const Graph& graph)
         : graph_(graph),
-        routes_internal_data_(graph.GetVertexCount(), std::vector<std::optional<RouteInternalData>>(graph.GetVertexCount()))
+        vertex_count_(graph.GetVertexCount())
     {
-        InitializeRoutesInternalData(graph);
+        std::vector<RouteInternalData> routes(vertex_count_ * vertex_count_, RouteInternalData{0, NO_ROUTE});
+        InitializeRoutesInternalData(graph, routes);
 
-        const size_t vertex_count = graph.GetVertexCount();
-        for (VertexId vertex_through = 0; vertex_through < vertex_count; ++vertex_through) {
-            RelaxRoutesInternalDataThroughVertex(vertex_count, vertex_through);
+        for (VertexId vertex_through = 0; vertex_through < vertex_count_; ++vertex_through) {
+            RelaxRoutesInternalDataThroughVertex(routes, vertex_count_, vertex_through);
+        }
+        routes_internal_data_ = std::move(routes);
+    }
+
+    template <typename Weight>
+        Router<Weight>::Router(const Graph& graph, RoutesInternalData routes_internal_data)
+        : graph_(graph),
+        vertex_count_(graph.GetVertexCount()),
+        routes_internal_data_(std::move(routes_internal_data))
+    {
+        if (routes_internal_data_.size() != vertex_count_ * vertex_count_) {
+            throw std::invalid_argument("routes do not match the graph");
         }
     }
 
     template <typename Weight>
         std::optional<typename Router<Weight>::RouteInfo> Router<Weight>::BuildRoute(VertexId from, VertexId to) const {
-            const auto& route_internal_data = routes_internal_data_[from][to];
-            if (!route_internal_data) {
+            const auto& route_internal_data = GetRouteInternalData(from, to);
+            if (!route_internal_data.HasRoute()) {
                 return std::nullopt;
             }
-            const Weight weight = route_internal_data->weight;
+            const Weight weight = route_internal_data.weight;
             std::vector<EdgeId> edges;
-            for (std::optional<EdgeId> edge_id = route_internal_data->prev_edge;
-                    edge_id;
-                    edge_id = routes_internal_data_[from][graph_.GetEdge(*edge_id).from]->prev_edge) {
-                edges.push_back(*edge_id);
+            for (EdgeId edge_id = route_internal_data.prev_edge;
+                    edge_id != NO_EDGE;
+                    edge_id = GetRouteInternalData(from, graph_.GetEdge(edge_id).from).prev_edge) {
+                edges.push_back(edge_id);
             }
             std::reverse(std::begin(edges), std::end(edges));
 
-            const RouteId route_id = next_route_id_++;
-            const size_t route_edge_count = edges.size();
-            expanded_routes_cache_[route_id] = std::move(edges);
-            return RouteInfo{route_id, weight, route_edge_count};
+            return this->SaveRoute(weight, std::move(edges));
         }
 
     template <typename Weight>
-        EdgeId Router<Weight>::GetRouteEdge(RouteId route_id, size_t edge_idx) const {
-            return expanded_routes_cache_.at(route_id)[edge_idx];
+        std::optional<Weight> Router<Weight>::GetRouteWeight(VertexId from, VertexId to) const {
+            if (const auto& route_internal_data = GetRouteInternalData(from, to); route_internal_data.HasRoute()) {
+                return route_internal_data.weight;
+            }
+            return std::nullopt;
         }
 
     template <typename Weight>
-        void Router<Weight>::ReleaseRoute(RouteId route_id) {
-            expanded_routes_cache_.erase(route_id);
+        bool Router<Weight>::Update(const GraphChanges<Weight>& changes) {
+            routes_internal_data_.Modify([this, &changes](std::vector<RouteInternalData>& routes) {
+                ResizeRoutesInternalData(routes, graph_.GetVertexCount());
+
+                std::vector<bool> is_heavier(graph_.GetEdgeCount());
+                std::vector<EdgeId> lighter_edges = changes.added_edges;
+                bool has_heavier = false;
+                for (const auto& [edge_id, old_weight] : changes.reweighted_edges) {
+                    const Weight weight = graph_.GetEdge(edge_id).weight;
+                    if (weight > old_weight) {
+                        is_heavier[edge_id] = has_heavier = true;
+                    } else if (weight < old_weight) {
+                        lighter_edges.push_back(edge_id);
+                    }
+                }
+
+                if (has_heavier) {
+                    for (VertexId source = 0; source < vertex_count_; ++source) {
+                        const RouteInternalData* row = routes.data() + source * vertex_count_;
+                        const bool is_affected = std::any_of(row, row + vertex_count_, [&is_heavier](const auto& route) {
+                            return route.prev_edge < is_heavier.size() && is_heavier[route.prev_edge];
+                        });
+                        if (is_affected) {
+                            RecomputeSource(routes, source);
+                        }
+                    }
+                }
+
+                for (const EdgeId edge_id : lighter_edges) {
+                    RelaxThroughEdge(routes, edge_id);
+                }
+            });
+            return true;
+        }
+
+    template <typename Weight>
+        void Router<Weight>::ResizeRoutesInternalData(std::vector<RouteInternalData>& routes, size_t vertex_count) {
+            if (vertex_count == vertex_count_) {
+                return;
+            }
+            std::vector<RouteInternalData> resized(vertex_count * vertex_count, RouteInternalData{0, NO_ROUTE});
+            for (VertexId from = 0; from < vertex_count_; ++from) {
+                std::copy_n(routes.begin() + from * vertex_count_, vertex_count_, resized.begin() + from * vertex_count);
+            }
+            for (VertexId vertex = vertex_count_; vertex < vertex_count; ++vertex) {
+                resized[vertex * vertex_count + vertex] = RouteInternalData{0, NO_EDGE};
+            }
+            routes = std::move(resized);
+            vertex_count_ = vertex_count;
+        }
+
+    template <typename Weight>
+        void Router<Weight>::RecomputeSource(std::vector<RouteInternalData>& routes, VertexId source) const {
+            const ShortestPathTree<Weight> tree(graph_, source);
+            RouteInternalData* row = routes.data() + source * vertex_count_;
+            for (VertexId to = 0; to < vertex_count_; ++to) {
+                if (const auto weight = tree.GetWeight(to)) {
+                    row[to] = RouteInternalData{*weight, tree.GetLastEdge(to).value_or(NO_EDGE)};
+                } else {
+                    row[to] = RouteInternalData{0, NO_ROUTE};
+                }
+            }
+        }
+
+    template <typename Weight>
+        void Router<Weight>::RelaxThroughEdge(std::vector<RouteInternalData>& routes, EdgeId edge_id) const {
+            const auto& edge = graph_.GetEdge(edge_id);
+            const RouteInternalData* edge_to_row = routes.data() + edge.to * vertex_count_;
+            for (VertexId source = 0; source < vertex_count_; ++source) {
+                RouteInternalData* row = routes.data() + source * vertex_count_;
+                if (!row[edge.from].HasRoute()) {
+                    continue;
+                }
+                const Weight weight_through_edge = row[edge.from].weight + edge.weight;
+                // If the edge does not improve the route to its own end, it
+                // cannot improve any route from this source.
+                if (row[edge.to].HasRoute() && !(weight_through_edge < row[edge.to].weight)) {
+                    continue;
+                }
+                for (VertexId to = 0; to < vertex_count_; ++to) {
+                    const auto& route_from_edge = edge_to_row[to];
+                    if (!route_from_edge.HasRoute()) {
+                        continue;
+                    }
+                    const Weight candidate_weight = weight_through_edge + route_from_edge.weight;
+                    auto& route = row[to];
+                    if (!route.HasRoute() || candidate_weight < route.weight) {
+                        route = {
+                            candidate_weight,
+                            route_from_edge.prev_edge != NO_EDGE
+                                ? route_from_edge.prev_edge
+                                : edge_id
+                        };
+                    }
+                }
+            }
         }
 
 }
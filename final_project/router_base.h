@@ -0,0 +1,124 @@
+#pragma once
+
+#include "graph.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace Graph {
+
+    // Changes made to a graph after a router was built for it: vertices
+    // starting from old_vertex_count, new edges and edges whose weight was
+    // changed, listed with their previous weight.
+    template <typename Weight>
+        struct GraphChanges {
+            size_t old_vertex_count = 0;
+            std::vector<EdgeId> added_edges;
+            std::vector<std::pair<EdgeId, Weight>> reweighted_edges;
+
+            GraphChanges() = default;
+            explicit GraphChanges(size_t vertex_count) : old_vertex_count(vertex_count) {}
+
+            // No changes yet to a graph of vertex_count vertices.
+            void Reset(size_t vertex_count) {
+                old_vertex_count = vertex_count;
+                added_edges.clear();
+                reweighted_edges.clear();
+            }
+            bool Empty(size_t vertex_count) const {
+                return old_vertex_count == vertex_count && added_edges.empty() && reweighted_edges.empty();
+            }
+        };
+
+    // Common interface of all routers. BuildRoute finds a route and keeps its
+    // edges until ReleaseRoute, GetRouteEdge walks them in order.
+    template <typename Weight>
+        class RouterBase {
+            public:
+                using RouteId = uint64_t;
+
+                struct RouteInfo {
+                    RouteId id;
+                    Weight weight;
+                    size_t edge_count;
+                };
+
+                virtual ~RouterBase() = default;
+
+                virtual std::optional<RouteInfo> BuildRoute(VertexId from, VertexId to) const = 0;
+                // Route weight without expanding the route edges.
+                virtual std::optional<Weight> GetRouteWeight(VertexId from, VertexId to) const;
+                // Brings the router up to date with its changed graph. Returns
+                // false if the router cannot do it and has to be rebuilt.
+                virtual bool Update(const GraphChanges<Weight>&) {
+                    return false;
+                }
+                // Router for a copy of its graph. Precomputed data is shared
+                // with this router until either of them is updated.
+                virtual std::unique_ptr<RouterBase> Clone(const DirectedWeightedGraph<Weight>& graph) const = 0;
+                EdgeId GetRouteEdge(RouteId route_id, size_t edge_idx) const;
+                void ReleaseRoute(RouteId route_id) const;
+                // All edges of a route at once, the route is released.
+                std::vector<EdgeId> ExtractRoute(RouteId route_id) const;
+
+            protected:
+                RouteInfo SaveRoute(Weight weight, std::vector<EdgeId> edges) const;
+
+            private:
+                using ExpandedRoute = std::vector<EdgeId>;
+
+                // Route queries may run concurrently, so the expanded routes
+                // are the only shared state and are guarded by a mutex.
+                mutable std::atomic<RouteId> next_route_id_ = 0;
+                mutable std::mutex expanded_routes_mutex_;
+                mutable std::unordered_map<RouteId, ExpandedRoute> expanded_routes_cache_;
+        };
+
+
+    template <typename Weight>
+        std::optional<Weight> RouterBase<Weight>::GetRouteWeight(VertexId from, VertexId to) const {
+            const auto route = BuildRoute(from, to);
+            if (!route) {
+                return std::nullopt;
+            }
+            ReleaseRoute(route->id);
+            return route->weight;
+        }
+
+    template <typename Weight>
+        typename RouterBase<Weight>::RouteInfo RouterBase<Weight>::SaveRoute(Weight weight, std::vector<EdgeId> edges) const {
+            const RouteId route_id = next_route_id_++;
+            const size_t route_edge_count = edges.size();
+            std::lock_guard<std::mutex> guard(expanded_routes_mutex_);
+            expanded_routes_cache_[route_id] = std::move(edges);
+            return RouteInfo{route_id, weight, route_edge_count};
+        }
+
+    template <typename Weight>
+        EdgeId RouterBase<Weight>::GetRouteEdge(RouteId route_id, size_t edge_idx) const {
+            std::lock_guard<std::mutex> guard(expanded_routes_mutex_);
+            return expanded_routes_cache_.at(route_id)[edge_idx];
+        }
+
+    template <typename Weight>
+        void RouterBase<Weight>::ReleaseRoute(RouteId route_id) const {
+            std::lock_guard<std::mutex> guard(expanded_routes_mutex_);
+            expanded_routes_cache_.erase(route_id);
+        }
+
+    template <typename Weight>
+        std::vector<EdgeId> RouterBase<Weight>::ExtractRoute(RouteId route_id) const {
+            std::lock_guard<std::mutex> guard(expanded_routes_mutex_);
+            const auto it = expanded_routes_cache_.find(route_id);
+            std::vector<EdgeId> edges = std::move(it->second);
+            expanded_routes_cache_.erase(it);
+            return edges;
+        }
+
+}
@@ -0,0 +1,70 @@
+#include "serialization.h"
+
+#include <algorithm>
+#include <iterator>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace Serialization {
+
+    void WriteString(ostream& output, const string& value) {
+        WriteValue<uint64_t>(output, value.size());
+        output.write(value.data(), value.size());
+    }
+
+    string ReadString(istream& input) {
+        string value(ReadValue<uint64_t>(input), '\0');
+        if (!input.read(value.data(), value.size())) {
+            throw runtime_error("unexpected end of snapshot");
+        }
+        return value;
+    }
+
+    shared_ptr<const Buffer> Buffer::MapFile(const string& path) {
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw runtime_error("cannot open snapshot " + path);
+        }
+        struct stat file_stat;
+        if (fstat(fd, &file_stat) != 0) {
+            close(fd);
+            throw runtime_error("cannot stat snapshot " + path);
+        }
+
+        shared_ptr<Buffer> buffer(new Buffer);
+        buffer->size_ = file_stat.st_size;
+        if (buffer->size_ > 0) {
+            void* mapping = mmap(nullptr, buffer->size_, PROT_READ, MAP_SHARED, fd, 0);
+            if (mapping == MAP_FAILED) {
+                close(fd);
+                throw runtime_error("cannot map snapshot " + path);
+            }
+            buffer->mapping_ = mapping;
+            buffer->data_ = static_cast<const char*>(mapping);
+        }
+        close(fd);
+        return buffer;
+    }
+
+    shared_ptr<const Buffer> Buffer::ReadStream(istream& input) {
+        const string bytes{istreambuf_iterator<char>(input), istreambuf_iterator<char>()};
+        shared_ptr<Buffer> buffer(new Buffer);
+        buffer->heap_.resize((bytes.size() + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+        copy(bytes.begin(), bytes.end(), reinterpret_cast<char*>(buffer->heap_.data()));
+        buffer->data_ = reinterpret_cast<const char*>(buffer->heap_.data());
+        buffer->size_ = bytes.size();
+        return buffer;
+    }
+
+    Buffer::~Buffer() {
+        if (mapping_) {
+            munmap(mapping_, size_);
+        }
+    }
+
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include "flat_array.h"
+
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Little helpers for the binary snapshot format. Values are written in the
+// host byte order, the snapshot is not meant to move between machines.
+namespace Serialization {
+
+    template <typename T>
+    void WriteValue(std::ostream& output, const T& value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        output.write(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    template <typename T>
+    T ReadValue(std::istream& input) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        T value;
+        if (!input.read(reinterpret_cast<char*>(&value), sizeof(value))) {
+            throw std::runtime_error("unexpected end of snapshot");
+        }
+        return value;
+    }
+
+    void WriteString(std::ostream& output, const std::string& value);
+    std::string ReadString(std::istream& input);
+
+    // Read-only bytes of a whole snapshot: either a file mapped into memory
+    // or a stream copied into 8-byte aligned heap memory.
+    class Buffer {
+    public:
+        static std::shared_ptr<const Buffer> MapFile(const std::string& path);
+        static std::shared_ptr<const Buffer> ReadStream(std::istream& input);
+
+        Buffer(const Buffer&) = delete;
+        Buffer& operator = (const Buffer&) = delete;
+        ~Buffer();
+
+        const char* data() const {
+            return data_;
+        }
+        size_t size() const {
+            return size_;
+        }
+
+    private:
+        Buffer() = default;
+
+        const char* data_ = nullptr;
+        size_t size_ = 0;
+        void* mapping_ = nullptr;
+        std::vector<uint64_t> heap_;
+    };
+
+    // Arrays of plain values back to back, each one as its uint64_t element
+    // count followed by the elements, both at 8-byte aligned offsets. The
+    // writer keeps pointers to the elements, they must outlive it.
+    class ArrayWriter {
+    public:
+        using Piece = std::pair<const char*, size_t>;
+
+        template <typename T>
+        void Write(const T* data, size_t count) {
+            static_assert(std::is_trivially_copyable_v<T> && alignof(T) <= sizeof(uint64_t));
+            static const char PADDING[sizeof(uint64_t)] = {};
+            counts_.push_back(count);
+            const size_t size = count * sizeof(T);
+            const size_t padding = (sizeof(uint64_t) - size % sizeof(uint64_t)) % sizeof(uint64_t);
+            pieces_.push_back({reinterpret_cast<const char*>(&counts_.back()), sizeof(uint64_t)});
+            pieces_.push_back({reinterpret_cast<const char*>(data), size});
+            pieces_.push_back({PADDING, padding});
+            size_ += sizeof(uint64_t) + size + padding;
+        }
+        template <typename Array>
+        void Write(const Array& values) {
+            Write(values.data(), values.size());
+        }
+
+        // Bytes written so far, always a multiple of 8.
+        size_t size() const {
+            return size_;
+        }
+        const std::vector<Piece>& GetPieces() const {
+            return pieces_;
+        }
+
+    private:
+        std::deque<uint64_t> counts_;  // stable addresses
+        std::vector<Piece> pieces_;
+        size_t size_ = 0;
+    };
+
+    // Views the arrays of an ArrayWriter in place, so the bytes must be
+    // 8-byte aligned and outlive the arrays.
+    class ArrayReader {
+    public:
+        ArrayReader(const char* data, size_t size) : data_(data), size_(size) {}
+
+        template <typename T>
+        FlatArray<T> Read() {
+            static_assert(std::is_trivially_copyable_v<T> && alignof(T) <= sizeof(uint64_t));
+            const uint64_t count = View<uint64_t>(1)[0];
+            FlatArray<T> values = View<T>(count);
+            View<char>((sizeof(uint64_t) - position_ % sizeof(uint64_t)) % sizeof(uint64_t));
+            return values;
+        }
+
+        bool AtEnd() const {
+            return position_ == size_;
+        }
+
+    private:
+        template <typename T>
+        FlatArray<T> View(uint64_t count) {
+            if (count > (size_ - position_) / sizeof(T)) {
+                throw std::runtime_error("unexpected end of snapshot");
+            }
+            FlatArray<T> values(reinterpret_cast<const T*>(data_ + position_), count);
+            position_ += count * sizeof(T);
+            return values;
+        }
+
+        const char* data_;
+        size_t size_;
+        size_t position_ = 0;
+    };
+
+    // Lets the stream helpers above read from a piece of a Buffer.
+    class MemoryStreamBuf : public std::streambuf {
+    public:
+        MemoryStreamBuf(const char* data, size_t size) {
+            char* begin = const_cast<char*>(data);
+            setg(begin, begin, begin + size);
+        }
+    };
+
+}
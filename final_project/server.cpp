@@ -0,0 +1,340 @@
+#include "server.h"
+#include "request.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+
+    // Stream buffer over a connected socket. Reading and writing use separate
+    // buffers, so one thread may read requests while others write responses.
+    class SocketStreamBuf : public streambuf {
+    public:
+        explicit SocketStreamBuf(int fd) : fd_(fd) {
+            setg(input_, input_, input_);
+            setp(output_, output_ + sizeof(output_));
+        }
+
+    protected:
+        int_type underflow() override {
+            ssize_t size;
+            do {
+                size = read(fd_, input_, sizeof(input_));
+            } while (size < 0 && errno == EINTR);
+            if (size <= 0) {
+                return traits_type::eof();
+            }
+            setg(input_, input_, input_ + size);
+            return traits_type::to_int_type(input_[0]);
+        }
+
+        int_type overflow(int_type ch) override {
+            if (sync() != 0) {
+                return traits_type::eof();
+            }
+            if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+                *pptr() = traits_type::to_char_type(ch);
+                pbump(1);
+            }
+            return traits_type::not_eof(ch);
+        }
+
+        int sync() override {
+            const char* data = pbase();
+            size_t size = pptr() - pbase();
+            while (size > 0) {
+                const ssize_t written = send(fd_, data, size, MSG_NOSIGNAL);
+                if (written < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    return -1;
+                }
+                data += written;
+                size -= written;
+            }
+            setp(output_, output_ + sizeof(output_));
+            return 0;
+        }
+
+    private:
+        int fd_;
+        char input_[4096];
+        char output_[4096];
+    };
+
+    // Responses of one stream. Workers write whole lines under the mutex, the
+    // reader waits for the pending ones before the stream goes away.
+    struct ResponseSink {
+        explicit ResponseSink(ostream& output) : output(output) {}
+
+        ostream& output;
+        mutex output_mutex;
+        condition_variable answered_cv;
+        size_t pending = 0;
+    };
+
+    struct Connection {
+        int fd;
+        thread reader;
+        shared_ptr<atomic<bool>> is_done;
+    };
+
+    optional<double> ReadRequestId(const Json::Node& request_json) {
+        if (const auto* fields = get_if<map<string, Json::Node>>(&request_json)) {
+            if (auto it = fields->find("id"); it != fields->end() && holds_alternative<double>(it->second)) {
+                return it->second.AsDouble();
+            }
+        }
+        return nullopt;
+    }
+
+    Json::Node MakeErrorResponse(optional<double> request_id) {
+        map<string, Json::Node> error;
+        if (request_id) {
+            error["request_id"] = Json::Node(*request_id);
+        }
+        error["error_message"] = Json::Node(string("invalid request"));
+        return Json::Node(move(error));
+    }
+
+}
+
+RequestServer::RequestServer(TransportSystemVersions& versions, size_t thread_count)
+    : versions_(versions)
+{
+    for (size_t i = 0; i < max<size_t>(thread_count, 1); ++i) {
+        workers_.emplace_back([this] {
+            WorkerLoop();
+        });
+    }
+}
+
+RequestServer::~RequestServer() {
+    {
+        lock_guard<mutex> guard(tasks_mutex_);
+        is_finished_ = true;
+    }
+    tasks_cv_.notify_all();
+    for (auto& worker : workers_) {
+        worker.join();
+    }
+}
+
+void RequestServer::WorkerLoop() {
+    while (true) {
+        function<void()> task;
+        {
+            unique_lock<mutex> lock(tasks_mutex_);
+            tasks_cv_.wait(lock, [this] {
+                return is_finished_ || !tasks_.empty();
+            });
+            if (tasks_.empty()) {
+                return;
+            }
+            task = move(tasks_.front());
+            tasks_.pop_front();
+        }
+        task();
+    }
+}
+
+void RequestServer::Submit(function<void()> task) {
+    {
+        lock_guard<mutex> guard(tasks_mutex_);
+        tasks_.push_back(move(task));
+    }
+    tasks_cv_.notify_one();
+}
+
+string RequestServer::Answer(const string& request_line, const TransportSystem& ts) const {
+    Json::Node response;
+    // Kept for the error response if the rest of the request is invalid.
+    optional<double> request_id;
+    try {
+        istringstream input(request_line);
+        const Json::Document document = Json::Load(input);
+        request_id = ReadRequestId(document.GetRoot());
+        const auto request = ParseReadRequest(document.GetRoot());
+        if (!request) {
+            throw invalid_argument("unknown request type");
+        }
+        response = static_cast<const ReadRequest<Json::Node>&>(*request).Process(ts);
+    } catch (const exception&) {
+        response = MakeErrorResponse(request_id);
+    }
+    ostringstream output;
+    Json::PrintCompact(output, response);
+    return output.str();
+}
+
+optional<string> RequestServer::ApplyUpdate(const string& request_line) {
+    // Most lines are stat requests, they are not parsed here.
+    if (request_line.find("\"base_requests\"") == string::npos) {
+        return nullopt;
+    }
+    Json::Node response;
+    optional<double> request_id;
+    try {
+        istringstream input(request_line);
+        const Json::Document document = Json::Load(input);
+        const auto* root = get_if<map<string, Json::Node>>(&document.GetRoot());
+        if (!root || !root->count("base_requests")) {
+            return nullopt;
+        }
+        request_id = ReadRequestId(document.GetRoot());
+        const auto write_requests = ReadWriteRequests(document);
+        for (const auto& request : write_requests) {
+            if (!request) {
+                throw invalid_argument("unknown request type");
+            }
+        }
+        // A failed update leaves the current version as it was.
+        versions_.Update([&write_requests](TransportSystem& ts) {
+            ProcessWriteRequests(write_requests, ts);
+        });
+        map<string, Json::Node> fields;
+        if (request_id) {
+            fields["request_id"] = Json::Node(*request_id);
+        }
+        response = Json::Node(move(fields));
+    } catch (const exception&) {
+        response = MakeErrorResponse(request_id);
+    }
+    ostringstream output;
+    Json::PrintCompact(output, response);
+    return output.str();
+}
+
+void RequestServer::Serve(istream& input, ostream& output) {
+    ResponseSink sink{output};
+    using Clock = chrono::steady_clock;
+    const auto respond = [this, &sink](const string& response, Clock::time_point start) {
+        lock_guard<mutex> guard(sink.output_mutex);
+        sink.output << response << '\n';
+        sink.output.flush();
+        RecordLatency(chrono::duration_cast<chrono::nanoseconds>(Clock::now() - start).count());
+        --sink.pending;
+        sink.answered_cv.notify_all();
+    };
+    for (string line; getline(input, line); ) {
+        if (line.find_first_not_of(" \t\r") == string::npos) {
+            continue;
+        }
+        const auto start = Clock::now();
+        {
+            lock_guard<mutex> guard(sink.output_mutex);
+            ++sink.pending;
+        }
+        // Updates are published before the next line is read, and every
+        // request is answered from the version current when it was read.
+        if (const auto response = ApplyUpdate(line)) {
+            respond(*response, start);
+            continue;
+        }
+        Submit([this, &respond, version = versions_.Pin(), line = move(line), start] {
+            respond(Answer(line, *version), start);
+        });
+    }
+    unique_lock<mutex> lock(sink.output_mutex);
+    sink.answered_cv.wait(lock, [&sink] {
+        return sink.pending == 0;
+    });
+}
+
+void RequestServer::ServeUnixSocket(const string& path) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        throw invalid_argument("socket path is too long: " + path);
+    }
+    copy(path.begin(), path.end(), address.sun_path);
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        throw runtime_error("cannot create a socket");
+    }
+    unlink(path.c_str());
+    if (bind(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0
+            || listen(fd, SOMAXCONN) != 0) {
+        close(fd);
+        throw runtime_error("cannot listen on " + path);
+    }
+    listen_fd_ = fd;
+    if (is_stopped_) {
+        shutdown(fd, SHUT_RDWR);
+    }
+
+    vector<Connection> connections;
+    while (!is_stopped_) {
+        const int client_fd = accept(fd, nullptr, nullptr);
+        if (client_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+
+        // Finished connections are joined as new ones come in. Only this
+        // thread closes client sockets, after joining their readers, so a
+        // descriptor is never shut down after it was closed and reused.
+        connections.erase(remove_if(connections.begin(), connections.end(), [](Connection& connection) {
+            if (!*connection.is_done) {
+                return false;
+            }
+            connection.reader.join();
+            close(connection.fd);
+            return true;
+        }), connections.end());
+
+        auto is_done = make_shared<atomic<bool>>(false);
+        connections.push_back({client_fd, thread([this, client_fd, is_done] {
+            SocketStreamBuf buffer(client_fd);
+            istream input(&buffer);
+            ostream output(&buffer);
+            Serve(input, output);
+            output.flush();
+            // The client sees the end of the answers now, the socket is
+            // closed later.
+            shutdown(client_fd, SHUT_RDWR);
+            *is_done = true;
+        }), is_done});
+    }
+    listen_fd_ = -1;
+
+    // Clients still connected get answers to what they have sent so far.
+    for (auto& connection : connections) {
+        shutdown(connection.fd, SHUT_RD);
+        connection.reader.join();
+        close(connection.fd);
+    }
+    close(fd);
+    unlink(path.c_str());
+}
+
+void RequestServer::Stop() {
+    is_stopped_ = true;
+    if (const int fd = listen_fd_; fd >= 0) {
+        shutdown(fd, SHUT_RDWR);
+    }
+}
+
+void RequestServer::RecordLatency(uint64_t latency_ns) {
+    latencies_.Record(latency_ns);
+}
+
+RequestServer::LatencyStats RequestServer::GetLatencyStats() const {
+    return {latencies_.GetCount(), latencies_.GetQuantile(0.5) / 1000.0, latencies_.GetQuantile(0.99) / 1000.0};
+}
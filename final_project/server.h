@@ -0,0 +1,76 @@
+#pragma once
+#include "transport_system.h"
+#include "transport_system_versions.h"
+#include "metrics.h"
+#include "parallel.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Answers stat requests given as newline-delimited JSON: every input line is
+// one request object, the same as an item of "stat_requests", and every
+// output line is its response. Requests are answered concurrently by a pool
+// of workers, so responses may come in a different order than requests and
+// are matched to them by request_id.
+//
+// A line with "base_requests", in the form of the input document, is an
+// update. Its requests are applied to a new version of the system, which is
+// published before the next line is read. The update is answered with its
+// id. Every request is answered from the version that was current when it
+// was read.
+class RequestServer {
+public:
+    struct LatencyStats {
+        size_t request_count;
+        double p50_us;
+        double p99_us;
+    };
+
+    explicit RequestServer(TransportSystemVersions& versions, size_t thread_count = DefaultThreadCount());
+    RequestServer(const RequestServer&) = delete;
+    RequestServer& operator = (const RequestServer&) = delete;
+    ~RequestServer();
+
+    // Serves one stream of requests until its end.
+    void Serve(std::istream& input, std::ostream& output);
+    // Serves every client that connects to a Unix socket at path, each
+    // connection being one stream, until Stop() is called. Stop() may be
+    // called from a signal handler.
+    void ServeUnixSocket(const std::string& path);
+    void Stop();
+
+    // Time from reading a request to writing its response. Kept in a fixed-size
+    // histogram however long the server runs, so quantiles are within 1/16.
+    LatencyStats GetLatencyStats() const;
+
+    std::string Answer(const std::string& request_line, const TransportSystem& ts) const;
+
+private:
+    // Response to an update line, nullopt if the line is no update.
+    std::optional<std::string> ApplyUpdate(const std::string& request_line);
+    void WorkerLoop();
+    void Submit(std::function<void()> task);
+    void RecordLatency(uint64_t latency_ns);
+
+    TransportSystemVersions& versions_;
+
+    std::mutex tasks_mutex_;
+    std::condition_variable tasks_cv_;
+    std::deque<std::function<void()>> tasks_;
+    bool is_finished_ = false;
+    std::vector<std::thread> workers_;
+
+    std::atomic<int> listen_fd_ = -1;
+    std::atomic<bool> is_stopped_ = false;
+
+    Metrics::LatencyHistogram latencies_;
+};
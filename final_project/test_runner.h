@@ -3,6 +3,9 @@
 #include <sstream>
 #include <stdexcept>
 #include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <map>
 #include <unordered_map>
 #include <set>
@@ -127,4 +130,106 @@ class TestRunner {
 #define RUN_TEST(tr, func) \
     tr.RunTest(func, #func)
 
+// Keeps the compiler from dropping a computation whose result is unused:
+// the value is assumed to be read by code it cannot see.
+template <class T>
+inline void DoNotOptimize(const T& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+// Makes the compiler assume all memory is read and written here, so stores
+// before it are done.
+inline void ClobberMemory() {
+    asm volatile("" : : : "memory");
+}
+
+struct BenchResult {
+    double min_ns = 0;
+    double median_ns = 0;
+    double stddev_ns = 0;
+    size_t iterations = 0;  // per sample
+};
+
+// Runs a function over and over and reports the time of one call. After a
+// warm-up the iteration count grows until a sample takes sample_time, then
+// sample_count samples are taken. Only benchmarks whose name contains the
+// filter run.
+class BenchRunner {
+    public:
+        explicit BenchRunner(const string& filter = {},
+                             chrono::nanoseconds sample_time = chrono::milliseconds(20),
+                             size_t sample_count = 15)
+            : filter(filter)
+            , sample_time(sample_time)
+            , sample_count(max<size_t>(1, sample_count))
+            {}
+
+        template <class BenchFunc>
+            BenchResult RunBench(BenchFunc func, const string& bench_name) {
+                if (bench_name.find(filter) == string::npos) {
+                    return {};
+                }
+                const auto run = [&func](size_t iterations) {
+                    const auto start = chrono::steady_clock::now();
+                    for (size_t i = 0; i < iterations; ++i) {
+                        func();
+                    }
+                    return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+                };
+
+                BenchResult result;
+                result.iterations = 1;
+                const double target_ns = chrono::duration<double, nano>(sample_time).count();
+                double elapsed_ns = run(result.iterations);  // warm-up
+                while ((elapsed_ns = run(result.iterations)) < target_ns) {
+                    const double scale = elapsed_ns > 0 ? target_ns / elapsed_ns : 10;
+                    result.iterations = max(result.iterations + 1, size_t(result.iterations * min(scale * 1.2, 10.0)));
+                }
+
+                vector<double> samples(sample_count);
+                for (auto& sample : samples) {
+                    sample = run(result.iterations) / result.iterations;
+                }
+                sort(samples.begin(), samples.end());
+                double mean = 0;
+                for (double sample : samples) {
+                    mean += sample / samples.size();
+                }
+                double variance = 0;
+                for (double sample : samples) {
+                    variance += (sample - mean) * (sample - mean) / samples.size();
+                }
+                result.min_ns = samples.front();
+                result.median_ns = samples[samples.size() / 2];
+                result.stddev_ns = sqrt(variance);
+
+                cerr << bench_name << ": min " << FormatTime(result.min_ns)
+                     << ", median " << FormatTime(result.median_ns)
+                     << ", stddev " << FormatTime(result.stddev_ns)
+                     << " (" << sample_count << " x " << result.iterations << " iterations)" << endl;
+                return result;
+            }
+
+    private:
+        static string FormatTime(double ns) {
+            ostringstream os;
+            os.precision(3);
+            if (ns < 1e3) {
+                os << ns << " ns";
+            } else if (ns < 1e6) {
+                os << ns / 1e3 << " us";
+            } else {
+                os << ns / 1e6 << " ms";
+            }
+            return os.str();
+        }
+
+        string filter;
+        chrono::nanoseconds sample_time;
+        size_t sample_count;
+};
+
+#define RUN_BENCH(br, func) \
+    br.RunBench(func, #func)
+
 
@@ -0,0 +1,104 @@
+#include "trace.h"
+
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+namespace Trace {
+
+    atomic<bool> is_enabled = false;
+
+    namespace {
+
+        struct Event {
+            const char* name;
+            uint64_t start_ns;
+            uint64_t end_ns;
+        };
+
+        // Written only by its own thread. The registry keeps it alive after
+        // the thread exits, so spans of finished workers are not lost.
+        struct ThreadBuffer {
+            static const size_t CAPACITY = 1 << 14;
+
+            uint32_t thread_id;
+            array<Event, CAPACITY> events;
+            atomic<uint64_t> recorded = 0;
+        };
+
+        struct Registry {
+            mutex buffers_mutex;
+            vector<shared_ptr<ThreadBuffer>> buffers;
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        };
+
+        Registry& GetRegistry() {
+            static Registry registry;
+            return registry;
+        }
+
+        ThreadBuffer& GetThreadBuffer() {
+            thread_local const shared_ptr<ThreadBuffer> buffer = [] {
+                auto buffer = make_shared<ThreadBuffer>();
+                auto& registry = GetRegistry();
+                lock_guard<mutex> guard(registry.buffers_mutex);
+                buffer->thread_id = registry.buffers.size() + 1;
+                registry.buffers.push_back(buffer);
+                return buffer;
+            }();
+            return *buffer;
+        }
+
+    }
+
+    void Enable() {
+        GetRegistry();
+        is_enabled = true;
+    }
+
+    uint64_t NowNs() {
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - GetRegistry().start).count();
+    }
+
+    void Record(const char* name, uint64_t start_ns, uint64_t end_ns) {
+        auto& buffer = GetThreadBuffer();
+        const uint64_t position = buffer.recorded.load(memory_order_relaxed);
+        buffer.events[position % ThreadBuffer::CAPACITY] = {name, start_ns, end_ns};
+        buffer.recorded.store(position + 1, memory_order_release);
+    }
+
+    void WriteJson(ostream& output) {
+        auto& registry = GetRegistry();
+        vector<shared_ptr<ThreadBuffer>> buffers;
+        {
+            lock_guard<mutex> guard(registry.buffers_mutex);
+            buffers = registry.buffers;
+        }
+
+        const auto precision = output.precision(3);
+        const auto flags = output.setf(ios::fixed, ios::floatfield);
+        output << "{\"traceEvents\": [";
+        bool is_first = true;
+        for (const auto& buffer : buffers) {
+            const uint64_t recorded = buffer->recorded.load(memory_order_acquire);
+            const uint64_t first = recorded - min<uint64_t>(recorded, ThreadBuffer::CAPACITY);
+            for (uint64_t position = first; position < recorded; ++position) {
+                const Event& event = buffer->events[position % ThreadBuffer::CAPACITY];
+                output << (is_first ? "\n" : ",\n")
+                       << "{\"name\": \"" << event.name << "\", \"ph\": \"X\", \"pid\": 1"
+                       << ", \"tid\": " << buffer->thread_id
+                       << ", \"ts\": " << event.start_ns / 1e3
+                       << ", \"dur\": " << (event.end_ns - event.start_ns) / 1e3 << "}";
+                is_first = false;
+            }
+        }
+        output << "\n], \"displayTimeUnit\": \"ms\"}\n";
+        output.precision(precision);
+        output.flags(flags);
+    }
+
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+
+// Timeline of scoped spans in the Chrome trace event format, viewable in
+// Perfetto or about:tracing. Tracing is off until Enable() is called; a
+// disabled scope costs one relaxed atomic load. Every thread records into
+// its own ring buffer, which keeps the latest spans once it is full.
+namespace Trace {
+
+    extern std::atomic<bool> is_enabled;
+
+    inline bool IsEnabled() {
+        return is_enabled.load(std::memory_order_relaxed);
+    }
+    void Enable();
+
+    // Meant to be called once the traced work is done: spans that are being
+    // recorded while writing may come out torn.
+    void WriteJson(std::ostream& output);
+
+    uint64_t NowNs();
+    // name must be a string literal or otherwise outlive the trace.
+    void Record(const char* name, uint64_t start_ns, uint64_t end_ns);
+
+    class Scope {
+    public:
+        explicit Scope(const char* name)
+            : name_(IsEnabled() ? name : nullptr)
+            , start_ns_(name_ ? NowNs() : 0)
+            {}
+        ~Scope() {
+            if (name_) {
+                Record(name_, start_ns_, NowNs());
+            }
+        }
+
+        Scope(const Scope&) = delete;
+        Scope& operator = (const Scope&) = delete;
+
+    private:
+        const char* name_;
+        uint64_t start_ns_;
+    };
+
+}
+
+#define TRACE_CONCAT_IMPL(left, right) left ## right
+#define TRACE_CONCAT(left, right) TRACE_CONCAT_IMPL(left, right)
+#define TRACE_SCOPE(name) Trace::Scope TRACE_CONCAT(trace_scope_, __LINE__)(name)
@@ -1,91 +1,152 @@
 #include "transport_system.h"
 #include "geo.h"
+#include "memory_accounting.h"
+#include "metrics.h"
+#include "perf_counters.h"
+#include "trace.h"
+#include "serialization.h"
+
+#include <algorithm>
+#include <deque>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
 
 using namespace std;
 
-double CalculateGeoDistance(shared_ptr<Stop> left, shared_ptr<Stop> right) {
+double CalculateGeoDistance(const shared_ptr<Stop>& left, const shared_ptr<Stop>& right) {
     return CalculateGeoDistance(left->lat, left->lon, right->lat, right->lon);
 }
 
-double CalculateStopsDistance(shared_ptr<Stop> left, shared_ptr<Stop> right) {
-    double distance = CalculateGeoDistance(left, right);
-    if (right->distances.count(left->name)) {
-        distance = right->distances[left->name];
+double CalculateStopsDistance(const shared_ptr<Stop>& left, const shared_ptr<Stop>& right) {
+    if (auto it = left->distances.find(right->name); it != left->distances.end()) {
+        return it->second;
     }
-    if (left->distances.count(right->name)) {
-        distance = left->distances[right->name];
+    if (auto it = right->distances.find(left->name); it != right->distances.end()) {
+        return it->second;
     }
-    return distance;
+    return CalculateGeoDistance(left, right);
 }
 
-void RoundBus::AddRouteToGraph(unique_ptr<Graph::DirectedWeightedGraph<double>>& graph, double velocity, unordered_map<size_t, Json::Node>& edges_description) const {
+// The wait before boarding is part of the edge, so a stop is a single vertex
+// and every transfer pays the wait on the edge it boards.
+static RouteEdge MakeBusEdge(Bus::ID bus_id, const shared_ptr<Stop>& from, const shared_ptr<Stop>& to,
+                             double distance, int span_count, double wait_time, double velocity) {
+    const double time = distance / velocity;
+    return {
+        {from->id, to->id, wait_time + time},
+        {bus_id, uint64_t(span_count), time}
+    };
+}
+
+void RoundBus::CollectRouteEdges(double wait_time, double velocity, vector<RouteEdge>& edges) const {
     for (int i = 0; i < stops.size(); ++i) {
         double distance = 0.0;
         for (int j = i + 1; j < stops.size(); ++j) {
             distance += CalculateStopsDistance(stops[j - 1], stops[j]);
-            map<string, Json::Node> edge_description;
-            edge_description["type"] = Json::Node(string("Bus"));
-            edge_description["bus"] = Json::Node(name);
-            edge_description["span_count"] = Json::Node(double(j - i));
-            edge_description["time"] = distance / velocity;
-            edges_description[graph->AddEdge({stops[i]->id * 2 + 1, stops[j]->id * 2, distance / velocity})]
-                = edge_description;
+            edges.push_back(MakeBusEdge(id, stops[i], stops[j], distance, j - i, wait_time, velocity));
         }
     }
 }
 
-void StraightBus::AddRouteToGraph(unique_ptr<Graph::DirectedWeightedGraph<double>>& graph, double velocity, unordered_map<size_t, Json::Node>& edges_description) const {
+void StraightBus::CollectRouteEdges(double wait_time, double velocity, vector<RouteEdge>& edges) const {
     for (int i = 0; i < stops.size(); ++i) {
         {
             double distance = 0.0;
             for (int j = i + 1; j < stops.size(); ++j) {
                 distance += CalculateStopsDistance(stops[j - 1], stops[j]);
-                map<string, Json::Node> edge_description;
-                edge_description["type"] = Json::Node(string("Bus"));
-                edge_description["bus"] = Json::Node(name);
-                edge_description["span_count"] = Json::Node(double(j - i));
-                edge_description["time"] = distance / velocity;
-                edges_description[graph->AddEdge({stops[i]->id * 2 + 1, stops[j]->id * 2, distance / velocity})]
-                    = edge_description;
+                edges.push_back(MakeBusEdge(id, stops[i], stops[j], distance, j - i, wait_time, velocity));
             }
         }
         {
             double distance = 0.0;
             for (int j = i - 1; j >= 0; --j) {
                 distance += CalculateStopsDistance(stops[j + 1], stops[j]);
-                map<string, Json::Node> edge_description;
-                edge_description["type"] = Json::Node(string("Bus"));
-                edge_description["bus"] = Json::Node(name);
-                edge_description["span_count"] = Json::Node(double(i - j));
-                edge_description["time"] = distance / velocity;
-                edges_description[graph->AddEdge({stops[i]->id * 2 + 1, stops[j]->id * 2, distance / velocity})]
-                    = edge_description;
+                edges.push_back(MakeBusEdge(id, stops[i], stops[j], distance, i - j, wait_time, velocity));
             }
         }
     }
 }
 
-shared_ptr<Stop> TransportSystem::AddDummyStop(const string& stop_name) {
+shared_ptr<Stop> TransportSystem::InsertDummyStop(const string& stop_name) {
     if (auto it = name_to_stop_.find(stop_name); it != name_to_stop_.end()) {
         return it->second;
     }
+    route_cache_.Clear();
     stops_.push_back(make_shared<Stop>(stop_name, 0, 0, stops_.size(), unordered_map<string, double>()));
     name_to_stop_[stops_.back()->name] = stops_.back();
+    if (graph_) {
+        AddStopToGraph();
+    }
     return stops_.back();
 }
 
+shared_ptr<Stop> TransportSystem::AddDummyStop(const string& stop_name) {
+    auto stop = InsertDummyStop(stop_name);
+    CommitGraphChanges();
+    return stop;
+}
+
 shared_ptr<Stop> TransportSystem::AddStop(const string& stop_name, double lat, double lon, unordered_map<string, double> distances) {
+    MEMORY_SCOPE(STOPS);
+    route_cache_.Clear();
     if (auto it = name_to_stop_.find(stop_name); it != name_to_stop_.end()) {
-        it->second->lat = lat;
-        it->second->lon = lon;
-        it->second->distances = distances;
+        if (shares_network_) {
+            ReplaceStop(make_shared<Stop>(stop_name, lat, lon, it->second->id, distances));
+        } else {
+            it->second->lat = lat;
+            it->second->lon = lon;
+            it->second->distances = distances;
+        }
+        if (graph_ && stop_to_buses_.count(stop_name)) {
+            // A bus may pass the stop several times, its edges are updated once.
+            set<Bus::ID> updated_buses;
+            for (const auto& bus : stop_to_buses_.at(stop_name)) {
+                if (updated_buses.insert(bus->id).second) {
+                    UpdateBusEdges(*bus);
+                }
+            }
+            CommitGraphChanges();
+        }
         return it->second;
     }
     stops_.push_back(make_shared<Stop>(stop_name, lat, lon, stops_.size(), distances));
     name_to_stop_[stops_.back()->name] = stops_.back();
+    if (graph_) {
+        AddStopToGraph();
+        CommitGraphChanges();
+    }
     return stops_.back();
 }
 
+void TransportSystem::ReplaceStop(shared_ptr<Stop> stop) {
+    // Stops and buses are shared with other copies of the system, so a
+    // changed stop is a new object, and so is every bus passing it.
+    const auto old_stop = stops_[stop->id];
+    stops_[stop->id] = stop;
+    name_to_stop_[stop->name] = stop;
+    if (!stop_to_buses_.count(stop->name)) {
+        return;
+    }
+    const auto old_buses = stop_to_buses_.at(stop->name);
+    set<Bus::ID> replaced_buses;
+    for (const auto& bus : old_buses) {
+        if (!replaced_buses.insert(bus->id).second) {
+            continue;
+        }
+        auto new_bus = bus->Clone();
+        replace(new_bus->stops.begin(), new_bus->stops.end(), old_stop, stop);
+        for (const auto& bus_stop : new_bus->stops) {
+            auto& stop_buses = stop_to_buses_.at(bus_stop->name);
+            replace(stop_buses.begin(), stop_buses.end(), bus, new_bus);
+        }
+        buses_[bus->id] = new_bus;
+        if (name_to_bus_[bus->name] == bus) {
+            name_to_bus_[bus->name] = new_bus;
+        }
+    }
+}
+
 shared_ptr<Stop> TransportSystem::GetStop(Stop::ID id) const {
     return stops_.at(id);
 }
@@ -101,7 +162,7 @@ vector<shared_ptr<Stop>> TransportSystem::AddDummyStops(const vector<string>& ro
     vector<shared_ptr<Stop>> stops;
 
     for (const auto& stop_name : route) {
-        stops.push_back(AddDummyStop(stop_name));
+        stops.push_back(InsertDummyStop(stop_name));
     }
 
     return stops;
@@ -114,22 +175,27 @@ optional<vector<shared_ptr<Bus>>> TransportSystem::GetBusesOnStop(const string&
     return stop_to_buses_.at(stop_name);
 }
 
-shared_ptr<Bus> TransportSystem::AddRoundBus(const std::string& bus_name, const vector<string>& route) {
-    buses_.push_back(make_shared<RoundBus>(AddDummyStops(route), bus_name, buses_.size()));
+shared_ptr<Bus> TransportSystem::InsertBus(shared_ptr<Bus> bus, const vector<string>& route) {
+    buses_.push_back(move(bus));
     name_to_bus_[buses_.back()->name] = buses_.back();
     for (const auto& stop : route) {
         stop_to_buses_[stop].push_back(buses_.back());
     }
+    if (graph_) {
+        AddBusToGraph(*buses_.back());
+        CommitGraphChanges();
+    }
     return buses_.back();
 }
 
+shared_ptr<Bus> TransportSystem::AddRoundBus(const std::string& bus_name, const vector<string>& route) {
+    route_cache_.Clear();
+    return InsertBus(make_shared<RoundBus>(AddDummyStops(route), bus_name, buses_.size()), route);
+}
+
 shared_ptr<Bus> TransportSystem::AddStraightBus(const std::string& bus_name, const vector<string>& route) {
-    buses_.push_back(make_shared<StraightBus>(AddDummyStops(route), bus_name, buses_.size()));
-    name_to_bus_[buses_.back()->name] = buses_.back();
-    for (const auto& stop : route) {
-        stop_to_buses_[stop].push_back(buses_.back());
-    }
-    return buses_.back();
+    route_cache_.Clear();
+    return InsertBus(make_shared<StraightBus>(AddDummyStops(route), bus_name, buses_.size()), route);
 }
 
 shared_ptr<Bus> TransportSystem::GetBus(Bus::ID id) const {
@@ -143,18 +209,767 @@ shared_ptr<Bus> TransportSystem::GetBus(const string& bus_name) const {
     return name_to_bus_.at(bus_name);
 }
 
-void TransportSystem::BuildGraph() {
-    graph_ = make_unique<Graph::DirectedWeightedGraph<double>>(2 * stops_.size());
-    edges_description.clear();
-    for (size_t v = 0; v < stops_.size(); ++v) {
-        map<string, Json::Node> edge_description;
-        edge_description["type"] = Json::Node(string("Wait"));
-        edge_description["stop_name"] = Json::Node(stops_[v]->name);
-        edge_description["time"] = Json::Node(WaitTime);
-        edges_description[graph_->AddEdge({v * 2 , v * 2 + 1, WaitTime})] = Json::Node(edge_description);
+void TransportSystem::BuildGraph(size_t thread_count) {
+    TRACE_SCOPE("BuildGraph");
+    MEMORY_SCOPE(GRAPH);
+    PERF_SCOPE("build_graph");
+    route_cache_.Clear();
+
+    // Every bus produces its edges independently into its own buffer.
+    vector<vector<RouteEdge>> bus_edges(buses_.size());
+    ParallelFor(buses_.size(), thread_count, [&](size_t bus_idx) {
+        TRACE_SCOPE("CollectRouteEdges");
+        buses_[bus_idx]->CollectRouteEdges(WaitTime, Velocity, bus_edges[bus_idx]);
+    });
+
+    // Edges go in bus order, so edge ids do not depend on the number of
+    // threads.
+    vector<size_t> offsets(buses_.size() + 1);
+    for (size_t bus_idx = 0; bus_idx < buses_.size(); ++bus_idx) {
+        offsets[bus_idx + 1] = offsets[bus_idx] + bus_edges[bus_idx].size();
+    }
+
+    vector<Graph::Edge<double>> edges(offsets.back());
+    vector<EdgeDescription> descriptions;
+    {
+        MEMORY_SCOPE(EDGE_DESCRIPTIONS);
+        descriptions.resize(offsets.back());
+    }
+    ParallelFor(buses_.size(), thread_count, [&](size_t bus_idx) {
+        size_t edge_id = offsets[bus_idx];
+        for (const auto& route_edge : bus_edges[bus_idx]) {
+            edges[edge_id] = route_edge.edge;
+            descriptions[edge_id] = route_edge.description;
+            ++edge_id;
+        }
+    });
+
+    edges_description = move(descriptions);
+    bus_edge_ranges_.resize(buses_.size());
+    for (size_t bus_idx = 0; bus_idx < buses_.size(); ++bus_idx) {
+        bus_edge_ranges_[bus_idx] = {offsets[bus_idx], bus_edges[bus_idx].size()};
+    }
+    {
+        TRACE_SCOPE("Graph construction");
+        graph_ = make_unique<Graph::DirectedWeightedGraph<double>>(stops_.size(), move(edges));
+    }
+    PERF_ELEMENTS(graph_->GetEdgeCount());
+    graph_changes_.Reset(graph_->GetVertexCount());
+    MakeRouter();
+    snapshot_.reset();
+}
+
+unique_ptr<TransportSystem> TransportSystem::Clone() const {
+    auto clone = make_unique<TransportSystem>();
+    clone->WaitTime = WaitTime;
+    clone->Velocity = Velocity;
+    clone->router_type_ = router_type_;
+    clone->vertex_order_ = vertex_order_;
+    clone->stops_ = stops_;
+    clone->name_to_stop_ = name_to_stop_;
+    clone->buses_ = buses_;
+    clone->name_to_bus_ = name_to_bus_;
+    clone->stop_to_buses_ = stop_to_buses_;
+    if (graph_) {
+        clone->graph_ = make_unique<Graph::DirectedWeightedGraph<double>>(*graph_);
+        clone->router = router->Clone(*clone->graph_);
+        static_cast<Graph::ComponentRouter<double>&>(*clone->router).SetEdgeOrder(clone->GetEdgeOrder());
+    }
+    clone->edges_description = edges_description;
+    clone->bus_edge_ranges_ = bus_edge_ranges_;
+    clone->graph_changes_ = graph_changes_;
+    clone->snapshot_ = snapshot_;
+    clone->route_cache_.SetCapacity(route_cache_.GetCapacity());
+    shares_network_ = clone->shares_network_ = true;
+    return clone;
+}
+
+static Graph::ComponentRouter<double>::RouterFactory GetRouterFactory(TransportSystem::RouterType router_type) {
+    using RouterType = TransportSystem::RouterType;
+    return [router_type](const Graph::DirectedWeightedGraph<double>& graph, size_t) -> unique_ptr<Graph::RouterBase<double>> {
+        switch (router_type) {
+            case RouterType::ALL_PAIRS:
+                return make_unique<Graph::Router<double>>(graph);
+            case RouterType::DIJKSTRA:
+                return make_unique<Graph::DijkstraRouter<double>>(graph);
+            case RouterType::HUB_LABELS:
+                return make_unique<Graph::HubLabelRouter<double>>(graph);
+            case RouterType::ALT:
+                return make_unique<Graph::AltRouter<double>>(graph);
+            case RouterType::BIDIRECTIONAL_DIJKSTRA:
+                return make_unique<Graph::BidirectionalDijkstraRouter<double>>(graph);
+        }
+        return nullptr;
+    };
+}
+
+// Index of a point of the 2^order x 2^order grid along the Hilbert curve.
+static uint64_t GetHilbertIndex(uint32_t x, uint32_t y, int order) {
+    uint64_t index = 0;
+    for (uint32_t side = 1u << (order - 1); side > 0; side /= 2) {
+        const uint32_t rx = (x & side) > 0;
+        const uint32_t ry = (y & side) > 0;
+        index += uint64_t(side) * side * ((3 * rx) ^ ry);
+        // Turn the quadrant so that the curve inside it starts and ends
+        // where the curve of the whole grid does.
+        if (ry == 0) {
+            if (rx == 1) {
+                x = side - 1 - (x & (side - 1));
+                y = side - 1 - (y & (side - 1));
+            }
+            swap(x, y);
+        }
+    }
+    return index;
+}
+
+vector<uint32_t> TransportSystem::ComputeVertexRanks() const {
+    switch (vertex_order_) {
+        case VertexOrder::INPUT:
+            return {};
+        case VertexOrder::BREADTH_FIRST:
+            return Graph::ComputeBreadthFirstRanks(*graph_);
+        case VertexOrder::CUTHILL_MCKEE:
+            return Graph::ComputeCuthillMcKeeRanks(*graph_);
+        case VertexOrder::HILBERT:
+            break;
+    }
+
+    double min_lat = numeric_limits<double>::max(), max_lat = numeric_limits<double>::lowest();
+    double min_lon = min_lat, max_lon = max_lat;
+    for (const auto& stop : stops_) {
+        min_lat = min(min_lat, stop->lat);
+        max_lat = max(max_lat, stop->lat);
+        min_lon = min(min_lon, stop->lon);
+        max_lon = max(max_lon, stop->lon);
+    }
+    const int order = 16;
+    const double cells = (1 << order) - 1;
+    const auto to_cell = [cells](double value, double min_value, double max_value) {
+        return max_value > min_value ? uint32_t((value - min_value) / (max_value - min_value) * cells) : 0;
+    };
+    vector<pair<uint64_t, uint32_t>> keys(stops_.size());
+    for (size_t stop_id = 0; stop_id < stops_.size(); ++stop_id) {
+        const auto& stop = *stops_[stop_id];
+        keys[stop_id] = {GetHilbertIndex(to_cell(stop.lon, min_lon, max_lon), to_cell(stop.lat, min_lat, max_lat), order),
+                         stop_id};
+    }
+    sort(keys.begin(), keys.end());
+    vector<uint32_t> ranks(stops_.size());
+    for (size_t rank = 0; rank < keys.size(); ++rank) {
+        ranks[keys[rank].second] = rank;
+    }
+    return ranks;
+}
+
+// Of buses equally fast between two stops, the one with fewer stops in
+// between is taken. Reads the descriptions of this system, so a clone sets
+// its own.
+Graph::ComponentRouter<double>::EdgeOrder TransportSystem::GetEdgeOrder() const {
+    return [this](Graph::EdgeId lhs, Graph::EdgeId rhs) {
+        return edges_description[lhs].span_count < edges_description[rhs].span_count;
+    };
+}
+
+void TransportSystem::MakeRouter() {
+    TRACE_SCOPE("Router construction");
+    MEMORY_SCOPE(ROUTER);
+    PERF_SCOPE("build_router");
+    PERF_ELEMENTS(graph_->GetVertexCount());
+    router = make_unique<Graph::ComponentRouter<double>>(*graph_, GetRouterFactory(router_type_), ComputeVertexRanks(),
+                                                         GetEdgeOrder());
+}
+
+size_t TransportSystem::GetPrunedEdgeCount() const {
+    if (!router) {
+        return 0;
+    }
+    return GetComponentRouter().GetPrunedEdgeCount();
+}
+
+const Graph::ComponentRouter<double>& TransportSystem::GetComponentRouter() const {
+    return static_cast<const Graph::ComponentRouter<double>&>(*router);
+}
+
+void TransportSystem::AddStopToGraph() {
+    // A new stop has no edges until a bus passes it.
+    graph_->AddVertex();
+}
+
+void TransportSystem::AddBusToGraph(const Bus& bus) {
+    vector<RouteEdge> route_edges;
+    bus.CollectRouteEdges(WaitTime, Velocity, route_edges);
+    bus_edge_ranges_.push_back({graph_->GetEdgeCount(), route_edges.size()});
+    for (const auto& route_edge : route_edges) {
+        graph_changes_.added_edges.push_back(graph_->AddEdge(route_edge.edge));
+    }
+    edges_description.Modify([&route_edges](auto& descriptions) {
+        for (const auto& route_edge : route_edges) {
+            descriptions.push_back(route_edge.description);
+        }
+    });
+}
+
+void TransportSystem::UpdateBusEdges(const Bus& bus) {
+    // Edges are collected in the same order every time, only their weights
+    // depend on the stops.
+    vector<RouteEdge> route_edges;
+    bus.CollectRouteEdges(WaitTime, Velocity, route_edges);
+    const size_t first_edge = bus_edge_ranges_[bus.id].first;
+    for (size_t idx = 0; idx < route_edges.size(); ++idx) {
+        const Graph::EdgeId edge_id = first_edge + idx;
+        const double old_weight = graph_->GetEdge(edge_id).weight;
+        const double weight = route_edges[idx].edge.weight;
+        if (weight == old_weight) {
+            continue;
+        }
+        graph_->SetEdgeWeight(edge_id, weight);
+        graph_changes_.reweighted_edges.push_back({edge_id, old_weight});
+        edges_description.Modify([edge_id, time = route_edges[idx].description.time](auto& descriptions) {
+            descriptions[edge_id].time = time;
+        });
+    }
+}
+
+void TransportSystem::IndexBusEdges() {
+    bus_edge_ranges_.assign(buses_.size(), {0, 0});
+    for (size_t edge_id = 0; edge_id < edges_description.size(); ++edge_id) {
+        auto& [first_edge, edge_count] = bus_edge_ranges_[edges_description[edge_id].bus_id];
+        if (edge_count == 0) {
+            first_edge = edge_id;
+        }
+        ++edge_count;
+    }
+}
+
+void TransportSystem::CommitGraphChanges() {
+    if (!graph_ || graph_changes_.Empty(graph_->GetVertexCount())) {
+        return;
+    }
+    if (!router->Update(graph_changes_)) {
+        MakeRouter();
+    }
+    graph_changes_.Reset(graph_->GetVertexCount());
+}
+
+void TransportSystem::RenderEdge(Graph::EdgeId id, vector<Json::Node>& items) const {
+    const auto& description = edges_description[id];
+    map<string, Json::Node> wait;
+    wait["type"] = Json::Node(string("Wait"));
+    wait["stop_name"] = Json::Node(stops_[graph_->GetEdge(id).from]->name);
+    wait["time"] = Json::Node(WaitTime);
+    items.push_back(Json::Node(move(wait)));
+
+    map<string, Json::Node> bus;
+    bus["type"] = Json::Node(string("Bus"));
+    bus["bus"] = Json::Node(buses_[description.bus_id]->name);
+    bus["span_count"] = Json::Node(double(description.span_count));
+    bus["time"] = Json::Node(description.time);
+    items.push_back(Json::Node(move(bus)));
+}
+
+RouteAnswerHolder TransportSystem::MakeRouteAnswer(double total_time, const vector<Graph::EdgeId>& edges) const {
+    METRICS_TIMER(RENDER_ROUTE);
+    vector<Json::Node> items;
+    items.reserve(2 * edges.size());
+    for (const auto edge_id : edges) {
+        RenderEdge(edge_id, items);
+    }
+    return make_shared<const RouteAnswer>(RouteAnswer{total_time, Json::Node(move(items))});
+}
+
+RouteAnswerHolder TransportSystem::ComputeRoute(Stop::ID from, Stop::ID to) const {
+    double weight;
+    vector<Graph::EdgeId> edges;
+    {
+        METRICS_TIMER(BUILD_ROUTE);
+        MEMORY_SCOPE(ROUTER);
+        auto route = router->BuildRoute(from, to);
+        if (!route) {
+            return nullptr;
+        }
+        weight = route->weight;
+        edges.resize(route->edge_count);
+        for (size_t i = 0; i < route->edge_count; ++i) {
+            edges[i] = router->GetRouteEdge(route->id, i);
+        }
+        router->ReleaseRoute(route->id);
+    }
+    return MakeRouteAnswer(weight, edges);
+}
+
+RouteAnswerHolder TransportSystem::FindRoute(Stop::ID from, Stop::ID to) const {
+    const RouteCache::Key key = {from, to};
+    if (auto cached = route_cache_.Get(key)) {
+        return *cached;
     }
+    RouteAnswerHolder answer = ComputeRoute(from, to);
+    route_cache_.Put(key, answer);
+    return answer;
+}
+
+vector<RouteAnswerHolder> TransportSystem::FindRoutes(Stop::ID from, const vector<Stop::ID>& to) const {
+    vector<RouteAnswerHolder> answers(to.size());
+    vector<size_t> missing;
+    for (size_t i = 0; i < to.size(); ++i) {
+        if (auto cached = route_cache_.Get({from, to[i]})) {
+            answers[i] = *cached;
+        } else {
+            missing.push_back(i);
+        }
+    }
+    if (missing.empty()) {
+        return answers;
+    }
+
+    if (IsSearchRouter() && missing.size() > 1) {
+        const auto tree = [this, from] {
+            METRICS_TIMER(BUILD_ROUTE);
+            MEMORY_SCOPE(ROUTER);
+            return GetComponentRouter().BuildTree(from);
+        }();
+        for (const size_t i : missing) {
+            if (auto weight = tree.GetWeight(to[i])) {
+                answers[i] = MakeRouteAnswer(*weight, tree.GetRouteEdges(to[i]));
+            }
+        }
+    } else {
+        for (const size_t i : missing) {
+            answers[i] = ComputeRoute(from, to[i]);
+        }
+    }
+    for (const size_t i : missing) {
+        route_cache_.Put({from, to[i]}, answers[i]);
+    }
+    return answers;
+}
+
+vector<double> TransportSystem::GetTravelTimes(const vector<Stop::ID>& from, const vector<Stop::ID>& to, size_t thread_count) const {
+    vector<double> times(from.size() * to.size(), numeric_limits<double>::infinity());
+    ParallelFor(from.size(), thread_count, [&](size_t row) {
+        double* row_times = times.data() + row * to.size();
+        if (IsSearchRouter()) {
+            const auto tree = GetComponentRouter().BuildTree(from[row]);
+            for (size_t col = 0; col < to.size(); ++col) {
+                if (auto weight = tree.GetWeight(to[col])) {
+                    row_times[col] = *weight;
+                }
+            }
+        } else {
+            for (size_t col = 0; col < to.size(); ++col) {
+                if (auto weight = router->GetRouteWeight(from[row], to[col])) {
+                    row_times[col] = *weight;
+                }
+            }
+        }
+    });
+    return times;
+}
+
+vector<pair<Stop::ID, double>> TransportSystem::FindStopsWithin(Stop::ID from, double max_time, size_t max_count) const {
+    // Vertex ids are stop ids.
+    return GetComponentRouter().FindVerticesWithin(from, max_time, max_count);
+}
+
+static const uint32_t SNAPSHOT_MAGIC = 0x504e5354;  // "TSNP"
+static const uint32_t SNAPSHOT_VERSION = 7;
+
+// A snapshot is a header followed by sections at 64-byte aligned offsets.
+// Only META is parsed on load; every other section is a flat array of
+// plain structs, or arrays of Serialization::ArrayWriter, that the graph
+// and router use where it lies. Only COMPONENTS is copied.
+enum SnapshotSection {
+    META,               // parameters, stops, buses and component counts
+    EDGES,              // Graph::Edge<double>[edge_count]
+    INCIDENCE_OFFSETS,  // uint64_t[vertex_count + 1]
+    INCIDENCE_EDGES,    // Graph::EdgeId[edge_count]
+    EDGE_DESCRIPTIONS,  // EdgeDescription[edge_count]
+    VERTEX_RANKS,       // uint32_t[vertex_count], vertex order inside the router
+    COMPONENTS,         // weak and strong components, local vertex and edge ids
+    PARTS,              // of every part: its vertices, edges and graph, then
+                        // the data of its router, see SavePartRouter
+    PART_OFFSETS,       // uint64_t[component_count + 1], where the parts start
+    SECTION_COUNT
+};
+
+struct SnapshotHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t section_offsets[SECTION_COUNT];
+    uint64_t section_sizes[SECTION_COUNT];
+};
+
+static const size_t SNAPSHOT_ALIGNMENT = 64;
+
+// Edges and incidence lists of a graph in the form the graph views them.
+struct GraphArrays {
+    vector<Graph::Edge<double>> edges;
+    vector<uint64_t> incidence_offsets;
+    vector<Graph::EdgeId> incidence_edges;
+};
+
+static GraphArrays GetGraphArrays(const Graph::DirectedWeightedGraph<double>& graph) {
+    const size_t vertex_count = graph.GetVertexCount();
+    GraphArrays arrays;
+    arrays.edges.resize(graph.GetEdgeCount());
+    for (size_t edge_id = 0; edge_id < arrays.edges.size(); ++edge_id) {
+        arrays.edges[edge_id] = graph.GetEdge(edge_id);
+    }
+    arrays.incidence_offsets.resize(vertex_count + 1);
+    arrays.incidence_edges.reserve(arrays.edges.size());
+    for (Graph::VertexId vertex = 0; vertex < vertex_count; ++vertex) {
+        for (const auto edge_id : graph.GetIncidentEdges(vertex)) {
+            arrays.incidence_edges.push_back(edge_id);
+        }
+        arrays.incidence_offsets[vertex + 1] = arrays.incidence_edges.size();
+    }
+    return arrays;
+}
+
+// Matrix of an all-pairs router, hub vertices and labels of a hub label
+// router, landmarks and their distances of an ALT router. The others have
+// nothing to save.
+static void SavePartRouter(TransportSystem::RouterType router_type, const Graph::RouterBase<double>& router,
+                           Serialization::ArrayWriter& arrays) {
+    using RouterType = TransportSystem::RouterType;
+    switch (router_type) {
+        case RouterType::ALL_PAIRS:
+            arrays.Write(static_cast<const Graph::Router<double>&>(router).GetRoutesInternalData());
+            break;
+        case RouterType::HUB_LABELS: {
+            const auto& labels = static_cast<const Graph::HubLabelRouter<double>&>(router).GetLabels();
+            arrays.Write(labels.hub_vertices);
+            for (const auto* label_set : {&labels.forward, &labels.backward}) {
+                arrays.Write(label_set->offsets);
+                arrays.Write(label_set->hubs);
+                arrays.Write(label_set->weights);
+                arrays.Write(label_set->edges);
+            }
+            break;
+        }
+        case RouterType::ALT: {
+            const auto& landmarks = static_cast<const Graph::AltRouter<double>&>(router).GetLandmarkDistances();
+            arrays.Write(landmarks.vertices);
+            arrays.Write(landmarks.from_landmark);
+            arrays.Write(landmarks.to_landmark);
+            break;
+        }
+        case RouterType::DIJKSTRA:
+        case RouterType::BIDIRECTIONAL_DIJKSTRA:
+            break;
+    }
+}
+
+// Views the data SavePartRouter wrote.
+static unique_ptr<Graph::RouterBase<double>> LoadPartRouter(TransportSystem::RouterType router_type,
+                                                           const Graph::DirectedWeightedGraph<double>& graph,
+                                                           Serialization::ArrayReader& arrays) {
+    using RouterType = TransportSystem::RouterType;
+    const size_t vertex_count = graph.GetVertexCount();
+    switch (router_type) {
+        case RouterType::ALL_PAIRS: {
+            auto routes = arrays.Read<Graph::Router<double>::RouteInternalData>();
+            if (routes.size() != vertex_count * vertex_count) {
+                throw runtime_error("corrupted snapshot routes");
+            }
+            return make_unique<Graph::Router<double>>(graph, move(routes));
+        }
+        case RouterType::HUB_LABELS: {
+            auto labels = make_shared<Graph::HubLabelRouter<double>::Labels>();
+            labels->hub_vertices = arrays.Read<Graph::VertexId>();
+            for (auto* label_set : {&labels->forward, &labels->backward}) {
+                label_set->offsets = arrays.Read<uint64_t>();
+                label_set->hubs = arrays.Read<uint32_t>();
+                label_set->weights = arrays.Read<double>();
+                label_set->edges = arrays.Read<Graph::EdgeId>();
+                const size_t entry_count = label_set->hubs.size();
+                if (label_set->offsets.size() != vertex_count + 1 || label_set->offsets[vertex_count] != entry_count
+                        || label_set->weights.size() != entry_count || label_set->edges.size() != entry_count) {
+                    throw runtime_error("corrupted snapshot labels");
+                }
+            }
+            if (labels->hub_vertices.size() != vertex_count) {
+                throw runtime_error("corrupted snapshot labels");
+            }
+            return make_unique<Graph::HubLabelRouter<double>>(graph, move(labels));
+        }
+        case RouterType::ALT: {
+            auto landmarks = make_shared<Graph::AltRouter<double>::Landmarks>();
+            landmarks->vertices = arrays.Read<Graph::VertexId>();
+            landmarks->from_landmark = arrays.Read<double>();
+            landmarks->to_landmark = arrays.Read<double>();
+            const size_t distance_count = vertex_count * landmarks->vertices.size();
+            if (landmarks->from_landmark.size() != distance_count || landmarks->to_landmark.size() != distance_count) {
+                throw runtime_error("corrupted snapshot landmarks");
+            }
+            return make_unique<Graph::AltRouter<double>>(graph, move(landmarks));
+        }
+        case RouterType::DIJKSTRA:
+        case RouterType::BIDIRECTIONAL_DIJKSTRA:
+            break;
+    }
+    return GetRouterFactory(router_type)(graph, 0);
+}
+
+void TransportSystem::SaveSnapshot(ostream& output) const {
+    TRACE_SCOPE("SaveSnapshot");
+    using namespace Serialization;
+
+    stringstream meta;
+    WriteValue(meta, WaitTime);
+    WriteValue(meta, Velocity);
+    WriteValue<uint8_t>(meta, static_cast<uint8_t>(router_type_));
+    WriteValue<uint8_t>(meta, static_cast<uint8_t>(vertex_order_));
+
+    WriteValue<uint64_t>(meta, stops_.size());
+    for (const auto& stop : stops_) {
+        WriteString(meta, stop->name);
+        WriteValue(meta, stop->lat);
+        WriteValue(meta, stop->lon);
+        WriteValue<uint64_t>(meta, stop->distances.size());
+        for (const auto& [other_stop_name, distance] : stop->distances) {
+            WriteString(meta, other_stop_name);
+            WriteValue(meta, distance);
+        }
+    }
+
+    WriteValue<uint64_t>(meta, buses_.size());
     for (const auto& bus : buses_) {
-        bus->AddRouteToGraph(graph_, Velocity, edges_description);
+        WriteString(meta, bus->name);
+        WriteValue<uint8_t>(meta, dynamic_cast<const RoundBus*>(bus.get()) != nullptr);
+        WriteValue<uint64_t>(meta, bus->stops.size());
+        for (const auto& stop : bus->stops) {
+            WriteValue<uint64_t>(meta, stop->id);
+        }
+    }
+    const auto& component_router = GetComponentRouter();
+    const auto& components = component_router.GetComponents();
+    WriteValue<uint64_t>(meta, components.weak_count);
+    WriteValue<uint64_t>(meta, components.strong_count);
+    WriteValue<uint64_t>(meta, component_router.GetPrunedEdgeCount());
+    const string meta_bytes = meta.str();
+
+    const GraphArrays graph = GetGraphArrays(*graph_);
+
+    // Every section is written from one or more pieces, the component
+    // matrices are not copied together.
+    using Piece = pair<const char*, size_t>;
+    vector<Piece> sections[SECTION_COUNT] = {
+        {{meta_bytes.data(), meta_bytes.size()}},
+        {{reinterpret_cast<const char*>(graph.edges.data()), graph.edges.size() * sizeof(Graph::Edge<double>)}},
+        {{reinterpret_cast<const char*>(graph.incidence_offsets.data()), graph.incidence_offsets.size() * sizeof(uint64_t)}},
+        {{reinterpret_cast<const char*>(graph.incidence_edges.data()), graph.incidence_edges.size() * sizeof(Graph::EdgeId)}},
+        {{reinterpret_cast<const char*>(edges_description.data()), edges_description.size() * sizeof(EdgeDescription)}},
+        {},
+        {},
+        {},
+        {}
+    };
+    // The routers were built over the vertex order and the components of
+    // their time, later stops included, so these are saved rather than
+    // computed again.
+    const auto& vertex_ranks = component_router.GetVertexRanks();
+    sections[VERTEX_RANKS].push_back({reinterpret_cast<const char*>(vertex_ranks.data()),
+                                      vertex_ranks.size() * sizeof(uint32_t)});
+    ArrayWriter component_arrays;
+    component_arrays.Write(components.weak);
+    component_arrays.Write(components.strong);
+    component_arrays.Write(component_router.GetLocalVertices());
+    component_arrays.Write(component_router.GetLocalEdges());
+    sections[COMPONENTS] = component_arrays.GetPieces();
+
+    ArrayWriter part_arrays;
+    deque<GraphArrays> part_graphs;
+    vector<uint64_t> part_offsets = {0};
+    for (size_t component = 0; component < component_router.GetComponentCount(); ++component) {
+        if (const auto* part = component_router.GetPart(component)) {
+            const auto& part_graph = part_graphs.emplace_back(GetGraphArrays(part->graph));
+            part_arrays.Write(part->vertices);
+            part_arrays.Write(part->edges);
+            part_arrays.Write(part_graph.edges);
+            part_arrays.Write(part_graph.incidence_offsets);
+            part_arrays.Write(part_graph.incidence_edges);
+            SavePartRouter(router_type_, *part->router, part_arrays);
+        }
+        part_offsets.push_back(part_arrays.size());
     }
-    router = make_unique<Graph::Router<double>>(*graph_.get());
+    sections[PARTS] = part_arrays.GetPieces();
+    sections[PART_OFFSETS].push_back({reinterpret_cast<const char*>(part_offsets.data()),
+                                      part_offsets.size() * sizeof(uint64_t)});
+    SnapshotHeader header = {SNAPSHOT_MAGIC, SNAPSHOT_VERSION, {}, {}};
+    for (size_t section = 0; section < SECTION_COUNT; ++section) {
+        for (const auto& [data, size] : sections[section]) {
+            header.section_sizes[section] += size;
+        }
+    }
+
+    uint64_t offset = sizeof(header);
+    for (size_t section = 0; section < SECTION_COUNT; ++section) {
+        offset = (offset + SNAPSHOT_ALIGNMENT - 1) / SNAPSHOT_ALIGNMENT * SNAPSHOT_ALIGNMENT;
+        header.section_offsets[section] = offset;
+        offset += header.section_sizes[section];
+    }
+
+    WriteValue(output, header);
+    uint64_t position = sizeof(header);
+    for (size_t section = 0; section < SECTION_COUNT; ++section) {
+        const string padding(header.section_offsets[section] - position, '\0');
+        output.write(padding.data(), padding.size());
+        for (const auto& [data, size] : sections[section]) {
+            output.write(data, size);
+        }
+        position = header.section_offsets[section] + header.section_sizes[section];
+    }
+}
+
+void TransportSystem::LoadSnapshot(istream& input) {
+    LoadSnapshot(Serialization::Buffer::ReadStream(input));
+}
+
+void TransportSystem::MapSnapshot(const string& path) {
+    LoadSnapshot(Serialization::Buffer::MapFile(path));
+}
+
+template <typename T>
+static FlatArray<T> GetSnapshotSection(const Serialization::Buffer& snapshot, const SnapshotHeader& header,
+                                       SnapshotSection section) {
+    const uint64_t offset = header.section_offsets[section];
+    const uint64_t size = header.section_sizes[section];
+    if (offset > snapshot.size() || size > snapshot.size() - offset
+            || offset % alignof(T) != 0 || size % sizeof(T) != 0) {
+        throw runtime_error("corrupted snapshot section " + to_string(section));
+    }
+    return FlatArray<T>(reinterpret_cast<const T*>(snapshot.data() + offset), size / sizeof(T));
+}
+
+template <typename T>
+static vector<T> CopyArray(const FlatArray<T>& values) {
+    return {values.begin(), values.end()};
+}
+
+void TransportSystem::LoadSnapshot(shared_ptr<const Serialization::Buffer> snapshot) {
+    TRACE_SCOPE("LoadSnapshot");
+    using namespace Serialization;
+    if (snapshot->size() < sizeof(SnapshotHeader)) {
+        throw runtime_error("not a transport system snapshot");
+    }
+    const auto& header = *reinterpret_cast<const SnapshotHeader*>(snapshot->data());
+    if (header.magic != SNAPSHOT_MAGIC) {
+        throw runtime_error("not a transport system snapshot");
+    }
+    if (header.version != SNAPSHOT_VERSION) {
+        throw runtime_error("unsupported snapshot version " + to_string(header.version));
+    }
+
+    const auto meta_bytes = GetSnapshotSection<char>(*snapshot, header, META);
+    MemoryStreamBuf meta_buf(meta_bytes.data(), meta_bytes.size());
+    istream meta(&meta_buf);
+
+    const double wait_time = ReadValue<double>(meta);
+    const double velocity = ReadValue<double>(meta);
+    SetParams(wait_time, velocity);
+    const auto router_type = ReadValue<uint8_t>(meta);
+    if (router_type > static_cast<uint8_t>(RouterType::BIDIRECTIONAL_DIJKSTRA)) {
+        throw runtime_error("corrupted snapshot router type");
+    }
+    const auto vertex_order = ReadValue<uint8_t>(meta);
+    if (vertex_order > static_cast<uint8_t>(VertexOrder::HILBERT)) {
+        throw runtime_error("corrupted snapshot vertex order");
+    }
+    SetRouterType(static_cast<RouterType>(router_type));
+    SetVertexOrder(static_cast<VertexOrder>(vertex_order));
+
+    for (uint64_t stop_count = ReadValue<uint64_t>(meta); stop_count > 0; --stop_count) {
+        string name = ReadString(meta);
+        const double lat = ReadValue<double>(meta);
+        const double lon = ReadValue<double>(meta);
+        unordered_map<string, double> distances;
+        for (uint64_t count = ReadValue<uint64_t>(meta); count > 0; --count) {
+            string other_stop_name = ReadString(meta);
+            distances[move(other_stop_name)] = ReadValue<double>(meta);
+        }
+        AddStop(name, lat, lon, move(distances));
+    }
+
+    for (uint64_t bus_count = ReadValue<uint64_t>(meta); bus_count > 0; --bus_count) {
+        string name = ReadString(meta);
+        const bool is_roundtrip = ReadValue<uint8_t>(meta);
+        vector<string> route(ReadValue<uint64_t>(meta));
+        for (auto& stop_name : route) {
+            stop_name = GetStop(ReadValue<uint64_t>(meta))->name;
+        }
+        if (is_roundtrip) {
+            AddRoundBus(name, route);
+        } else {
+            AddStraightBus(name, route);
+        }
+    }
+    Graph::ComponentRouter<double>::Layout layout;
+    layout.components.weak_count = ReadValue<uint64_t>(meta);
+    layout.components.strong_count = ReadValue<uint64_t>(meta);
+    layout.pruned_edge_count = ReadValue<uint64_t>(meta);
+
+    graph_ = make_unique<Graph::DirectedWeightedGraph<double>>(
+            GetSnapshotSection<Graph::Edge<double>>(*snapshot, header, EDGES),
+            GetSnapshotSection<uint64_t>(*snapshot, header, INCIDENCE_OFFSETS),
+            GetSnapshotSection<Graph::EdgeId>(*snapshot, header, INCIDENCE_EDGES));
+    edges_description = GetSnapshotSection<EdgeDescription>(*snapshot, header, EDGE_DESCRIPTIONS);
+
+    const auto vertex_ranks = GetSnapshotSection<uint32_t>(*snapshot, header, VERTEX_RANKS);
+    vector<uint32_t> ranks(vertex_ranks.data(), vertex_ranks.data() + vertex_ranks.size());
+
+    const auto component_bytes = GetSnapshotSection<char>(*snapshot, header, COMPONENTS);
+    ArrayReader component_arrays(component_bytes.data(), component_bytes.size());
+    layout.components.weak = CopyArray(component_arrays.Read<uint32_t>());
+    layout.components.strong = CopyArray(component_arrays.Read<uint32_t>());
+    layout.local_vertices = CopyArray(component_arrays.Read<Graph::VertexId>());
+    layout.local_edges = CopyArray(component_arrays.Read<Graph::EdgeId>());
+
+    using Part = Graph::ComponentRouter<double>::Part;
+    const auto part_bytes = GetSnapshotSection<char>(*snapshot, header, PARTS);
+    const auto part_offsets = GetSnapshotSection<uint64_t>(*snapshot, header, PART_OFFSETS);
+    if (part_offsets.size() != layout.components.weak_count + 1) {
+        throw runtime_error("corrupted snapshot parts");
+    }
+    // Left at the router data of every part.
+    vector<ArrayReader> router_arrays;
+    layout.parts.resize(layout.components.weak_count);
+    for (size_t component = 0; component < layout.parts.size(); ++component) {
+        const uint64_t begin = part_offsets[component];
+        const uint64_t end = part_offsets[component + 1];
+        if (begin > end || end > part_bytes.size() || begin % sizeof(uint64_t) != 0) {
+            throw runtime_error("corrupted snapshot parts");
+        }
+        ArrayReader arrays(part_bytes.data() + begin, end - begin);
+        router_arrays.push_back(arrays);
+        if (begin == end) {
+            continue;
+        }
+        auto vertices = arrays.Read<Graph::VertexId>();
+        auto edges = arrays.Read<Graph::EdgeId>();
+        auto graph_edges = arrays.Read<Graph::Edge<double>>();
+        auto incidence_offsets = arrays.Read<uint64_t>();
+        auto incidence_edges = arrays.Read<Graph::EdgeId>();
+        if (incidence_offsets.size() != vertices.size() + 1 || graph_edges.size() != edges.size()
+                || incidence_edges.size() != edges.size()) {
+            throw runtime_error("corrupted snapshot parts");
+        }
+        layout.parts[component] = make_shared<Part>(Part{
+            Graph::DirectedWeightedGraph<double>(move(graph_edges), move(incidence_offsets), move(incidence_edges)),
+            move(vertices), move(edges), nullptr});
+        router_arrays.back() = arrays;
+    }
+    const auto load = [this, &router_arrays](const Graph::DirectedWeightedGraph<double>& graph, size_t component) {
+        auto& arrays = router_arrays[component];
+        auto part_router = LoadPartRouter(router_type_, graph, arrays);
+        if (!arrays.AtEnd()) {
+            throw runtime_error("corrupted snapshot parts");
+        }
+        return part_router;
+    };
+    router = make_unique<Graph::ComponentRouter<double>>(*graph_, GetRouterFactory(router_type_), load, move(layout),
+                                                         move(ranks), GetEdgeOrder());
+    IndexBusEdges();
+    graph_changes_.Reset(graph_->GetVertexCount());
+    snapshot_ = move(snapshot);
 }
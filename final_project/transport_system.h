@@ -1,13 +1,26 @@
 #pragma once
 #include "router.h"
+#include "dijkstra.h"
+#include "alt.h"
+#include "bidirectional_dijkstra.h"
+#include "components.h"
+#include "vertex_order.h"
+#include "hub_labels.h"
 #include "json.h"
+#include "parallel.h"
+#include "route_cache.h"
+#include "serialization.h"
+#include "flat_array.h"
+#include <cstdint>
 #include <unordered_map>
 #include <set>
 #include <string>
 #include <vector>
 #include <memory>
 #include <iostream>
+#include <limits>
 #include <optional>
+#include <utility>
 
 struct Stop {
     using ID = size_t;
@@ -25,8 +38,23 @@ struct Stop {
         {}
 };
 
-double CalculateGeoDistance(std::shared_ptr<Stop> left, std::shared_ptr<Stop> right);
-double CalculateStopsDistance(std::shared_ptr<Stop> left, std::shared_ptr<Stop> right);
+double CalculateGeoDistance(const std::shared_ptr<Stop>& left, const std::shared_ptr<Stop>& right);
+double CalculateStopsDistance(const std::shared_ptr<Stop>& left, const std::shared_ptr<Stop>& right);
+
+// What a graph edge stands for: a wait at the stop it starts from and a
+// ride of span_count stops on one bus. It is rendered into a Wait and a Bus
+// route item on demand and has no pointers, so snapshots keep it as a flat
+// array.
+struct EdgeDescription {
+    uint64_t bus_id;
+    uint64_t span_count;
+    double time;  // on the bus, the edge weight adds the wait
+};
+
+struct RouteEdge {
+    Graph::Edge<double> edge;
+    EdgeDescription description;
+};
 
 struct Bus {
     using ID = size_t;
@@ -59,7 +87,8 @@ struct Bus {
         return RouteLength() / GeoRouteLength();
     }
 
-    virtual void AddRouteToGraph(std::unique_ptr<Graph::DirectedWeightedGraph<double>>& graph, double velocity, std::unordered_map<size_t, Json::Node>& edges_description) const = 0;
+    virtual void CollectRouteEdges(double wait_time, double velocity, std::vector<RouteEdge>& edges) const = 0;
+    virtual std::shared_ptr<Bus> Clone() const = 0;
 };
 
 struct RoundBus : Bus {
@@ -91,7 +120,10 @@ struct RoundBus : Bus {
         return result;
     }
 
-    virtual void AddRouteToGraph(std::unique_ptr<Graph::DirectedWeightedGraph<double>>& graph, double velocity, std::unordered_map<size_t, Json::Node>& edges_description) const override;
+    void CollectRouteEdges(double wait_time, double velocity, std::vector<RouteEdge>& edges) const override;
+    std::shared_ptr<Bus> Clone() const override {
+        return std::make_shared<RoundBus>(*this);
+    }
 };
 
 struct StraightBus : Bus {
@@ -124,13 +156,34 @@ struct StraightBus : Bus {
         return result;
     }
 
-    virtual void AddRouteToGraph(std::unique_ptr<Graph::DirectedWeightedGraph<double>>& graph, double velocity, std::unordered_map<size_t, Json::Node>& edges_description) const override;
+    void CollectRouteEdges(double wait_time, double velocity, std::vector<RouteEdge>& edges) const override;
+    std::shared_ptr<Bus> Clone() const override {
+        return std::make_shared<StraightBus>(*this);
+    }
 };
 
 class TransportSystem {
+public:
+    enum class RouterType {
+        ALL_PAIRS,  // precomputed Graph::Router, the default
+        DIJKSTRA,   // one search per query or per batch source
+        HUB_LABELS, // two-hop labels, far smaller than the all-pairs matrix
+        ALT,        // A* over landmark distances, linear in the vertex count
+        BIDIRECTIONAL_DIJKSTRA  // two meeting searches per query, nothing precomputed
+    };
+    // Order of the stops inside the router, stop ids stay as they are.
+    enum class VertexOrder {
+        INPUT,          // by stop id, the order of first mention
+        BREADTH_FIRST,
+        CUTHILL_MCKEE,  // reverse Cuthill-McKee
+        HILBERT         // along a Hilbert curve over the coordinates
+    };
+
 private:
     double WaitTime = 0.0;
     double Velocity = 1.0;
+    RouterType router_type_ = RouterType::ALL_PAIRS;
+    VertexOrder vertex_order_ = VertexOrder::INPUT;
 
     std::vector<std::shared_ptr<Stop>> stops_;
     std::unordered_map<std::string, std::shared_ptr<Stop>> name_to_stop_;
@@ -141,15 +194,34 @@ private:
     std::unordered_map<std::string, std::vector<std::shared_ptr<Bus>>> stop_to_buses_;
 
     std::unique_ptr<Graph::DirectedWeightedGraph<double>> graph_;
-    std::unordered_map<size_t, Json::Node> edges_description;
+    FlatArray<EdgeDescription> edges_description;
+    // First edge id and edge count of every bus, its edges are contiguous.
+    std::vector<std::pair<size_t, size_t>> bus_edge_ranges_;
+    // Changes made to the built graph that the router has not seen yet.
+    Graph::GraphChanges<double> graph_changes_;
+
+    // Keeps a loaded snapshot alive while the graph and router use it in place.
+    std::shared_ptr<const Serialization::Buffer> snapshot_;
+
+    RouteCache route_cache_;
+
+    // Set once Clone() shares the stops and buses with another copy, after
+    // that they are replaced instead of being changed in place.
+    mutable bool shares_network_ = false;
 
 public:
-    std::unique_ptr<Graph::Router<double>> router;
+    std::unique_ptr<Graph::RouterBase<double>> router;
 
 public:
+    // Every edge weight depends on the parameters, so a built graph is
+    // rebuilt from scratch.
     void SetParams(double wait_time, double velocity) {
+        route_cache_.Clear();
         WaitTime = wait_time;
         Velocity = velocity;
+        if (graph_) {
+            BuildGraph();
+        }
     }
     double GetWaitTime() const {
         return WaitTime;
@@ -157,9 +229,26 @@ public:
     double GetVelocity() const {
         return Velocity;
     }
-    Json::Node GetEdgeDescription(size_t id) const {
-        return edges_description.at(id);
+    void SetRouterType(RouterType router_type) {
+        router_type_ = router_type;
     }
+    RouterType GetRouterType() const {
+        return router_type_;
+    }
+    // Takes effect with the next router built.
+    void SetVertexOrder(VertexOrder vertex_order) {
+        vertex_order_ = vertex_order;
+    }
+    VertexOrder GetVertexOrder() const {
+        return vertex_order_;
+    }
+    // Routers without precomputed data, which answer many targets at once
+    // faster with one shortest path tree than with a query per target.
+    bool IsSearchRouter() const {
+        return router_type_ == RouterType::DIJKSTRA || router_type_ == RouterType::BIDIRECTIONAL_DIJKSTRA;
+    }
+    // Wait and Bus route items of an edge.
+    void RenderEdge(Graph::EdgeId id, std::vector<Json::Node>& items) const;
 
     std::shared_ptr<Stop> AddDummyStop(const std::string& stop_name);
     std::shared_ptr<Stop> AddStop(const std::string& stop_name, double lat, double lon,
@@ -174,7 +263,69 @@ public:
     std::shared_ptr<Bus> GetBus(Bus::ID id) const;
     std::shared_ptr<Bus> GetBus(const std::string& bus_name) const;
 
-    void BuildGraph();
+    // Answers are cached until the next change of the network.
+    RouteAnswerHolder FindRoute(Stop::ID from, Stop::ID to) const;
+    // Same as FindRoute for every target, but a search-based router answers
+    // all of them from one shortest path tree.
+    std::vector<RouteAnswerHolder> FindRoutes(Stop::ID from, const std::vector<Stop::ID>& to) const;
+    // Dense row-major matrix of route times, infinity where there is no route.
+    // Routes are not expanded, so nothing is rendered or cached.
+    std::vector<double> GetTravelTimes(const std::vector<Stop::ID>& from, const std::vector<Stop::ID>& to,
+                                       size_t thread_count = DefaultThreadCount()) const;
+    // Stops with a route from "from" of at most max_time, the start itself
+    // included, and the times of their routes. Nearest first, at most
+    // max_count of them. One search whatever the router, over the same
+    // pruned component graphs as routes.
+    std::vector<std::pair<Stop::ID, double>> FindStopsWithin(Stop::ID from, double max_time,
+                                                             size_t max_count = std::numeric_limits<size_t>::max()) const;
+    void SetRouteCacheCapacity(size_t capacity) {
+        route_cache_.SetCapacity(capacity);
+    }
+    RouteCache::Stats GetRouteCacheStats() const {
+        return route_cache_.GetStats();
+    }
+
+    // Stops and buses added or changed after BuildGraph are applied to the
+    // graph and the router right away, without building them again.
+    void BuildGraph(size_t thread_count = DefaultThreadCount());
+    // Builds the router of the current type over the built graph again, one
+    // per connected component. BuildGraph already does it, alone it times
+    // router construction.
+    void MakeRouter();
+    // Bus edges the router leaves out for a faster or equal one between the
+    // same stops, 0 without a built graph.
+    size_t GetPrunedEdgeCount() const;
+
+    // Copy to be changed while this system keeps serving queries. Stops,
+    // buses, the graph storage and the router data are shared until the
+    // copy changes them, and the copy starts with an empty route cache.
+    std::unique_ptr<TransportSystem> Clone() const;
+
+    // Binary snapshot of a system with a built graph. Loading restores the
+    // stops, buses, graph and router without rebuilding any of them, and
+    // expects an empty TransportSystem. A mapped snapshot is used in place:
+    // the graph, edge descriptions and router matrix are never copied.
+    void SaveSnapshot(std::ostream& output) const;
+    void LoadSnapshot(std::istream& input);
+    void MapSnapshot(const std::string& path);
 private:
+    std::shared_ptr<Stop> InsertDummyStop(const std::string& stop_name);
     std::vector<std::shared_ptr<Stop>> AddDummyStops(const std::vector<std::string>& route);
+    std::shared_ptr<Bus> InsertBus(std::shared_ptr<Bus> bus, const std::vector<std::string>& route);
+    void ReplaceStop(std::shared_ptr<Stop> stop);
+
+    void AddStopToGraph();
+    void AddBusToGraph(const Bus& bus);
+    void UpdateBusEdges(const Bus& bus);
+    void IndexBusEdges();
+    void CommitGraphChanges();
+
+    std::vector<uint32_t> ComputeVertexRanks() const;
+    Graph::ComponentRouter<double>::EdgeOrder GetEdgeOrder() const;
+    // The router is always one, whatever routers it runs per component.
+    const Graph::ComponentRouter<double>& GetComponentRouter() const;
+
+    RouteAnswerHolder ComputeRoute(Stop::ID from, Stop::ID to) const;
+    RouteAnswerHolder MakeRouteAnswer(double total_time, const std::vector<Graph::EdgeId>& edges) const;
+    void LoadSnapshot(std::shared_ptr<const Serialization::Buffer> snapshot);
 };
@@ -0,0 +1,51 @@
+#pragma once
+#include "transport_system.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+// Publishes immutable versions of a transport system. Readers pin the
+// current version and answer queries from it for as long as they hold it.
+// A writer changes a copy of the current version and then publishes it, so
+// readers never wait for updates. A version is freed when the last reader
+// pinning it lets it go.
+//
+// RequestServer answers every request from a pinned version and publishes
+// its update lines with Update.
+//
+// Pinning is not lock-free: std::atomic_load and std::atomic_store on a
+// shared_ptr take one of the small spin mutexes libstdc++ keeps for them,
+// picked by the address of current_. The mutex is held only to copy the
+// pointer and bump its count, never while a writer clones or changes a
+// version, so a reader waits at most for another pointer copy.
+class TransportSystemVersions {
+public:
+    using Version = std::shared_ptr<const TransportSystem>;
+
+    explicit TransportSystemVersions(std::unique_ptr<TransportSystem> initial)
+        : current_(std::move(initial))
+        {}
+
+    // Takes the pointer mutex for the copy, see above.
+    Version Pin() const {
+        return std::atomic_load(&current_);
+    }
+
+    // Calls update(TransportSystem&) on a copy of the current version and
+    // publishes the copy. Writers are applied one at a time.
+    template <typename Updater>
+    Version Update(Updater update) {
+        std::lock_guard<std::mutex> guard(writer_mutex_);
+        std::unique_ptr<TransportSystem> next = Pin()->Clone();
+        update(*next);
+        Version version(std::move(next));
+        std::atomic_store(&current_, version);
+        return version;
+    }
+
+private:
+    Version current_;
+    std::mutex writer_mutex_;
+};
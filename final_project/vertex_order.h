@@ -0,0 +1,103 @@
+#pragma once
+
+#include "graph.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+namespace Graph {
+
+    // Renumberings that put vertices close in the graph close in memory.
+    // Each returns the new position of every vertex, a permutation of
+    // [0, vertex_count). Edge directions are ignored.
+
+    namespace Detail {
+
+        // Breadth-first order over the undirected graph, a new search from
+        // every vertex not reached yet. Neighbors are visited in the order
+        // given by is_before, or as they are listed.
+        template <typename Weight, typename NeighborOrder>
+            std::vector<VertexId> BreadthFirstOrder(const DirectedWeightedGraph<Weight>& graph,
+                                                    const std::vector<VertexId>& roots, NeighborOrder is_before) {
+                const size_t vertex_count = graph.GetVertexCount();
+                const ReverseIncidence<Weight> reverse_incidence(graph);
+                std::vector<bool> is_reached(vertex_count);
+                std::vector<VertexId> order;
+                order.reserve(vertex_count);
+                std::vector<VertexId> neighbors;
+                for (const VertexId root : roots) {
+                    if (is_reached[root]) {
+                        continue;
+                    }
+                    is_reached[root] = true;
+                    order.push_back(root);
+                    for (size_t head = order.size() - 1; head < order.size(); ++head) {
+                        const VertexId vertex = order[head];
+                        neighbors.clear();
+                        for (const EdgeId edge_id : graph.GetIncidentEdges(vertex)) {
+                            neighbors.push_back(graph.GetEdge(edge_id).to);
+                        }
+                        for (const EdgeId edge_id : reverse_incidence.GetIncomingEdges(vertex)) {
+                            neighbors.push_back(graph.GetEdge(edge_id).from);
+                        }
+                        std::stable_sort(neighbors.begin(), neighbors.end(), is_before);
+                        for (const VertexId neighbor : neighbors) {
+                            if (!is_reached[neighbor]) {
+                                is_reached[neighbor] = true;
+                                order.push_back(neighbor);
+                            }
+                        }
+                    }
+                }
+                return order;
+            }
+
+        inline std::vector<uint32_t> OrderToRanks(const std::vector<VertexId>& order) {
+            std::vector<uint32_t> ranks(order.size());
+            for (size_t rank = 0; rank < order.size(); ++rank) {
+                ranks[order[rank]] = rank;
+            }
+            return ranks;
+        }
+
+    }
+
+    // Breadth-first order from vertex 0, then from the first vertex left.
+    template <typename Weight>
+        std::vector<uint32_t> ComputeBreadthFirstRanks(const DirectedWeightedGraph<Weight>& graph) {
+            std::vector<VertexId> roots(graph.GetVertexCount());
+            for (VertexId vertex = 0; vertex < roots.size(); ++vertex) {
+                roots[vertex] = vertex;
+            }
+            return Detail::OrderToRanks(Detail::BreadthFirstOrder(graph, roots, [](VertexId, VertexId) {
+                return false;
+            }));
+        }
+
+    // Reverse Cuthill-McKee: searches start from vertices of the lowest
+    // degree and take neighbors by increasing degree, which keeps the
+    // adjacency matrix close to its diagonal.
+    template <typename Weight>
+        std::vector<uint32_t> ComputeCuthillMcKeeRanks(const DirectedWeightedGraph<Weight>& graph) {
+            const size_t vertex_count = graph.GetVertexCount();
+            std::vector<size_t> degrees(vertex_count);
+            for (EdgeId edge_id = 0; edge_id < graph.GetEdgeCount(); ++edge_id) {
+                ++degrees[graph.GetEdge(edge_id).from];
+                ++degrees[graph.GetEdge(edge_id).to];
+            }
+            const auto is_before = [&degrees](VertexId lhs, VertexId rhs) {
+                return degrees[lhs] < degrees[rhs];
+            };
+            std::vector<VertexId> roots(vertex_count);
+            for (VertexId vertex = 0; vertex < vertex_count; ++vertex) {
+                roots[vertex] = vertex;
+            }
+            std::stable_sort(roots.begin(), roots.end(), is_before);
+            auto order = Detail::BreadthFirstOrder(graph, roots, is_before);
+            std::reverse(order.begin(), order.end());
+            return Detail::OrderToRanks(order);
+        }
+
+}